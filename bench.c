@@ -0,0 +1,479 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "process.h"
+#include "source.h"
+
+/* Default number of timed frames per run, untimed ones ahead of them */
+#define BENCH_ITERS  100
+#define BENCH_WARMUP 5
+/* Distinct frames cycled through, so caches do not see the same image */
+#define BENCH_FRAMES 8
+/* Frames in flight when measuring throughput */
+#define BENCH_DEPTH  4
+
+/* Resolutions of the synthetic sweep */
+static const uint32_t SIZES[][2] =
+{
+  { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 }
+};
+
+/* Frames of one input */
+struct input
+{
+  const char *name;
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  uint8_t *frames[BENCH_FRAMES];
+  uint32_t count;
+};
+
+/* Samples of one run, per frame */
+struct samples
+{
+  double *wall;
+  double *stages[STAGE_COUNT];
+};
+
+/**
+ * Returns a monotonic timestamp in seconds
+ */
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * Returns a percentile of the samples, sorting them in place
+ */
+static double
+percentile(double *samples, uint32_t count, double p)
+{
+  qsort(samples, count, sizeof(double), compare);
+  return samples[(size_t)(p * (count - 1) + 0.5)];
+}
+
+/**
+ * Draws RGBA frames with edges at all orientations moving between them
+ */
+static int
+initSynthetic(struct input *in, uint32_t width, uint32_t height)
+{
+  uint32_t i, x, y;
+  int32_t dx, dy, r;
+  uint8_t *p, v;
+
+  in->name = "synthetic";
+  in->width = width;
+  in->height = height;
+  in->format = V4L2_PIX_FMT_RGBA32;
+  in->count = BENCH_FRAMES;
+
+  srand(1);
+  for (i = 0; i < in->count; ++i)
+  {
+    if (!(p = in->frames[i] = (uint8_t*)malloc((size_t)width * height * 4)))
+    {
+      return 0;
+    }
+
+    /* Diagonal stripes, a disc and a box over a slight noise floor */
+    r = height / 4;
+    for (y = 0; y < height; ++y)
+    {
+      for (x = 0; x < width; ++x, p += 4)
+      {
+        dx = (int32_t)x - (int32_t)(width / 2 + i * 8);
+        dy = (int32_t)y - (int32_t)(height / 2);
+        v = ((x + y + i * 4) / 32) & 1 ? 160 : 96;
+        v = dx * dx + dy * dy < r * r ? 224 : v;
+        v = x > width / 8 && x < width / 4 && y > height / 8 &&
+            y < height / 2 + i * 4 ? 32 : v;
+        v += rand() & 7;
+        p[0] = p[1] = p[2] = v;
+        p[3] = 0xFF;
+      }
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Reads the first frames of a file, looped if it has fewer
+ */
+static int
+initFile(struct input *in, const char *path, uint32_t width, uint32_t height,
+         enum reader_format format)
+{
+  struct source src;
+  size_t size;
+
+  memset(&src, 0, sizeof(src));
+  src.path = path;
+  src.width = width;
+  src.height = height;
+  src.file.format = format;
+  src.fast = 1;
+  if (!initSource(&src) || src.type != SOURCE_FILE)
+  {
+    destroySource(&src);
+    return 0;
+  }
+
+  in->name = path;
+  in->width = src.width;
+  in->height = src.height;
+  in->format = src.format;
+  in->count = 0;
+
+  size = (size_t)src.width * src.height *
+         (src.format == V4L2_PIX_FMT_YUYV ? 2 : 4);
+  startSource(&src);
+  while (in->count < BENCH_FRAMES)
+  {
+    if (!(in->frames[in->count] = (uint8_t*)malloc(size)))
+    {
+      break;
+    }
+
+    if (!getFrame(&src, in->frames[in->count]))
+    {
+      free(in->frames[in->count]);
+      break;
+    }
+
+    in->count++;
+  }
+
+  destroySource(&src);
+  return in->count > 0;
+}
+
+static void
+destroyInput(struct input *in)
+{
+  uint32_t i;
+
+  for (i = 0; i < in->count; ++i)
+  {
+    free(in->frames[i]);
+  }
+
+  in->count = 0;
+}
+
+/**
+ * Fills the staging buffer of the next frame
+ */
+static void
+submitInput(struct process *proc, struct input *in, uint32_t i)
+{
+  size_t size;
+
+  size = (size_t)in->width * in->height *
+         (in->format == V4L2_PIX_FMT_YUYV ? 2 : 4);
+  memcpy(beginFrame(proc), in->frames[i % in->count], size);
+  submitFrame(proc, -1);
+}
+
+/**
+ * Writes the p50 and p99 of a set of samples in milliseconds
+ */
+static void
+writeStats(FILE *json, const char *name, double *samples, uint32_t count)
+{
+  fprintf(json, "\"%s\": { \"p50\": %.4f, \"p99\": %.4f }", name,
+          percentile(samples, count, 0.50) * 1e3,
+          percentile(samples, count, 0.99) * 1e3);
+}
+
+/**
+ * Times one input on one backend and appends the run to the report
+ * Latency is timed one frame at a time, throughput with frames in flight.
+ * @return 0 if the backend is not available
+ */
+static int
+runBench(FILE *json, int *first, struct input *in, enum backend backend,
+         uint32_t iters)
+{
+  struct process proc;
+  struct samples s;
+  double start, fps;
+  uint32_t i, j, n;
+  int ret;
+
+  memset(&proc, 0, sizeof(proc));
+  proc.platform = proc.device = -1;
+  proc.low = proc.high = -1.0f;
+  proc.width = in->width;
+  proc.height = in->height;
+  proc.format = in->format;
+  proc.backend = backend;
+  proc.headless = 1;
+  proc.profile = backend == BACKEND_OPENCL;
+  proc.depth = BENCH_DEPTH;
+
+  memset(&s, 0, sizeof(s));
+  ret = 0;
+  if (!initProcess(&proc))
+  {
+    goto done;
+  }
+
+  if (!(s.wall = (double*)calloc(iters, sizeof(double))))
+  {
+    goto done;
+  }
+
+  for (j = 0; j < STAGE_COUNT; ++j)
+  {
+    if (!(s.stages[j] = (double*)calloc(iters, sizeof(double))))
+    {
+      goto done;
+    }
+  }
+
+  /* Warm up, the first frames include lazy allocations and compiles */
+  for (i = 0; i < BENCH_WARMUP; ++i)
+  {
+    submitInput(&proc, in, i);
+    while (finishFrame(&proc, NULL));
+  }
+
+  for (i = 0; i < iters; ++i)
+  {
+    start = now();
+    submitInput(&proc, in, i);
+    while (finishFrame(&proc, NULL));
+    s.wall[i] = now() - start;
+
+    for (j = 0; j < STAGE_COUNT; ++j)
+    {
+      s.stages[j][i] = proc.times[j] * 1e-9;
+    }
+  }
+
+  /* Keep the ring full, only the first frames wait for nothing */
+  start = now();
+  for (i = n = 0; n < iters; ++i)
+  {
+    if (proc.pending == proc.depth || i >= iters)
+    {
+      finishFrame(&proc, NULL);
+      ++n;
+    }
+
+    if (i < iters)
+    {
+      submitInput(&proc, in, i);
+    }
+  }
+  fps = iters / (now() - start);
+
+  printf("%-24.24s %-6s %5ux%-5u %9.1f %9.3f %9.3f\n", in->name,
+         backend == BACKEND_CPU ? "cpu" : "opencl", in->width, in->height,
+         fps, percentile(s.wall, iters, 0.50) * 1e3,
+         percentile(s.wall, iters, 0.99) * 1e3);
+
+  fprintf(json, "%s\n    { \"input\": \"%s\", \"backend\": \"%s\", "
+          "\"width\": %u, \"height\": %u,\n      \"fps\": %.2f, "
+          "\"mpix_s\": %.2f, ", *first ? "" : ",", in->name,
+          backend == BACKEND_CPU ? "cpu" : "opencl", in->width, in->height,
+          fps, fps * in->width * in->height * 1e-6);
+  writeStats(json, "latency_ms", s.wall, iters);
+  fprintf(json, ",\n      \"stages_ms\": {");
+
+  /* Stages that never ran, such as the histogram with fixed thresholds,
+     are left out */
+  for (j = n = 0; j < STAGE_COUNT; ++j)
+  {
+    if (percentile(s.stages[j], iters, 1.0) <= 0.0)
+    {
+      continue;
+    }
+
+    fprintf(json, "%s\n        ", n++ ? "," : "");
+    writeStats(json, stageNames[j], s.stages[j], iters);
+  }
+  fprintf(json, "%s}\n    }", n ? "\n      " : " ");
+
+  *first = 0;
+  ret = 1;
+
+done:
+  free(s.wall);
+  for (j = 0; j < STAGE_COUNT; ++j)
+  {
+    free(s.stages[j]);
+  }
+
+  destroyProcess(&proc);
+  return ret;
+}
+
+/**
+ * Runs every input on every backend and writes a JSON report
+ */
+int
+main(int argc, char **argv)
+{
+  static struct option options[] =
+  {
+    { "iterations", required_argument, 0, 'n' },
+    { "output", required_argument, 0, 'o' },
+    { "backend", required_argument, 0, 'b' },
+    { "width", required_argument, 0, 'w' },
+    { "height", required_argument, 0, 'h' },
+    { "format", required_argument, 0, 'f' },
+    { 0, 0, 0, 0 }
+  };
+  enum backend backends[2] = { BACKEND_OPENCL, BACKEND_CPU };
+  enum reader_format format;
+  uint32_t iters, width, height, nbackends, i, j;
+  const char *output;
+  struct input in;
+  FILE *json;
+  int c, first, ret;
+
+  iters = BENCH_ITERS;
+  output = "canny-bench.json";
+  nbackends = 2;
+  width = 640;
+  height = 480;
+  format = READER_AUTO;
+  while ((c = getopt_long(argc, argv, "n:o:b:w:h:f:", options, NULL)) != -1)
+  {
+    switch (c)
+    {
+      case 'n':
+      {
+        iters = atoi(optarg);
+        break;
+      }
+      case 'o':
+      {
+        output = optarg;
+        break;
+      }
+      case 'b':
+      {
+        nbackends = 1;
+        if (!strcmp(optarg, "cpu"))
+        {
+          backends[0] = BACKEND_CPU;
+        }
+        else if (!strcmp(optarg, "all"))
+        {
+          nbackends = 2;
+        }
+        else if (strcmp(optarg, "opencl"))
+        {
+          fprintf(stderr, "Unknown backend '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case 'w':
+      {
+        width = atoi(optarg);
+        break;
+      }
+      case 'h':
+      {
+        height = atoi(optarg);
+        break;
+      }
+      case 'f':
+      {
+        if (!strcmp(optarg, "yuyv"))
+        {
+          format = READER_YUYV;
+        }
+        else if (!strcmp(optarg, "rgba"))
+        {
+          format = READER_RGBA;
+        }
+        else if (!strcmp(optarg, "y4m"))
+        {
+          format = READER_Y4M;
+        }
+        else
+        {
+          fprintf(stderr, "Unknown format '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      default:
+      {
+        fprintf(stderr, "Usage: %s [-n iterations] [-o report.json] "
+                "[-b opencl|cpu|all] [-w W -h H -f F] [file...]\n", argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  iters = iters ? iters : 1;
+  if (!(json = strcmp(output, "-") ? fopen(output, "w") : stdout))
+  {
+    fprintf(stderr, "Cannot open '%s'\n", output);
+    return EXIT_FAILURE;
+  }
+
+  fprintf(json, "{\n  \"iterations\": %u,\n  \"runs\": [", iters);
+  printf("%-24s %-6s %11s %9s %9s %9s\n", "input", "engine", "size", "fps",
+         "p50 ms", "p99 ms");
+
+  /* Synthetic sweep first, then the files at their own size */
+  ret = EXIT_SUCCESS;
+  first = 1;
+  for (i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]) + argc - optind; ++i)
+  {
+    memset(&in, 0, sizeof(in));
+    if (i < sizeof(SIZES) / sizeof(SIZES[0])
+        ? !initSynthetic(&in, SIZES[i][0], SIZES[i][1])
+        : !initFile(&in, argv[optind + i - sizeof(SIZES) / sizeof(SIZES[0])],
+                    width, height, format))
+    {
+      fprintf(stderr, "Cannot load input %u\n", i);
+      destroyInput(&in);
+      ret = EXIT_FAILURE;
+      continue;
+    }
+
+    for (j = 0; j < nbackends; ++j)
+    {
+      if (!runBench(json, &first, &in, backends[j], iters))
+      {
+        fprintf(stderr, "%s: %s backend not available\n", in.name,
+                backends[j] == BACKEND_CPU ? "cpu" : "opencl");
+      }
+    }
+
+    destroyInput(&in);
+  }
+
+  fprintf(json, "\n  ]\n}\n");
+  if (json != stdout)
+  {
+    fclose(json);
+  }
+
+  return ret;
+}
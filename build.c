@@ -0,0 +1,368 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "build.h"
+
+/* Largest number of devices a program is built for */
+#define BUILD_MAX_DEVICES 16
+
+/**
+ * Hashes a block of bytes into a running 64 bit FNV-1a hash
+ */
+static uint64_t
+hash(uint64_t h, const void *data, size_t size)
+{
+  const uint8_t *p = (const uint8_t*)data;
+
+  while (size--)
+  {
+    h = (h ^ *p++) * 0x100000001B3ULL;
+  }
+
+  return h;
+}
+
+/**
+ * Hashes a string property of a device or platform, including its end
+ */
+static uint64_t
+hashInfo(uint64_t h, cl_device_id dev, cl_platform_id platform,
+         cl_uint param)
+{
+  char info[1024];
+  cl_int err;
+
+  err = platform ? clGetPlatformInfo(platform, param, sizeof(info) - 1,
+                                     info, NULL)
+                 : clGetDeviceInfo(dev, param, sizeof(info) - 1, info, NULL);
+  info[err == CL_SUCCESS ? sizeof(info) - 1 : 0] = '\0';
+  return hash(h, info, strlen(info) + 1);
+}
+
+/**
+ * Resolves the cache directory and creates it
+ * @param dir Directory to use, NULL for the XDG cache, empty to disable
+ * @return 0 if there is no cache
+ */
+static int
+cacheDir(const char *dir, char *path, size_t size)
+{
+  const char *base;
+  int n;
+
+  if (dir && !*dir)
+  {
+    return 0;
+  }
+
+  if (dir)
+  {
+    n = snprintf(path, size, "%s", dir);
+  }
+  else if ((base = getenv("XDG_CACHE_HOME")) && *base)
+  {
+    n = snprintf(path, size, "%s/canny", base);
+  }
+  else if ((base = getenv("HOME")) && *base)
+  {
+    /* Parent first, it may not exist on fresh accounts */
+    n = snprintf(path, size, "%s/.cache", base);
+    if (n > 0 && (size_t)n < size)
+    {
+      mkdir(path, 0755);
+    }
+    n = snprintf(path, size, "%s/.cache/canny", base);
+  }
+  else
+  {
+    return 0;
+  }
+
+  if (n <= 0 || (size_t)n >= size)
+  {
+    return 0;
+  }
+
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+/**
+ * Returns the path of the cached binary of a device
+ * The key covers the source, the options, the device and its driver.
+ */
+static int
+cachePath(const char *dir, cl_device_id dev, const char *source,
+          size_t length, const char *options, char *path, size_t size)
+{
+  cl_platform_id platform;
+  uint64_t h;
+  int n;
+
+  if (clGetDeviceInfo(dev, CL_DEVICE_PLATFORM, sizeof(platform), &platform,
+                      NULL) != CL_SUCCESS)
+  {
+    return 0;
+  }
+
+  h = 0xCBF29CE484222325ULL;
+  h = hash(h, source, length);
+  h = hash(h, options, strlen(options) + 1);
+  h = hashInfo(h, dev, NULL, CL_DEVICE_NAME);
+  h = hashInfo(h, dev, NULL, CL_DEVICE_VERSION);
+  h = hashInfo(h, dev, NULL, CL_DRIVER_VERSION);
+  h = hashInfo(h, NULL, platform, CL_PLATFORM_NAME);
+  h = hashInfo(h, NULL, platform, CL_PLATFORM_VERSION);
+
+  n = snprintf(path, size, "%s/%016llx.bin", dir, (unsigned long long)h);
+  return n > 0 && (size_t)n < size;
+}
+
+/**
+ * Reads a whole cache file
+ * @return NULL if missing or empty
+ */
+static unsigned char *
+readBinary(const char *path, size_t *size)
+{
+  unsigned char *data;
+  struct stat st;
+  size_t done;
+  ssize_t ret;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+  {
+    return NULL;
+  }
+
+  data = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+      (data = (unsigned char*)malloc(st.st_size)))
+  {
+    for (done = 0; done < (size_t)st.st_size; done += ret)
+    {
+      if ((ret = read(fd, data + done, st.st_size - done)) <= 0)
+      {
+        if (ret < 0 && errno == EINTR)
+        {
+          ret = 0;
+          continue;
+        }
+
+        free(data);
+        data = NULL;
+        break;
+      }
+    }
+
+    *size = st.st_size;
+  }
+
+  close(fd);
+  return data;
+}
+
+/**
+ * Writes a cache file through a temporary one, so readers never see a
+ * partial binary, concurrent writers simply race to the same content
+ */
+static void
+writeBinary(const char *path, const unsigned char *data, size_t size)
+{
+  char tmp[PATH_MAX];
+  size_t done;
+  ssize_t ret;
+  int fd, n;
+
+  n = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  if (n <= 0 || (size_t)n >= sizeof(tmp) ||
+      (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+  {
+    return;
+  }
+
+  for (done = 0; done < size; done += ret)
+  {
+    if ((ret = write(fd, data + done, size - done)) <= 0)
+    {
+      if (ret < 0 && errno == EINTR)
+      {
+        ret = 0;
+        continue;
+      }
+      break;
+    }
+  }
+
+  if (close(fd) != 0 || done < size || rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+  }
+}
+
+/**
+ * Prints the build log of every device
+ */
+static void
+printLog(cl_program prog, const cl_device_id *ids, cl_uint count)
+{
+  size_t log;
+  cl_uint i;
+  char *tmp;
+
+  for (i = 0; i < count; ++i)
+  {
+    clGetProgramBuildInfo(prog, ids[i], CL_PROGRAM_BUILD_LOG, 0, NULL, &log);
+    if ((tmp = (char*)malloc(sizeof(char) * (log + 1))) == NULL)
+    {
+      return;
+    }
+
+    clGetProgramBuildInfo(prog, ids[i], CL_PROGRAM_BUILD_LOG, log, tmp, 0);
+    tmp[log] = '\0';
+    fprintf(stderr, "OpenCL: \n%s\n", tmp);
+    free(tmp);
+  }
+}
+
+/**
+ * Creates a program from the cached binaries of all devices
+ * @return NULL if any of them is missing or rejected
+ */
+static cl_program
+loadProgram(cl_context context, const cl_device_id *ids, cl_uint count,
+            const char *options, char paths[][PATH_MAX])
+{
+  unsigned char *bins[BUILD_MAX_DEVICES];
+  size_t sizes[BUILD_MAX_DEVICES];
+  cl_int status[BUILD_MAX_DEVICES];
+  cl_program prog;
+  cl_uint i, n;
+  cl_int err;
+
+  prog = NULL;
+  for (n = 0; n < count; ++n)
+  {
+    if (!(bins[n] = readBinary(paths[n], &sizes[n])))
+    {
+      goto done;
+    }
+  }
+
+  if ((prog = clCreateProgramWithBinary(context, count, ids, sizes,
+                                        (const unsigned char**)bins, status,
+                                        &err)) &&
+      clBuildProgram(prog, count, ids, options, NULL, NULL) != CL_SUCCESS)
+  {
+    clReleaseProgram(prog);
+    prog = NULL;
+  }
+
+done:
+  for (i = 0; i < n; ++i)
+  {
+    free(bins[i]);
+  }
+
+  return prog;
+}
+
+/**
+ * Stores the binaries of a freshly built program
+ */
+static void
+saveProgram(cl_program prog, cl_uint count, char paths[][PATH_MAX])
+{
+  unsigned char *bins[BUILD_MAX_DEVICES];
+  size_t sizes[BUILD_MAX_DEVICES];
+  cl_uint i, n;
+
+  /* Binaries come in the order of the context devices, the ones given */
+  if (clGetProgramInfo(prog, CL_PROGRAM_NUM_DEVICES, sizeof(n), &n,
+                       NULL) != CL_SUCCESS || n != count ||
+      clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * count,
+                       sizes, NULL) != CL_SUCCESS)
+  {
+    return;
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    bins[i] = sizes[i] ? (unsigned char*)malloc(sizes[i]) : NULL;
+  }
+
+  if (clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof(bins), bins,
+                       NULL) == CL_SUCCESS)
+  {
+    for (i = 0; i < count; ++i)
+    {
+      if (bins[i])
+      {
+        writeBinary(paths[i], bins[i], sizes[i]);
+      }
+    }
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    free(bins[i]);
+  }
+}
+
+/**
+ * Builds a program for all devices, reusing cached binaries
+ * Stale or corrupt binaries fail to load and are rebuilt from source.
+ * @param dir Cache directory, NULL for the default, empty to disable
+ * @return NULL if the source does not build
+ */
+cl_program
+buildProgram(cl_context context, const cl_device_id *ids, cl_uint count,
+             const char *source, size_t length, const char *options,
+             const char *dir)
+{
+  char paths[BUILD_MAX_DEVICES][PATH_MAX], base[PATH_MAX];
+  cl_program prog;
+  int cached;
+  cl_uint i;
+  cl_int err;
+
+  count = count > BUILD_MAX_DEVICES ? BUILD_MAX_DEVICES : count;
+  cached = cacheDir(dir, base, sizeof(base));
+  for (i = 0; cached && i < count; ++i)
+  {
+    cached = cachePath(base, ids[i], source, length, options, paths[i],
+                       sizeof(paths[i]));
+  }
+
+  if (cached && (prog = loadProgram(context, ids, count, options, paths)))
+  {
+    return prog;
+  }
+
+  if (!(prog = clCreateProgramWithSource(context, 1, &source, &length,
+                                         &err)))
+  {
+    fprintf(stderr, "OpenCL: Cannot create program\n");
+    return NULL;
+  }
+
+  if (clBuildProgram(prog, count, ids, options, NULL, NULL) != CL_SUCCESS)
+  {
+    printLog(prog, ids, count);
+    clReleaseProgram(prog);
+    return NULL;
+  }
+
+  if (cached)
+  {
+    saveProgram(prog, count, paths);
+  }
+
+  return prog;
+}
@@ -0,0 +1,10 @@
+#ifndef __HOG_BUILD_H__
+#define __HOG_BUILD_H__
+
+#include <stddef.h>
+#include <CL/cl.h>
+
+cl_program buildProgram(cl_context, const cl_device_id *, cl_uint,
+                        const char *, size_t, const char *, const char *);
+
+#endif /*__HOG_BUILD_H__*/
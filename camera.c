@@ -4,10 +4,35 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include "camera.h"
+#include "convert.h"
+#include "stats.h"
+
+/* Formats the camera is asked for, cheapest to turn into luma first */
+static const struct
+{
+  uint32_t format;
+  uint32_t layout;
+  int convert;
+  int studio;
+} FORMATS[] =
+{
+  /* Luma as is, planar chroma simply follows it */
+  { V4L2_PIX_FMT_GREY,   V4L2_PIX_FMT_GREY, 0, 0 },
+  { V4L2_PIX_FMT_NV12,   V4L2_PIX_FMT_GREY, 0, 1 },
+  { V4L2_PIX_FMT_NV21,   V4L2_PIX_FMT_GREY, 0, 1 },
+  { V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_GREY, 0, 1 },
+  { V4L2_PIX_FMT_YVU420, V4L2_PIX_FMT_GREY, 0, 1 },
+  /* Packed, the device splits luma from chroma */
+  { V4L2_PIX_FMT_YUYV,   V4L2_PIX_FMT_YUYV, 0, 1 },
+  { V4L2_PIX_FMT_UYVY,   V4L2_PIX_FMT_YUYV, 1, 1 }
+};
+
+#define FORMAT_COUNT (sizeof(FORMATS) / sizeof(FORMATS[0]))
 
 /**
  * Resumes ioctl on interrupts
@@ -24,6 +49,70 @@ devctl(struct camera *dev, int req, void *arg)
   return ret;
 }
 
+/**
+ * Returns the rank of a format in FORMATS, FORMAT_COUNT if unsupported
+ */
+static uint32_t
+rankFormat(uint32_t format)
+{
+  uint32_t i;
+
+  for (i = 0; i < FORMAT_COUNT; ++i)
+  {
+    if (FORMATS[i].format == format)
+    {
+      break;
+    }
+  }
+
+  return i;
+}
+
+/**
+ * Picks the cheapest format the camera offers
+ * @return FORMAT_COUNT if none of them is supported
+ */
+static uint32_t
+pickFormat(struct camera *dev)
+{
+  struct v4l2_fmtdesc desc;
+  uint32_t best, rank;
+
+  best = FORMAT_COUNT;
+  memset(&desc, 0, sizeof(desc));
+  desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  while (devctl(dev, VIDIOC_ENUM_FMT, &desc) == 0)
+  {
+    /* Compressed formats never rank */
+    rank = rankFormat(desc.pixelformat);
+    best = rank < best ? rank : best;
+    desc.index++;
+  }
+
+  return best;
+}
+
+/**
+ * Copies rows of a plane, in one go if they are contiguous
+ */
+static void
+copyPlane(uint8_t *dest, const uint8_t *src, size_t row, uint32_t height,
+          size_t stride)
+{
+  uint32_t y;
+
+  if (stride == row)
+  {
+    memcpy(dest, src, row * height);
+    return;
+  }
+
+  for (y = 0; y < height; ++y)
+  {
+    memcpy(dest + y * row, src + y * stride, row);
+  }
+}
+
 /**
  * Retrieves a handle to a camera
  */
@@ -35,7 +124,8 @@ initCamera(struct camera *dev)
   struct v4l2_capability cap;
   struct v4l2_format fmt;
   struct stat st;
-  uint32_t i;
+  uint32_t i, rank;
+  long page;
 
   /* Check whether the camera can be read from */
   if (stat(dev->camera, &st) == -1 || !S_ISCHR(st.st_mode))
@@ -61,7 +151,13 @@ initCamera(struct camera *dev)
     return 0;
   }
 
-  /* Change resolution */
+  /* Negotiate the format and change resolution */
+  if ((rank = pickFormat(dev)) == FORMAT_COUNT)
+  {
+    fprintf(stderr, "V4L2: No supported pixel format\n");
+    return 0;
+  }
+
   memset(&fmt, 0, sizeof(fmt));
   fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   if (devctl(dev, VIDIOC_G_FMT, &fmt) < 0)
@@ -72,29 +168,59 @@ initCamera(struct camera *dev)
   
   fmt.fmt.pix.width = dev->width ? dev->width : fmt.fmt.pix.width;
   fmt.fmt.pix.height = dev->height ? dev->height : fmt.fmt.pix.height;
+  fmt.fmt.pix.pixelformat = FORMATS[rank].format;
   if (devctl(dev, VIDIOC_S_FMT, &fmt) < 0)
   {
     fprintf(stderr, "V4L2: Cannot set format");
     return 0;
   }
 
+  /* Drivers may substitute a format of their own */
+  if ((rank = rankFormat(fmt.fmt.pix.pixelformat)) == FORMAT_COUNT)
+  {
+    fprintf(stderr, "V4L2: Camera switched to an unsupported format\n");
+    return 0;
+  }
+
   dev->width = fmt.fmt.pix.width;
   dev->height = fmt.fmt.pix.height;
   dev->size = fmt.fmt.pix.sizeimage;
   dev->type = fmt.fmt.pix.colorspace;
-  dev->format = fmt.fmt.pix.pixelformat;
+  dev->format = FORMATS[rank].format;
+  dev->layout = FORMATS[rank].layout;
+  dev->convert = FORMATS[rank].convert;
+  dev->studio = FORMATS[rank].studio;
+
+  /* Of the luma plane for planar formats */
+  dev->stride = fmt.fmt.pix.bytesperline ? fmt.fmt.pix.bytesperline :
+                dev->width * (dev->layout == V4L2_PIX_FMT_GREY ? 1 : 2);
 
-  /* Request buffers */
+  /* Repacked frames are copied anyway */
+  dev->userptr = dev->userptr && !dev->convert;
+
+  /* Request buffers, user pointers fall back to mmap if unsupported */
   memset(&req, 0, sizeof(req));
   req.count = 8;
   req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  req.memory = V4L2_MEMORY_MMAP;
-  if (devctl(dev, VIDIOC_REQBUFS, &req) < 0 || req.count < 2)
+  req.memory = dev->userptr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+  if (devctl(dev, VIDIOC_REQBUFS, &req) < 0 && dev->userptr)
+  {
+    req.count = 8;
+    req.memory = V4L2_MEMORY_MMAP;
+    dev->userptr = 0;
+    if (devctl(dev, VIDIOC_REQBUFS, &req) < 0)
+    {
+      return 0;
+    }
+  }
+
+  if (req.count < 2)
   {
     return 0;
   }
 
   /* Initialise the buffers */
+  dev->memory = req.memory;
   dev->buffer_count = req.count;
   dev->buffers = (struct buffer*)malloc(sizeof(struct buffer) * req.count);
   memset(dev->buffers, 0, sizeof(struct buffer) * req.count);
@@ -103,6 +229,23 @@ initCamera(struct camera *dev)
     dev->buffers[i].ptr = MAP_FAILED;
   }
 
+  /* Allocate page aligned user buffers, these can be wrapped by OpenCL */
+  if (dev->memory == V4L2_MEMORY_USERPTR)
+  {
+    page = sysconf(_SC_PAGESIZE);
+    for (i = 0; i < dev->buffer_count; ++i)
+    {
+      dev->buffers[i].length = (dev->size + page - 1) & ~(page - 1);
+      if (posix_memalign(&dev->buffers[i].ptr, page, dev->buffers[i].length))
+      {
+        dev->buffers[i].ptr = MAP_FAILED;
+        return 0;
+      }
+    }
+
+    return 1;
+  }
+
   /* mmap all the buffers */
   for (i = 0; i < dev->buffer_count; ++i)
   {
@@ -142,7 +285,16 @@ destroyCamera(struct camera *dev)
   {
     for (i = 0; i < dev->buffer_count; ++i)
     {
-      if (dev->buffers[i].ptr != MAP_FAILED)
+      if (dev->buffers[i].ptr == MAP_FAILED)
+      {
+        continue;
+      }
+
+      if (dev->memory == V4L2_MEMORY_USERPTR)
+      {
+        free(dev->buffers[i].ptr);
+      }
+      else
       {
         munmap(dev->buffers[i].ptr, dev->buffers[i].length);
       }
@@ -166,7 +318,6 @@ int
 startCamera(struct camera *dev)
 {
   enum v4l2_buf_type type;
-  struct v4l2_buffer buf;
   uint32_t i;
 
   if (dev->capture)
@@ -177,11 +328,7 @@ startCamera(struct camera *dev)
   /* Queue all buffers */
   for (i = 0; i < dev->buffer_count; ++i)
   {
-    memset(&buf, 0, sizeof(buf));
-    buf.index = i;
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    if (devctl(dev, VIDIOC_QBUF, &buf) < 0)
+    if (!queueImage(dev, i))
     {
       return 0;
     }
@@ -199,113 +346,122 @@ startCamera(struct camera *dev)
 }
 
 /**
- * Clips a color to 0 - 255
- */
-static inline uint8_t
-clip(int color)
-{
-  return (color < 0) ? 0 : (color >= 0xFF ? 0xFF : color);
-}
-
-/**
- * Converts an YUYV source to RGB
+ * Hands a buffer back to the driver
  */
-static void
-yuyvToRGB(uint8_t *src, uint8_t *dest, uint32_t w, uint32_t h)
+int
+queueImage(struct camera *dev, uint32_t index)
 {
-  uint32_t idx, sidx, i, j;
-  int c0, c1, d, e;
+  struct v4l2_buffer buf;
 
-  sidx = 0;
-  idx = 0;
-  for (i = 0; i < h; ++i)
+  memset(&buf, 0, sizeof(buf));
+  buf.index = index;
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = dev->memory;
+  if (dev->memory == V4L2_MEMORY_USERPTR)
   {
-    for (j = 0; j < w >> 1; ++j)
-    {
-      c0 = src[sidx++] - 16;
-      d  = src[sidx++] - 128;
-      c1 = src[sidx++] - 16;
-      e  = src[sidx++] - 128;
-
-      dest[idx++] = clip((298 * c0           + 409 * e + 128) >> 8);
-      dest[idx++] = clip((298 * c0 - 100 * d - 208 * e + 128) >> 8);
-      dest[idx++] = clip((298 * c0 + 516 * d           + 128) >> 8);
-      dest[idx++] = 0;
-
-      dest[idx++] = clip((298 * c1           + 409 * e + 128) >> 8);
-      dest[idx++] = clip((298 * c1 - 100 * d - 208 * e + 128) >> 8);
-      dest[idx++] = clip((298 * c1 + 516 * d           + 128) >> 8);
-      dest[idx++] = 0;
-    }
+    buf.m.userptr = (unsigned long)dev->buffers[index].ptr;
+    buf.length = dev->buffers[index].length;
   }
+
+  return devctl(dev, VIDIOC_QBUF, &buf) >= 0;
 }
 
 /**
- * Retrieves a frame from the camera
+ * Takes a filled buffer without waiting, callers poll the descriptor
+ * The buffer is owned by the caller until it is passed to queueImage.
+ * @return Index of the buffer, -1 if none is filled yet or on error
  */
 int
-getImage(struct camera *dev, uint8_t *dest)
+dequeueImage(struct camera *dev)
 {
   struct v4l2_buffer buf;
-  struct timeval tv;
-  fd_set fds;
-  int r;
+  struct timespec ts;
 
-  if (!dev->capture || !dest)
+  if (!dev->capture)
   {
-    return 0;
+    return -1;
   }
 
-  /* Repeat if VIDIOC_DQBUF fails with EAGAIN */
-  do
+  /* The descriptor is non-blocking, EAGAIN means no buffer is filled */
+  memset(&buf, 0, sizeof(buf));
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = dev->memory;
+  if (devctl(dev, VIDIOC_DQBUF, &buf) < 0)
   {
-    /* Set up select */
-    FD_ZERO(&fds);
-    FD_SET(dev->fd, &fds);
-    tv.tv_sec = 0;
-    tv.tv_usec = 16000;
-    if ((r = select(dev->fd + 1, &fds, NULL, NULL, &tv)) <= 0)
-    {
-      if (errno == EINTR)
-      {
-        continue;
-      }
-      return 0;
-    }
-
-    /* Deque the buffer & read from it */
-    memset(&buf, 0, sizeof(buf));
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-  } while (devctl(dev, VIDIOC_DQBUF, &buf) < 0 && errno == EAGAIN);
+    return -1;
+  }
 
   /* Invalid buffer */
   if (buf.index >= dev->buffer_count)
   {
-    return 0;
+    return -1;
+  }
+
+  /* Frames stamped with another clock are stamped once dequeued */
+  if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+      V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+  {
+    dev->timestamp = buf.timestamp.tv_sec * 1000000000ULL +
+                     buf.timestamp.tv_usec * 1000ULL;
+  }
+  else
+  {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    dev->timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
   }
 
-  /* Process the image */
+  return buf.index;
+}
+
+/**
+ * Copies a dequeued buffer in the format frames are handed out in
+ */
+int
+copyImage(struct camera *dev, int index, uint8_t *dest)
+{
+  const uint8_t *src;
+  uint32_t y;
+  int ret;
+
+  /* Copy the raw image, conversion happens on the device */
+  STAT_START(copy);
+  src = (const uint8_t*)dev->buffers[index].ptr;
+  ret = 1;
   switch (dev->format)
   {
+    case V4L2_PIX_FMT_GREY:
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+    {
+      /* Chroma is never looked at */
+      copyPlane(dest, src, dev->width, dev->height, dev->stride);
+      break;
+    }
     case V4L2_PIX_FMT_YUYV:
     {
-      yuyvToRGB(dev->buffers[buf.index].ptr, dest, dev->width, dev->height);
+      copyPlane(dest, src, dev->width * 2, dev->height, dev->stride);
+      break;
+    }
+    case V4L2_PIX_FMT_UYVY:
+    {
+      for (y = 0; y < dev->height; ++y)
+      {
+        uyvyToYUYV(src + y * dev->stride, dest + y * dev->width * 2,
+                   dev->width);
+      }
       break;
     }
     default:
     {
-      return 0;
+      ret = 0;
+      break;
     }
   }
 
-  /* Put the buffer back in the queue */
-  if (devctl(dev, VIDIOC_QBUF, &buf) < 0)
-  {
-    return 0;
-  }
-
-  return 1;
+  STAT_STOP(STAT_CONVERT, copy);
+  return ret;
 }
 
 /**
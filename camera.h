@@ -16,17 +16,37 @@ struct camera
   int capture;
   uint32_t width;
   uint32_t height;
+  uint32_t stride;
   size_t size;
+  int userptr;
+  uint32_t memory;
   uint32_t buffer_count;
+
+  /* Negotiated format, and the one copyImage hands frames out in, GREY
+     for the luma plane of planar formats */
   uint32_t format;
+  uint32_t layout;
+
+  /* Frames are repacked by copyImage, buffers cannot be read in place */
+  int convert;
+
+  /* Luma is limited to 16 - 235, only GREY itself spans the full range */
+  int studio;
+
   struct buffer *buffers;
   enum v4l2_colorspace type;
   const char *camera;
+
+  /* Capture time of the last dequeued buffer in monotonic nanoseconds,
+     the dequeue time if the driver stamps with another clock */
+  uint64_t timestamp;
 };
 
 int initCamera(struct camera *);
 int startCamera(struct camera *);
-int getImage(struct camera *, uint8_t *);
+int copyImage(struct camera *, int, uint8_t *);
+int dequeueImage(struct camera *);
+int queueImage(struct camera *, uint32_t);
 void stopCamera(struct camera *);
 void destroyCamera(struct camera *);
 
@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "capture.h"
+
+/* Milliseconds the capture thread sleeps before checking for quit */
+#define CAPTURE_POLL 100
+
+/**
+ * Increments an eventfd
+ */
+static void
+signalFd(int fd)
+{
+  uint64_t one = 1;
+
+  while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+/**
+ * Resets an eventfd
+ */
+static void
+clearFd(int fd)
+{
+  uint64_t count;
+
+  while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR);
+}
+
+/**
+ * Hands the buffers the consumer is done with back to the camera
+ * @return Number of buffers queued
+ */
+static uint32_t
+recycle(struct capture *cap)
+{
+  uint32_t tail, head, n;
+
+  tail = cap->free_tail;
+  head = __atomic_load_n(&cap->free_head, __ATOMIC_ACQUIRE);
+  for (n = 0; tail != head; ++tail)
+  {
+    n += queueImage(cap->dev, cap->freed[tail & (CAPTURE_RING - 1)]);
+  }
+
+  __atomic_store_n(&cap->free_tail, tail, __ATOMIC_RELEASE);
+  return n;
+}
+
+/**
+ * Capture thread, dequeues every frame as soon as the camera has it
+ */
+static void *
+captureMain(void *arg)
+{
+  struct capture *cap = (struct capture*)arg;
+  struct pollfd fds[2];
+  uint32_t queued, head;
+  int index, old;
+
+  /* startCamera queued every buffer */
+  queued = cap->dev->buffer_count;
+  fds[0].fd = cap->wake;
+  fds[0].events = POLLIN;
+  fds[1].fd = cap->dev->fd;
+  fds[1].events = POLLIN;
+
+  while (!__atomic_load_n(&cap->quit, __ATOMIC_ACQUIRE))
+  {
+    queued += recycle(cap);
+
+    /* The camera fails polls while it holds no buffers */
+    fds[0].revents = fds[1].revents = 0;
+    if (poll(fds, queued ? 2 : 1, CAPTURE_POLL) <= 0)
+    {
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      clearFd(cap->wake);
+    }
+
+    /* Errors and unplugged cameras would poll at once forever */
+    if (fds[1].revents & (POLLERR | POLLHUP | POLLNVAL))
+    {
+      break;
+    }
+
+    if (!(fds[1].revents & POLLIN))
+    {
+      continue;
+    }
+
+    if ((index = dequeueImage(cap->dev)) < 0)
+    {
+      if (errno == EAGAIN)
+      {
+        continue;
+      }
+      break;
+    }
+
+    queued--;
+    cap->stamps[index] = cap->dev->timestamp;
+    __atomic_fetch_add(&cap->captured, 1, __ATOMIC_RELAXED);
+    if (cap->mode == CAPTURE_LATEST)
+    {
+      /* A frame still waiting is stale by now */
+      old = __atomic_exchange_n(&cap->latest, index, __ATOMIC_ACQ_REL);
+      if (old >= 0)
+      {
+        queued += queueImage(cap->dev, old);
+        __atomic_fetch_add(&cap->dropped, 1, __ATOMIC_RELAXED);
+      }
+    }
+    else
+    {
+      /* Never full, there are fewer buffers than entries */
+      head = cap->head;
+      cap->filled[head & (CAPTURE_RING - 1)] = index;
+      __atomic_store_n(&cap->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    signalFd(cap->ready);
+  }
+
+  /* Wake the consumer so it drains what is left and stops */
+  if (!__atomic_load_n(&cap->quit, __ATOMIC_ACQUIRE))
+  {
+    fprintf(stderr, "V4L2: Cannot capture from '%s'\n", cap->dev->camera);
+    __atomic_store_n(&cap->failed, 1, __ATOMIC_RELEASE);
+    signalFd(cap->ready);
+  }
+
+  return NULL;
+}
+
+/**
+ * Starts the capture thread of a streaming camera
+ */
+int
+initCapture(struct capture *cap, struct camera *dev, enum capture_mode mode)
+{
+  memset(cap, 0, sizeof(*cap));
+  cap->ready = cap->wake = -1;
+  cap->dev = dev;
+  cap->mode = mode;
+  cap->latest = -1;
+
+  if (dev->buffer_count > CAPTURE_RING)
+  {
+    fprintf(stderr, "V4L2: Too many buffers to capture\n");
+    return 0;
+  }
+
+  if ((cap->ready = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+      (cap->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+      pthread_create(&cap->thread, NULL, captureMain, cap) != 0)
+  {
+    destroyCapture(cap);
+    return 0;
+  }
+
+  cap->started = 1;
+  return 1;
+}
+
+/**
+ * Checks whether a frame is waiting, the ready eventfd fires once one is
+ */
+int
+frameWaiting(struct capture *cap)
+{
+  if (cap->mode == CAPTURE_LATEST)
+  {
+    return __atomic_load_n(&cap->latest, __ATOMIC_ACQUIRE) >= 0;
+  }
+
+  return cap->tail != __atomic_load_n(&cap->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Takes the next frame without waiting
+ * The buffer is owned by the caller until it is passed to giveFrame.
+ * @param timestamp Set to the capture time of the frame
+ * @return Index of the buffer, -1 if no frame is waiting
+ */
+int
+takeFrame(struct capture *cap, uint64_t *timestamp)
+{
+  uint32_t tail;
+  int index;
+
+  if (cap->mode == CAPTURE_LATEST)
+  {
+    index = __atomic_exchange_n(&cap->latest, -1, __ATOMIC_ACQ_REL);
+  }
+  else if ((tail = cap->tail) != __atomic_load_n(&cap->head,
+                                                  __ATOMIC_ACQUIRE))
+  {
+    index = cap->filled[tail & (CAPTURE_RING - 1)];
+    __atomic_store_n(&cap->tail, tail + 1, __ATOMIC_RELEASE);
+  }
+  else
+  {
+    return -1;
+  }
+
+  if (index >= 0)
+  {
+    *timestamp = cap->stamps[index];
+  }
+
+  return index;
+}
+
+/**
+ * Returns a buffer to the capture thread
+ */
+void
+giveFrame(struct capture *cap, int index)
+{
+  uint32_t head;
+
+  if (index < 0)
+  {
+    return;
+  }
+
+  head = cap->free_head;
+  cap->freed[head & (CAPTURE_RING - 1)] = index;
+  __atomic_store_n(&cap->free_head, head + 1, __ATOMIC_RELEASE);
+  signalFd(cap->wake);
+}
+
+/**
+ * Stops the capture thread, buffers still handed out are reclaimed when
+ * the camera stops streaming
+ */
+void
+destroyCapture(struct capture *cap)
+{
+  if (cap->started)
+  {
+    __atomic_store_n(&cap->quit, 1, __ATOMIC_RELEASE);
+    signalFd(cap->wake);
+    pthread_join(cap->thread, NULL);
+    cap->started = 0;
+  }
+
+  if (cap->ready >= 0)
+  {
+    close(cap->ready);
+    cap->ready = -1;
+  }
+
+  if (cap->wake >= 0)
+  {
+    close(cap->wake);
+    cap->wake = -1;
+  }
+}
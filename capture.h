@@ -0,0 +1,67 @@
+#ifndef __HOG_CAPTURE_H__
+#define __HOG_CAPTURE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "camera.h"
+
+/* Entries of the rings, a power of two above VIDEO_MAX_FRAME buffers */
+#define CAPTURE_RING 64
+
+/* Frames handed to the consumer */
+enum capture_mode
+{
+  /* Queued in order, none is dropped while buffers last */
+  CAPTURE_EVERY,
+  /* Only the newest one is kept, stale ones go back to the camera */
+  CAPTURE_LATEST
+};
+
+/**
+ * Capture thread of a camera, the only one issuing ioctls once started
+ * Buffers travel through single producer, single consumer rings, the
+ * eventfds only wake the side that waits.
+ */
+struct capture
+{
+  struct camera *dev;
+  enum capture_mode mode;
+
+  /* Filled buffers, from the capture thread to the consumer */
+  uint32_t filled[CAPTURE_RING];
+  uint32_t head;
+  uint32_t tail;
+  int latest;
+
+  /* Consumed buffers, from the consumer back to the capture thread */
+  uint32_t freed[CAPTURE_RING];
+  uint32_t free_head;
+  uint32_t free_tail;
+
+  /* Capture time of every buffer, valid while it is handed out */
+  uint64_t stamps[CAPTURE_RING];
+
+  /* Signalled on a new frame, to be reset by the consumer's loop, and on a
+     returned buffer */
+  int ready;
+  int wake;
+
+  pthread_t thread;
+  int started;
+  int quit;
+
+  /* Set once the camera failed, frames captured before remain waiting */
+  int failed;
+
+  /* Frames captured and dropped for newer ones */
+  uint64_t captured;
+  uint64_t dropped;
+};
+
+int initCapture(struct capture *, struct camera *, enum capture_mode);
+int frameWaiting(struct capture *);
+int takeFrame(struct capture *, uint64_t *);
+void giveFrame(struct capture *, int);
+void destroyCapture(struct capture *);
+
+#endif /*__HOG_CAPTURE_H__*/
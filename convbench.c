@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "convert.h"
+
+/* Default frame size and number of iterations */
+#define BENCH_WIDTH  1920
+#define BENCH_HEIGHT 1080
+#define BENCH_ITERS  200
+/* Pixels in the row used to check the scalar tails */
+#define BENCH_TAIL   46
+
+/**
+ * Returns a monotonic timestamp in seconds
+ */
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Compares the YUYV converters against the scalar version
+ */
+int
+main(int argc, char **argv)
+{
+  const struct converter *conv;
+  uint32_t width, height, iters, i, n;
+  uint8_t *src, *ref, *out, tail[BENCH_TAIL * 4];
+  size_t pixels;
+  double start, base, times[16];
+  int ret, bad;
+
+  width = argc > 1 ? atoi(argv[1]) : BENCH_WIDTH;
+  height = argc > 2 ? atoi(argv[2]) : BENCH_HEIGHT;
+  iters = argc > 3 ? atoi(argv[3]) : BENCH_ITERS;
+
+  pixels = (size_t)width * height;
+  src = (uint8_t*)malloc(pixels * 2);
+  ref = (uint8_t*)malloc(pixels * 4);
+  out = (uint8_t*)malloc(pixels * 4);
+  if (!src || !ref || !out || pixels < BENCH_TAIL)
+  {
+    fprintf(stderr, "Cannot allocate buffers\n");
+    return EXIT_FAILURE;
+  }
+
+  /* Random samples, with the extremes at the start of the frame */
+  srand(1);
+  for (i = 0; i < pixels * 2; ++i)
+  {
+    src[i] = rand() & 0xFF;
+  }
+  for (i = 0; i < 256 * 4 && i < pixels * 2; ++i)
+  {
+    src[i] = (i & 1) ? ((i >> 1) & 1 ? 0xFF : 0x00) : (i >> 2);
+  }
+
+  yuyvToRGBScalar(src, ref, width, height);
+  yuyvToRGBScalar(src, tail, BENCH_TAIL, 1);
+
+  ret = EXIT_SUCCESS;
+  n = 0;
+  base = 0.0;
+  for (conv = converters; conv->name; ++conv, ++n)
+  {
+    times[n] = 0.0;
+    if (!conv->supported())
+    {
+      continue;
+    }
+
+    /* Check for bit exact output, also on a short row with a tail */
+    memset(out, 0xAA, pixels * 4);
+    conv->yuyv(src, out, width, height);
+    bad = memcmp(out, ref, (size_t)(width >> 1) * 2 * height * 4) != 0;
+    conv->yuyv(src, out, BENCH_TAIL, 1);
+    bad |= memcmp(out, tail, BENCH_TAIL * 4) != 0;
+    if (bad)
+    {
+      fprintf(stderr, "%s: output differs from scalar\n", conv->name);
+      ret = EXIT_FAILURE;
+    }
+
+    start = now();
+    for (i = 0; i < iters; ++i)
+    {
+      conv->yuyv(src, out, width, height);
+    }
+    times[n] = (now() - start) / iters;
+
+    if (conv->yuyv == yuyvToRGBScalar)
+    {
+      base = times[n];
+    }
+  }
+
+  printf("%ux%u, %u iterations, default: %s\n", width, height, iters,
+         initConvert(NULL));
+  printf("%-8s %10s %10s %8s\n", "variant", "ms/frame", "Mpix/s", "speedup");
+  for (i = 0; i < n; ++i)
+  {
+    if (times[i] <= 0.0)
+    {
+      printf("%-8s %10s\n", converters[i].name, "n/a");
+      continue;
+    }
+
+    printf("%-8s %10.3f %10.1f %7.2fx\n", converters[i].name, times[i] * 1e3,
+           pixels / times[i] * 1e-6, base / times[i]);
+  }
+
+  free(src);
+  free(ref);
+  free(out);
+  return ret;
+}
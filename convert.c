@@ -0,0 +1,382 @@
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "convert.h"
+
+/**
+ * Clips a color to 0 - 255
+ */
+static inline uint8_t
+clip(int color)
+{
+  return (color < 0) ? 0 : (color >= 0xFF ? 0xFF : color);
+}
+
+/**
+ * Converts YUYV pairs to RGB
+ */
+static void
+yuyvPairs(const uint8_t *src, uint8_t *dest, uint32_t count)
+{
+  uint32_t idx, sidx, j;
+  int c0, c1, d, e;
+
+  sidx = 0;
+  idx = 0;
+  for (j = 0; j < count; ++j)
+  {
+    c0 = src[sidx++] - 16;
+    d  = src[sidx++] - 128;
+    c1 = src[sidx++] - 16;
+    e  = src[sidx++] - 128;
+
+    dest[idx++] = clip((298 * c0           + 409 * e + 128) >> 8);
+    dest[idx++] = clip((298 * c0 - 100 * d - 208 * e + 128) >> 8);
+    dest[idx++] = clip((298 * c0 + 516 * d           + 128) >> 8);
+    dest[idx++] = 0;
+
+    dest[idx++] = clip((298 * c1           + 409 * e + 128) >> 8);
+    dest[idx++] = clip((298 * c1 - 100 * d - 208 * e + 128) >> 8);
+    dest[idx++] = clip((298 * c1 + 516 * d           + 128) >> 8);
+    dest[idx++] = 0;
+  }
+}
+
+/**
+ * Converts an YUYV source to RGB
+ */
+void
+yuyvToRGBScalar(const uint8_t *src, uint8_t *dest, uint32_t w, uint32_t h)
+{
+  yuyvPairs(src, dest, (w >> 1) * h);
+}
+
+static int
+supportedScalar(void)
+{
+  return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * Converts 8 pixels with SSE2
+ * Chroma is duplicated next to each luma sample so that madd computes
+ * the same 32 bit sums as the scalar code, the packs saturate to 0 - 255.
+ */
+__attribute__((target("sse2")))
+static inline void
+yuyvBlockSSE2(const uint8_t *src, uint8_t *dest)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i bias = _mm_setr_epi16(16, 128, 16, 128, 16, 128, 16, 128);
+  const __m128i round = _mm_set1_epi32(128);
+  const __m128i wr = _mm_setr_epi16(298, 409, 298, 409, 298, 409, 298, 409);
+  const __m128i wgu = _mm_setr_epi16(298, -100, 298, -100,
+                                     298, -100, 298, -100);
+  const __m128i wgv = _mm_setr_epi16(0, -208, 0, -208, 0, -208, 0, -208);
+  const __m128i wb = _mm_setr_epi16(298, 516, 298, 516, 298, 516, 298, 516);
+  __m128i px, half[2], yu, yv, r[2], g[2], b[2], rg, b0;
+  int i;
+
+  px = _mm_loadu_si128((const __m128i*)src);
+  half[0] = _mm_sub_epi16(_mm_unpacklo_epi8(px, zero), bias);
+  half[1] = _mm_sub_epi16(_mm_unpackhi_epi8(px, zero), bias);
+
+  for (i = 0; i < 2; ++i)
+  {
+    /* Y0 U Y1 U and Y0 V Y1 V */
+    yu = _mm_shufflelo_epi16(half[i], _MM_SHUFFLE(1, 2, 1, 0));
+    yu = _mm_shufflehi_epi16(yu, _MM_SHUFFLE(1, 2, 1, 0));
+    yv = _mm_shufflelo_epi16(half[i], _MM_SHUFFLE(3, 2, 3, 0));
+    yv = _mm_shufflehi_epi16(yv, _MM_SHUFFLE(3, 2, 3, 0));
+
+    r[i] = _mm_madd_epi16(yv, wr);
+    g[i] = _mm_add_epi32(_mm_madd_epi16(yu, wgu), _mm_madd_epi16(yv, wgv));
+    b[i] = _mm_madd_epi16(yu, wb);
+
+    r[i] = _mm_srai_epi32(_mm_add_epi32(r[i], round), 8);
+    g[i] = _mm_srai_epi32(_mm_add_epi32(g[i], round), 8);
+    b[i] = _mm_srai_epi32(_mm_add_epi32(b[i], round), 8);
+  }
+
+  /* R0 G0 R1 G1 ... and B0 0 B1 0 ... */
+  rg = _mm_packus_epi16(_mm_packs_epi32(r[0], r[1]),
+                        _mm_packs_epi32(g[0], g[1]));
+  rg = _mm_unpacklo_epi8(rg, _mm_srli_si128(rg, 8));
+  b0 = _mm_packus_epi16(_mm_packs_epi32(b[0], b[1]), zero);
+  b0 = _mm_unpacklo_epi8(b0, zero);
+
+  _mm_storeu_si128((__m128i*)dest, _mm_unpacklo_epi16(rg, b0));
+  _mm_storeu_si128((__m128i*)(dest + 16), _mm_unpackhi_epi16(rg, b0));
+}
+
+/**
+ * Converts an YUYV source to RGB, 16 pixels at a time
+ */
+__attribute__((target("sse2")))
+static void
+yuyvToRGBSSE2(const uint8_t *src, uint8_t *dest, uint32_t w, uint32_t h)
+{
+  uint32_t count, i;
+
+  count = (w >> 1) * h;
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    yuyvBlockSSE2(src + i * 4, dest + i * 8);
+    yuyvBlockSSE2(src + i * 4 + 16, dest + i * 8 + 32);
+  }
+
+  yuyvPairs(src + i * 4, dest + i * 8, count - i);
+}
+
+static int
+supportedSSE2(void)
+{
+  return __builtin_cpu_supports("sse2");
+}
+
+/**
+ * Converts 16 pixels with AVX2
+ * Same as the SSE2 version, the lanes are reordered before the store.
+ */
+__attribute__((target("avx2")))
+static inline void
+yuyvBlockAVX2(const uint8_t *src, uint8_t *dest)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i bias = _mm256_setr_epi16(16, 128, 16, 128, 16, 128, 16, 128,
+                                         16, 128, 16, 128, 16, 128, 16, 128);
+  const __m256i round = _mm256_set1_epi32(128);
+  const __m256i wr = _mm256_broadcastsi128_si256(
+      _mm_setr_epi16(298, 409, 298, 409, 298, 409, 298, 409));
+  const __m256i wgu = _mm256_broadcastsi128_si256(
+      _mm_setr_epi16(298, -100, 298, -100, 298, -100, 298, -100));
+  const __m256i wgv = _mm256_broadcastsi128_si256(
+      _mm_setr_epi16(0, -208, 0, -208, 0, -208, 0, -208));
+  const __m256i wb = _mm256_broadcastsi128_si256(
+      _mm_setr_epi16(298, 516, 298, 516, 298, 516, 298, 516));
+  __m256i px, half[2], yu, yv, r[2], g[2], b[2], rg, b0, lo, hi;
+  int i;
+
+  px = _mm256_loadu_si256((const __m256i*)src);
+  half[0] = _mm256_sub_epi16(_mm256_unpacklo_epi8(px, zero), bias);
+  half[1] = _mm256_sub_epi16(_mm256_unpackhi_epi8(px, zero), bias);
+
+  for (i = 0; i < 2; ++i)
+  {
+    yu = _mm256_shufflelo_epi16(half[i], _MM_SHUFFLE(1, 2, 1, 0));
+    yu = _mm256_shufflehi_epi16(yu, _MM_SHUFFLE(1, 2, 1, 0));
+    yv = _mm256_shufflelo_epi16(half[i], _MM_SHUFFLE(3, 2, 3, 0));
+    yv = _mm256_shufflehi_epi16(yv, _MM_SHUFFLE(3, 2, 3, 0));
+
+    r[i] = _mm256_madd_epi16(yv, wr);
+    g[i] = _mm256_add_epi32(_mm256_madd_epi16(yu, wgu),
+                            _mm256_madd_epi16(yv, wgv));
+    b[i] = _mm256_madd_epi16(yu, wb);
+
+    r[i] = _mm256_srai_epi32(_mm256_add_epi32(r[i], round), 8);
+    g[i] = _mm256_srai_epi32(_mm256_add_epi32(g[i], round), 8);
+    b[i] = _mm256_srai_epi32(_mm256_add_epi32(b[i], round), 8);
+  }
+
+  rg = _mm256_packus_epi16(_mm256_packs_epi32(r[0], r[1]),
+                           _mm256_packs_epi32(g[0], g[1]));
+  rg = _mm256_unpacklo_epi8(rg, _mm256_srli_si256(rg, 8));
+  b0 = _mm256_packus_epi16(_mm256_packs_epi32(b[0], b[1]), zero);
+  b0 = _mm256_unpacklo_epi8(b0, zero);
+
+  /* Each 128 bit lane holds pixels 0-3 & 8-11 or 4-7 & 12-15 */
+  lo = _mm256_unpacklo_epi16(rg, b0);
+  hi = _mm256_unpackhi_epi16(rg, b0);
+  _mm256_storeu_si256((__m256i*)dest, _mm256_permute2x128_si256(lo, hi, 0x20));
+  _mm256_storeu_si256((__m256i*)(dest + 32),
+                      _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+/**
+ * Converts an YUYV source to RGB, 32 pixels at a time
+ */
+__attribute__((target("avx2")))
+static void
+yuyvToRGBAVX2(const uint8_t *src, uint8_t *dest, uint32_t w, uint32_t h)
+{
+  uint32_t count, i;
+
+  count = (w >> 1) * h;
+  for (i = 0; i + 16 <= count; i += 16)
+  {
+    yuyvBlockAVX2(src + i * 4, dest + i * 8);
+    yuyvBlockAVX2(src + i * 4 + 32, dest + i * 8 + 64);
+  }
+
+  yuyvPairs(src + i * 4, dest + i * 8, count - i);
+}
+
+static int
+supportedAVX2(void)
+{
+  return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+#if defined(__ARM_NEON)
+
+/**
+ * Computes a channel of 8 pixels: clip((298 c + kd d + ke e + 128) >> 8)
+ */
+static inline uint8x8_t
+neonChannel(int16x8_t c, int16x8_t d, int16x8_t e, int16_t kd, int16_t ke)
+{
+  int32x4_t lo, hi;
+
+  lo = vmull_n_s16(vget_low_s16(c), 298);
+  lo = vmlal_n_s16(lo, vget_low_s16(d), kd);
+  lo = vmlal_n_s16(lo, vget_low_s16(e), ke);
+  hi = vmull_n_s16(vget_high_s16(c), 298);
+  hi = vmlal_n_s16(hi, vget_high_s16(d), kd);
+  hi = vmlal_n_s16(hi, vget_high_s16(e), ke);
+
+  lo = vshrq_n_s32(vaddq_s32(lo, vdupq_n_s32(128)), 8);
+  hi = vshrq_n_s32(vaddq_s32(hi, vdupq_n_s32(128)), 8);
+  return vqmovun_s16(vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+}
+
+/**
+ * Widens and biases a vector of samples
+ */
+static inline int16x8_t
+neonWiden(uint8x8_t v, int16_t bias)
+{
+  return vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v)), vdupq_n_s16(bias));
+}
+
+/**
+ * Converts an YUYV source to RGB, 16 pixels at a time
+ */
+static void
+yuyvToRGBNEON(const uint8_t *src, uint8_t *dest, uint32_t w, uint32_t h)
+{
+  uint32_t count, i;
+  uint8x8x4_t in;
+  uint8x8x2_t r, g, b;
+  uint8x16x4_t out;
+  int16x8_t c0, c1, d, e;
+
+  count = (w >> 1) * h;
+  out.val[3] = vdupq_n_u8(0);
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    in = vld4_u8(src + i * 4);
+    c0 = neonWiden(in.val[0], 16);
+    d  = neonWiden(in.val[1], 128);
+    c1 = neonWiden(in.val[2], 16);
+    e  = neonWiden(in.val[3], 128);
+
+    r = vzip_u8(neonChannel(c0, d, e, 0, 409), neonChannel(c1, d, e, 0, 409));
+    g = vzip_u8(neonChannel(c0, d, e, -100, -208),
+                neonChannel(c1, d, e, -100, -208));
+    b = vzip_u8(neonChannel(c0, d, e, 516, 0), neonChannel(c1, d, e, 516, 0));
+
+    out.val[0] = vcombine_u8(r.val[0], r.val[1]);
+    out.val[1] = vcombine_u8(g.val[0], g.val[1]);
+    out.val[2] = vcombine_u8(b.val[0], b.val[1]);
+    vst4q_u8(dest + i * 8, out);
+  }
+
+  yuyvPairs(src + i * 4, dest + i * 8, count - i);
+}
+
+static int
+supportedNEON(void)
+{
+  return 1;
+}
+
+#endif
+
+const struct converter converters[] =
+{
+#if defined(__x86_64__) || defined(__i386__)
+  { "avx2",   supportedAVX2,   yuyvToRGBAVX2   },
+  { "sse2",   supportedSSE2,   yuyvToRGBSSE2   },
+#endif
+#if defined(__ARM_NEON)
+  { "neon",   supportedNEON,   yuyvToRGBNEON   },
+#endif
+  { "scalar", supportedScalar, yuyvToRGBScalar },
+  { NULL,     NULL,            NULL            }
+};
+
+yuyv_fn yuyvToRGB = yuyvToRGBScalar;
+
+/**
+ * Picks the fastest conversion supported by the CPU
+ * @param name Name of a specific implementation, NULL for the fastest one
+ * @return Name of the selected implementation, NULL if unavailable
+ */
+const char *
+initConvert(const char *name)
+{
+  const struct converter *conv;
+
+  for (conv = converters; conv->name; ++conv)
+  {
+    if ((!name || !strcmp(name, conv->name)) && conv->supported())
+    {
+      yuyvToRGB = conv->yuyv;
+      return conv->name;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Repacks a planar YUV source to YUYV
+ * @param sx Horizontal chroma subsampling shift
+ * @param sy Vertical chroma subsampling shift
+ * If the chroma planes are missing, the image is treated as grayscale.
+ */
+void
+planarToYUYV(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+             uint8_t *dest, uint32_t w, uint32_t h, uint32_t sx, uint32_t sy)
+{
+  uint32_t idx, cw, i, j, k;
+
+  cw = (w + (1 << sx) - 1) >> sx;
+  idx = 0;
+  for (i = 0; i < h; ++i)
+  {
+    for (j = 0; j + 1 < w; j += 2)
+    {
+      k = (i >> sy) * cw + (j >> sx);
+      dest[idx++] = y[i * w + j];
+      dest[idx++] = u ? u[k] : 128;
+      dest[idx++] = y[i * w + j + 1];
+      dest[idx++] = v ? v[k] : 128;
+    }
+  }
+}
+
+/**
+ * Repacks a row of UYVY to YUYV, two pixels at a time
+ */
+void
+uyvyToYUYV(const uint8_t *src, uint8_t *dest, uint32_t w)
+{
+  uint32_t i, px;
+
+  for (i = 0; i < (w >> 1); ++i)
+  {
+    memcpy(&px, src + i * 4, 4);
+    px = ((px & 0x00FF00FF) << 8) | ((px >> 8) & 0x00FF00FF);
+    memcpy(dest + i * 4, &px, 4);
+  }
+}
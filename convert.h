@@ -0,0 +1,27 @@
+#ifndef __HOG_CONVERT_H__
+#define __HOG_CONVERT_H__
+
+#include <stdint.h>
+
+typedef void (*yuyv_fn)(const uint8_t *, uint8_t *, uint32_t, uint32_t);
+
+struct converter
+{
+  const char *name;
+  int (*supported)(void);
+  yuyv_fn yuyv;
+};
+
+/* Available implementations, fastest first, terminated by a NULL name */
+extern const struct converter converters[];
+
+/* YUYV to RGBA conversion picked by initConvert */
+extern yuyv_fn yuyvToRGB;
+
+const char *initConvert(const char *);
+void yuyvToRGBScalar(const uint8_t *, uint8_t *, uint32_t, uint32_t);
+void planarToYUYV(const uint8_t *, const uint8_t *, const uint8_t *, uint8_t *,
+                  uint32_t, uint32_t, uint32_t, uint32_t);
+void uyvyToYUYV(const uint8_t *, uint8_t *, uint32_t);
+
+#endif /*__HOG_CONVERT_H__*/
@@ -0,0 +1,795 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "cpu.h"
+#include "convert.h"
+#include "process.h"
+
+/* Same hysteresis states as program.cl */
+#define EDGE_NONE   0
+#define EDGE_WEAK   1
+#define EDGE_STRONG 2
+
+/* Four floats, lowered to SSE or NEON by the compiler */
+typedef float v4f __attribute__((vector_size(16)));
+
+/* Neighbours along the quantized gradient directions */
+static const int DIRS[4][2] =
+{
+  { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }
+};
+
+static inline v4f
+load4(const float *p)
+{
+  v4f v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void
+store4(float *p, v4f v)
+{
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline v4f
+splat4(float f)
+{
+  return (v4f){ f, f, f, f };
+}
+
+static inline int
+clampi(int v, int lo, int hi)
+{
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+/**
+ * Allocates a cache line aligned buffer
+ */
+static void *
+alignedAlloc(size_t size)
+{
+  void *ptr;
+
+  return posix_memalign(&ptr, 64, size) ? NULL : ptr;
+}
+
+/**
+ * Quantizes the gradient direction, same sectors as program.cl
+ */
+static inline uint8_t
+quantize(float vert, float horz)
+{
+  float ax, ay;
+
+  ax = fabsf(horz);
+  ay = fabsf(vert);
+  if (ay <= 0.41421356f * ax)
+  {
+    return 0;
+  }
+  if (ay >= 2.41421356f * ax)
+  {
+    return 2;
+  }
+
+  return (vert * horz > 0.0f) ? 1 : 3;
+}
+
+/**
+ * Extracts the 8 bit luma of a row, rounded like a UNORM image write
+ */
+static void
+lumaRow(struct cpu *cpu, const uint8_t *row, uint8_t *luma)
+{
+  uint32_t x;
+  int y;
+
+  if (cpu->format == V4L2_PIX_FMT_YUYV)
+  {
+    for (x = 0; x < cpu->width; ++x)
+    {
+      y = (row[x * 2] - 16) * 255;
+      luma[x] = clampi((y + 109) / 219, 0, 255);
+    }
+  }
+  else if (cpu->format == V4L2_PIX_FMT_GREY && cpu->studio)
+  {
+    for (x = 0; x < cpu->width; ++x)
+    {
+      y = (row[x] - 16) * 255;
+      luma[x] = clampi((y + 109) / 219, 0, 255);
+    }
+  }
+  else if (cpu->format == V4L2_PIX_FMT_GREY)
+  {
+    memcpy(luma, row, cpu->width);
+  }
+  else
+  {
+    for (x = 0; x < cpu->width; ++x)
+    {
+      luma[x] = (299 * row[x * 4 + 0] + 587 * row[x * 4 + 1] +
+                 114 * row[x * 4 + 2] + 500) / 1000;
+    }
+  }
+}
+
+/**
+ * Horizontal blur of a row padded with radius clamped pixels on each side
+ */
+static void
+blurRow(struct cpu *cpu, const float *pad, float *dst)
+{
+  uint32_t x;
+  int i;
+  v4f acc;
+  float sum;
+
+  for (x = 0; x + 4 <= cpu->width; x += 4)
+  {
+    acc = splat4(0.0f);
+    for (i = 0; i <= 2 * cpu->radius; ++i)
+    {
+      acc += splat4(cpu->weights[i]) * load4(pad + x + i);
+    }
+    store4(dst + x, acc);
+  }
+
+  for (; x < cpu->width; ++x)
+  {
+    sum = 0.0f;
+    for (i = 0; i <= 2 * cpu->radius; ++i)
+    {
+      sum += cpu->weights[i] * pad[x + i];
+    }
+    dst[x] = sum;
+  }
+}
+
+/**
+ * Vertical blur of row y from the horizontally blurred image
+ */
+static void
+blurColumn(struct cpu *cpu, int y, float *dst)
+{
+  const int h = cpu->height;
+  const float *rows[2 * PROCESS_MAX_RADIUS + 1];
+  uint32_t x;
+  int i;
+  v4f acc;
+  float sum;
+
+  for (i = 0; i <= 2 * cpu->radius; ++i)
+  {
+    rows[i] = cpu->temp + clampi(y + i - cpu->radius, 0, h - 1) * cpu->width;
+  }
+
+  for (x = 0; x + 4 <= cpu->width; x += 4)
+  {
+    acc = splat4(0.0f);
+    for (i = 0; i <= 2 * cpu->radius; ++i)
+    {
+      acc += splat4(cpu->weights[i]) * load4(rows[i] + x);
+    }
+    store4(dst + x, acc);
+  }
+
+  for (; x < cpu->width; ++x)
+  {
+    sum = 0.0f;
+    for (i = 0; i <= 2 * cpu->radius; ++i)
+    {
+      sum += cpu->weights[i] * rows[i][x];
+    }
+    dst[x] = sum;
+  }
+}
+
+/**
+ * Sobel magnitude and direction of a pixel, neighbours are clamped
+ */
+static inline void
+sobelAt(const float *up, const float *mid, const float *down, int w, int x,
+        float *mag, uint8_t *dir)
+{
+  float vert, horz;
+  int l, r;
+
+  l = x > 0 ? x - 1 : 0;
+  r = x < w - 1 ? x + 1 : w - 1;
+  vert = up[l] + 2 * up[x] + up[r] - down[l] - 2 * down[x] - down[r];
+  horz = up[l] + 2 * mid[l] + down[l] - up[r] - 2 * mid[r] - down[r];
+  mag[x] = sqrtf(vert * vert + horz * horz);
+  dir[x] = quantize(vert, horz);
+}
+
+/**
+ * Sobel magnitude and direction of a row
+ * The interior is computed four pixels at a time, the first and last
+ * pixels clamp.
+ */
+static void
+sobelRow(struct cpu *cpu, const float *up, const float *mid, const float *down,
+         float *mag, uint8_t *dir)
+{
+  const int w = cpu->width;
+  v4f v, h, two;
+  int x, l;
+
+  sobelAt(up, mid, down, w, 0, mag, dir);
+
+  two = splat4(2.0f);
+  for (x = 1; x + 4 < w; x += 4)
+  {
+    v = load4(up + x - 1) + two * load4(up + x) + load4(up + x + 1) -
+        load4(down + x - 1) - two * load4(down + x) - load4(down + x + 1);
+    h = load4(up + x - 1) + two * load4(mid + x - 1) + load4(down + x - 1) -
+        load4(up + x + 1) - two * load4(mid + x + 1) - load4(down + x + 1);
+    store4(mag + x, v * v + h * h);
+
+    for (l = 0; l < 4; ++l)
+    {
+      mag[x + l] = sqrtf(mag[x + l]);
+      dir[x + l] = quantize(v[l], h[l]);
+    }
+  }
+
+  for (; x < w; ++x)
+  {
+    sobelAt(up, mid, down, w, x, mag, dir);
+  }
+}
+
+/**
+ * Offsets of the per worker scratch buffers
+ */
+struct scratch
+{
+  float *blur;
+  float *mag;
+  uint8_t *dir;
+  uint8_t *luma;
+  float *pad;
+};
+
+static void
+getScratch(struct cpu *cpu, uint32_t worker, struct scratch *s)
+{
+  const size_t w = cpu->width;
+  uint8_t *base = cpu->scratch + worker * cpu->scratch_size;
+
+  s->blur = (float*)base;
+  s->mag = s->blur + (CPU_BAND + 4) * w;
+  s->pad = s->mag + (CPU_BAND + 2) * w;
+  s->dir = (uint8_t*)(s->pad + w + 2 * PROCESS_MAX_RADIUS);
+  s->luma = s->dir + (CPU_BAND + 2) * w;
+}
+
+/**
+ * Luma and horizontal blur of a band
+ */
+static void
+taskBlur(void *arg, uint32_t task, uint32_t worker)
+{
+  struct cpu *cpu = (struct cpu*)arg;
+  struct band *band = &cpu->bands[task];
+  struct scratch s;
+  uint32_t y;
+  int i, r;
+
+  getScratch(cpu, worker, &s);
+  r = cpu->radius;
+  for (y = band->y0; y < band->y1; ++y)
+  {
+    lumaRow(cpu, cpu->src + y * cpu->stride, s.luma);
+    for (i = 0; i < (int)cpu->width + 2 * r; ++i)
+    {
+      s.pad[i] = s.luma[clampi(i - r, 0, cpu->width - 1)] * (1.0f / 255.0f);
+    }
+
+    blurRow(cpu, s.pad, cpu->temp + y * cpu->width);
+  }
+}
+
+/**
+ * Vertical blur, Sobel and non maximum suppression of a band
+ * The blurred rows and gradients of the band and its halo stay in the
+ * worker scratch, only the thinned magnitudes are written out.
+ */
+static void
+taskGradient(void *arg, uint32_t task, uint32_t worker)
+{
+  struct cpu *cpu = (struct cpu*)arg;
+  struct band *band = &cpu->bands[task];
+  const int w = cpu->width, h = cpu->height;
+  uint32_t *hist = cpu->hist + worker * PROCESS_HIST_BINS;
+  struct scratch s;
+  int by0, by1, my0, my1, y, x, dx, dy, bin;
+  float center, left, right, *row;
+  uint8_t d;
+
+  getScratch(cpu, worker, &s);
+  by0 = band->y0 > 2 ? band->y0 - 2 : 0;
+  by1 = band->y1 + 2 < (uint32_t)h ? (int)band->y1 + 2 : h;
+  my0 = band->y0 > 1 ? band->y0 - 1 : 0;
+  my1 = band->y1 + 1 < (uint32_t)h ? (int)band->y1 + 1 : h;
+
+  for (y = by0; y < by1; ++y)
+  {
+    blurColumn(cpu, y, s.blur + (y - by0) * w);
+  }
+
+  for (y = my0; y < my1; ++y)
+  {
+    sobelRow(cpu, s.blur + (clampi(y - 1, 0, h - 1) - by0) * w,
+             s.blur + (y - by0) * w,
+             s.blur + (clampi(y + 1, 0, h - 1) - by0) * w,
+             s.mag + (y - my0) * w, s.dir + (y - my0) * w);
+  }
+
+  for (y = band->y0; y < (int)band->y1; ++y)
+  {
+    row = cpu->nms + y * w;
+    for (x = 0; x < w; ++x)
+    {
+      d = s.dir[(y - my0) * w + x];
+      dx = DIRS[d][0];
+      dy = DIRS[d][1];
+      center = s.mag[(y - my0) * w + x];
+      left = s.mag[(clampi(y + dy, 0, h - 1) - my0) * w +
+                   clampi(x + dx, 0, w - 1)];
+      right = s.mag[(clampi(y - dy, 0, h - 1) - my0) * w +
+                    clampi(x - dx, 0, w - 1)];
+
+      if (center <= left || center <= right)
+      {
+        center = 0.0f;
+      }
+
+      row[x] = center;
+      if (cpu->threshold != THRESHOLD_FIXED && center > 0.0f)
+      {
+        bin = (int)(center * (PROCESS_HIST_BINS / PROCESS_HIST_RANGE));
+        hist[bin < PROCESS_HIST_BINS ? bin : PROCESS_HIST_BINS - 1]++;
+      }
+    }
+  }
+}
+
+/**
+ * Promotes a weak pixel of a band and pushes it on the stack
+ * Promotions on the first or last row are signalled to the neighbour.
+ */
+static inline void
+promote(struct cpu *cpu, uint32_t b, uint32_t idx, uint32_t *stack,
+        uint32_t *top)
+{
+  struct band *band = &cpu->bands[b];
+  uint32_t y = idx / cpu->width;
+
+  cpu->edges[idx] = EDGE_STRONG;
+  stack[(*top)++] = idx;
+
+  if (y == band->y0 && b > 0)
+  {
+    __atomic_store_n(&cpu->bands[b - 1].dirty, 1, __ATOMIC_RELAXED);
+  }
+  if (y == band->y1 - 1 && b + 1 < cpu->band_count)
+  {
+    __atomic_store_n(&cpu->bands[b + 1].dirty, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Promotes weak pixels of a band reachable from the pixels on the stack
+ */
+static void
+floodBand(struct cpu *cpu, uint32_t b, uint32_t *stack, uint32_t top)
+{
+  struct band *band = &cpu->bands[b];
+  const int w = cpu->width;
+  uint32_t idx;
+  int x, y, nx, ny, i, j;
+
+  while (top > 0)
+  {
+    idx = stack[--top];
+    x = idx % w;
+    y = idx / w;
+    for (j = -1; j <= 1; ++j)
+    {
+      ny = y + j;
+      if (ny < (int)band->y0 || ny >= (int)band->y1)
+      {
+        continue;
+      }
+
+      for (i = -1; i <= 1; ++i)
+      {
+        nx = x + i;
+        if (nx >= 0 && nx < w && cpu->edges[ny * w + nx] == EDGE_WEAK)
+        {
+          promote(cpu, b, ny * w + nx, stack, &top);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Classifies the pixels of a band and propagates its strong edges
+ */
+static void
+taskClassify(void *arg, uint32_t task, uint32_t worker)
+{
+  struct cpu *cpu = (struct cpu*)arg;
+  struct band *band = &cpu->bands[task];
+  uint32_t *stack = cpu->stack + band->y0 * cpu->width;
+  uint32_t i, top;
+  float pix;
+
+  (void)worker;
+  top = 0;
+  for (i = band->y0 * cpu->width; i < band->y1 * cpu->width; ++i)
+  {
+    pix = cpu->nms[i];
+    cpu->edges[i] = pix >= cpu->high ? EDGE_STRONG
+                  : (pix >= cpu->low ? EDGE_WEAK : EDGE_NONE);
+    if (cpu->edges[i] == EDGE_STRONG)
+    {
+      stack[top++] = i;
+    }
+  }
+
+  floodBand(cpu, task, stack, top);
+}
+
+/**
+ * Seeds a band from the strong pixels of its neighbours' boundary rows
+ * Bands of the same parity never touch, so they run concurrently.
+ */
+static void
+taskPropagate(void *arg, uint32_t task, uint32_t worker)
+{
+  struct cpu *cpu = (struct cpu*)arg;
+  uint32_t b = task * 2 + cpu->parity;
+  const int w = cpu->width;
+  struct band *band;
+  uint32_t *stack, top;
+  int rows[2][2], k, x, i;
+
+  (void)worker;
+  if (b >= cpu->band_count || !cpu->bands[b].dirty)
+  {
+    return;
+  }
+
+  band = &cpu->bands[b];
+  stack = cpu->stack + band->y0 * w;
+
+  /* Outside row and the band row next to it */
+  band->dirty = 0;
+  rows[0][0] = band->y0 - 1;
+  rows[0][1] = band->y0;
+  rows[1][0] = band->y1;
+  rows[1][1] = band->y1 - 1;
+
+  top = 0;
+  for (k = 0; k < 2; ++k)
+  {
+    if (rows[k][0] < 0 || rows[k][0] >= (int)cpu->height)
+    {
+      continue;
+    }
+
+    for (x = 0; x < w; ++x)
+    {
+      if (cpu->edges[rows[k][0] * w + x] != EDGE_STRONG)
+      {
+        continue;
+      }
+
+      for (i = x > 0 ? x - 1 : 0; i <= x + 1 && i < w; ++i)
+      {
+        if (cpu->edges[rows[k][1] * w + i] == EDGE_WEAK)
+        {
+          promote(cpu, b, rows[k][1] * w + i, stack, &top);
+        }
+      }
+    }
+  }
+
+  floodBand(cpu, b, stack, top);
+}
+
+/**
+ * Composes the input with the edges
+ */
+static void
+taskCompose(void *arg, uint32_t task, uint32_t worker)
+{
+  struct cpu *cpu = (struct cpu*)arg;
+  struct band *band = &cpu->bands[task];
+  const uint32_t w = cpu->width;
+  uint8_t *dst;
+  uint32_t y, x;
+
+  (void)worker;
+  for (y = band->y0; y < band->y1; ++y)
+  {
+    dst = cpu->rgba + y * w * 4;
+    if (cpu->format == V4L2_PIX_FMT_YUYV)
+    {
+      yuyvToRGB(cpu->src + y * cpu->stride, dst, w, 1);
+    }
+    else if (cpu->format == V4L2_PIX_FMT_GREY)
+    {
+      for (x = 0; x < w; ++x)
+      {
+        memset(dst + x * 4, cpu->src[y * cpu->stride + x], 3);
+        dst[x * 4 + 3] = 0;
+      }
+    }
+    else
+    {
+      memcpy(dst, cpu->src + y * cpu->stride, w * 4);
+    }
+
+    for (x = 0; x < w; ++x)
+    {
+      if (cpu->edges[y * w + x] == EDGE_STRONG)
+      {
+        memset(dst + x * 4, 0xFF, 4);
+      }
+    }
+  }
+}
+
+/**
+ * Derives the thresholds from the histograms of all workers
+ * Same selection as krnThresholds, the previous ones are kept on frames
+ * without edges.
+ */
+static void
+adaptThresholds(struct cpu *cpu)
+{
+  uint32_t *hist = cpu->hist;
+  float total, sum, acc, w0, m0, var, max;
+  uint32_t i, j;
+  int best;
+
+  for (j = 1; j < cpu->pool.count; ++j)
+  {
+    for (i = 0; i < PROCESS_HIST_BINS; ++i)
+    {
+      hist[i] += hist[j * PROCESS_HIST_BINS + i];
+    }
+  }
+
+  total = sum = 0.0f;
+  for (i = 0; i < PROCESS_HIST_BINS; ++i)
+  {
+    total += hist[i];
+    sum += i * (float)hist[i];
+  }
+
+  best = -1;
+  if (total > 0.0f && cpu->threshold == THRESHOLD_PERCENTILE)
+  {
+    acc = 0.0f;
+    for (i = 0; i < PROCESS_HIST_BINS && best < 0; ++i)
+    {
+      acc += hist[i];
+      best = acc >= cpu->percentile * total ? (int)i : -1;
+    }
+  }
+  else if (total > 0.0f && cpu->threshold == THRESHOLD_OTSU)
+  {
+    w0 = m0 = max = 0.0f;
+    for (i = 0; i < PROCESS_HIST_BINS - 1; ++i)
+    {
+      w0 += hist[i];
+      m0 += i * (float)hist[i];
+      if (w0 == 0.0f || w0 == total)
+      {
+        continue;
+      }
+
+      var = m0 / w0 - (sum - m0) / (total - w0);
+      var = w0 * (total - w0) * var * var;
+      if (var > max)
+      {
+        max = var;
+        best = i;
+      }
+    }
+  }
+
+  if (best >= 0)
+  {
+    cpu->high = (best + 1) * (PROCESS_HIST_RANGE / PROCESS_HIST_BINS);
+    cpu->low = cpu->high * cpu->ratio;
+  }
+}
+
+/**
+ * Allocates the buffers of the CPU engine and starts its threads
+ * @param weights Gaussian weights computed by initProcess
+ */
+int
+initCPU(struct process *proc, const float *weights)
+{
+  struct cpu *cpu;
+  size_t w, pixels;
+  uint32_t i;
+
+  if (!(proc->cpu = cpu = (struct cpu*)calloc(1, sizeof(struct cpu))))
+  {
+    return 0;
+  }
+
+  cpu->width = w = proc->width;
+  cpu->height = proc->height;
+  cpu->format = proc->format;
+  cpu->studio = proc->studio;
+  cpu->radius = proc->radius;
+  cpu->low = proc->low;
+  cpu->high = proc->high;
+  pixels = w * proc->height;
+
+  if (!initPool(&cpu->pool, proc->threads))
+  {
+    fprintf(stderr, "CPU: Cannot start threads\n");
+    return 0;
+  }
+
+  /* Bands of CPU_BAND rows, the last one takes the remainder */
+  cpu->band_count = (proc->height + CPU_BAND - 1) / CPU_BAND;
+  if (!(cpu->bands = (struct band*)calloc(cpu->band_count,
+                                          sizeof(struct band))))
+  {
+    return 0;
+  }
+
+  for (i = 0; i < cpu->band_count; ++i)
+  {
+    cpu->bands[i].y0 = i * CPU_BAND;
+    cpu->bands[i].y1 = (i + 1) * CPU_BAND < proc->height
+                     ? (i + 1) * CPU_BAND : proc->height;
+  }
+
+  /* Blurred and gradient rows of a band with its halo, padded luma row */
+  cpu->scratch_size = sizeof(float) * w * (2 * CPU_BAND + 7) +
+                      sizeof(float) * 2 * PROCESS_MAX_RADIUS +
+                      (CPU_BAND + 3) * w;
+  cpu->scratch_size = (cpu->scratch_size + 63) & ~(size_t)63;
+
+  if (!(cpu->weights = (float*)malloc(sizeof(float) * (2 * cpu->radius + 1))) ||
+      !(cpu->temp = (float*)alignedAlloc(sizeof(float) * pixels)) ||
+      !(cpu->nms = (float*)alignedAlloc(sizeof(float) * pixels)) ||
+      !(cpu->edges = (uint8_t*)alignedAlloc(pixels)) ||
+      !(cpu->check = (uint8_t*)alignedAlloc(pixels)) ||
+      !(cpu->stack = (uint32_t*)alignedAlloc(sizeof(uint32_t) * pixels)) ||
+      !(cpu->buffer = (uint8_t*)alignedAlloc(pixels * 4)) ||
+      !(cpu->scratch = (uint8_t*)alignedAlloc(cpu->scratch_size *
+                                              cpu->pool.count)) ||
+      !(cpu->hist = (uint32_t*)calloc(cpu->pool.count * PROCESS_HIST_BINS,
+                                      sizeof(uint32_t))))
+  {
+    fprintf(stderr, "CPU: Cannot allocate buffers\n");
+    return 0;
+  }
+
+  memcpy(cpu->weights, weights, sizeof(float) * (2 * cpu->radius + 1));
+  initConvert(NULL);
+  return 1;
+}
+
+/**
+ * Keeps the camera buffers to read frames in place
+ */
+int
+wrapCPU(struct cpu *cpu, uint8_t * const *ptrs, uint32_t count, size_t stride)
+{
+  if (!(cpu->inputs = (uint8_t**)malloc(sizeof(uint8_t*) * count)))
+  {
+    return 0;
+  }
+
+  memcpy(cpu->inputs, ptrs, sizeof(uint8_t*) * count);
+  cpu->input_count = count;
+  cpu->input_stride = stride;
+  return 1;
+}
+
+/**
+ * Runs the detector on a frame, the edges are left in edges
+ * @param stride Bytes between rows of the input
+ * @param dest Composed RGBA output, NULL to use the engine's buffer
+ */
+void
+runCPU(struct cpu *cpu, const uint8_t *src, size_t stride, uint8_t *dest)
+{
+  uint32_t i, any;
+
+  cpu->rgba = dest ? dest : cpu->buffer;
+  cpu->src = src;
+  cpu->stride = stride;
+  if (cpu->threshold != THRESHOLD_FIXED)
+  {
+    memset(cpu->hist, 0,
+           sizeof(uint32_t) * PROCESS_HIST_BINS * cpu->pool.count);
+  }
+
+  runPool(&cpu->pool, taskBlur, cpu, cpu->band_count);
+  runPool(&cpu->pool, taskGradient, cpu, cpu->band_count);
+  if (cpu->threshold != THRESHOLD_FIXED)
+  {
+    adaptThresholds(cpu);
+  }
+
+  /* Propagate inside the bands, then across them until nothing changes */
+  runPool(&cpu->pool, taskClassify, cpu, cpu->band_count);
+  for (i = 0; i < cpu->band_count; ++i)
+  {
+    cpu->bands[i].dirty = 1;
+  }
+
+  do
+  {
+    for (cpu->parity = 0; cpu->parity < 2; ++cpu->parity)
+    {
+      runPool(&cpu->pool, taskPropagate, cpu, (cpu->band_count + 1) / 2);
+    }
+
+    any = 0;
+    for (i = 0; i < cpu->band_count; ++i)
+    {
+      any |= cpu->bands[i].dirty;
+    }
+  } while (any);
+
+  runPool(&cpu->pool, taskCompose, cpu, cpu->band_count);
+}
+
+/**
+ * Counts the pixels whose edge state differs from the last frame
+ * @param edges Hysteresis states of the same frame computed elsewhere
+ */
+uint32_t
+compareCPU(struct cpu *cpu, const uint8_t *edges)
+{
+  uint32_t i, count;
+
+  count = 0;
+  for (i = 0; i < cpu->width * cpu->height; ++i)
+  {
+    count += (cpu->edges[i] == EDGE_STRONG) != (edges[i] == EDGE_STRONG);
+  }
+
+  return count;
+}
+
+void
+destroyCPU(struct cpu *cpu)
+{
+  destroyPool(&cpu->pool);
+
+  free(cpu->weights);
+  free(cpu->temp);
+  free(cpu->nms);
+  free(cpu->edges);
+  free(cpu->check);
+  free(cpu->stack);
+  free(cpu->buffer);
+  free(cpu->scratch);
+  free(cpu->hist);
+  free(cpu->bands);
+  free(cpu->inputs);
+  free(cpu);
+}
@@ -0,0 +1,79 @@
+#ifndef __HOG_CPU_H__
+#define __HOG_CPU_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pool.h"
+
+/* Rows per band, the scratch of a band stays in L2 */
+#define CPU_BAND 16
+
+struct process;
+
+struct band
+{
+  uint32_t y0, y1;
+
+  /* Set when a neighbour promoted pixels next to the band */
+  int dirty;
+};
+
+struct cpu
+{
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  int studio;
+  struct pool pool;
+
+  /* Gaussian weights */
+  float *weights;
+  int radius;
+
+  /* Thresholds of the current frame */
+  int threshold;
+  float percentile;
+  float ratio;
+  float low;
+  float high;
+
+  /* Full frame buffers, shared between the bands */
+  float *temp;
+  float *nms;
+  uint8_t *edges;
+  uint32_t *stack;
+
+  /* Composed output, the caller's buffer or the engine's own */
+  uint8_t *rgba;
+  uint8_t *buffer;
+
+  /* Row bands, the propagation runs over bands of one parity at a time */
+  struct band *bands;
+  uint32_t band_count;
+  uint32_t parity;
+
+  /* Per worker scratch and histograms */
+  uint8_t *scratch;
+  size_t scratch_size;
+  uint32_t *hist;
+
+  /* Input of the current frame */
+  const uint8_t *src;
+  size_t stride;
+
+  /* Wrapped camera buffers */
+  uint8_t **inputs;
+  uint32_t input_count;
+  size_t input_stride;
+
+  /* Edges read back from the device when verifying */
+  uint8_t *check;
+};
+
+int initCPU(struct process *, const float *);
+int wrapCPU(struct cpu *, uint8_t * const *, uint32_t, size_t);
+void runCPU(struct cpu *, const uint8_t *, size_t, uint8_t *);
+uint32_t compareCPU(struct cpu *, const uint8_t *);
+void destroyCPU(struct cpu *);
+
+#endif /*__HOG_CPU_H__*/
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "loop.h"
+
+/**
+ * Creates an empty loop
+ */
+int
+initLoop(struct loop *loop)
+{
+  memset(loop, 0, sizeof(*loop));
+  if ((loop->fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+    fprintf(stderr, "Loop: Cannot create epoll instance\n");
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Wakes the loop whenever a descriptor is readable
+ * @param drain Reset the counter of an eventfd once it fires
+ */
+int
+watchFd(struct loop *loop, int fd, int drain)
+{
+  struct epoll_event evt;
+
+  if (loop->count >= LOOP_MAX_FDS)
+  {
+    fprintf(stderr, "Loop: Too many descriptors\n");
+    return 0;
+  }
+
+  memset(&evt, 0, sizeof(evt));
+  evt.events = EPOLLIN;
+  evt.data.u32 = loop->count;
+  if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &evt) != 0)
+  {
+    fprintf(stderr, "Loop: Cannot watch descriptor (%s)\n", strerror(errno));
+    return 0;
+  }
+
+  loop->fds[loop->count] = fd;
+  loop->drain[loop->count] = drain;
+  loop->count++;
+  return 1;
+}
+
+/**
+ * Sleeps until any of the descriptors is readable
+ * Callers check their state before waiting, so a counter that fired in
+ * between wakes the loop at once.
+ * @param timeout Milliseconds, -1 to wait for an event
+ * @return Number of readable descriptors, 0 on timeout or signal, -1 on
+ * error
+ */
+int
+waitLoop(struct loop *loop, int timeout)
+{
+  struct epoll_event evts[LOOP_MAX_FDS];
+  uint64_t count;
+  uint32_t i;
+  int n, ret;
+
+  if ((n = epoll_wait(loop->fd, evts, LOOP_MAX_FDS, timeout)) < 0)
+  {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  for (i = 0; i < (uint32_t)n; ++i)
+  {
+    if (loop->drain[evts[i].data.u32])
+    {
+      do {
+        ret = read(loop->fds[evts[i].data.u32], &count, sizeof(count));
+      } while (ret < 0 && errno == EINTR);
+    }
+  }
+
+  return n;
+}
+
+/**
+ * Closes the loop, the descriptors stay with their owners
+ */
+void
+destroyLoop(struct loop *loop)
+{
+  if (loop->fd >= 0)
+  {
+    close(loop->fd);
+  }
+
+  loop->fd = -1;
+  loop->count = 0;
+}
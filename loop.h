@@ -0,0 +1,25 @@
+#ifndef __HOG_LOOP_H__
+#define __HOG_LOOP_H__
+
+/* Descriptors a loop can wait on */
+#define LOOP_MAX_FDS 16
+
+/**
+ * Event loop over file descriptors
+ * Counters such as eventfds are reset once they fire, anything else, such
+ * as the X connection or sockets, is left to be read by its owner.
+ */
+struct loop
+{
+  int fd;
+  int fds[LOOP_MAX_FDS];
+  int drain[LOOP_MAX_FDS];
+  int count;
+};
+
+int initLoop(struct loop *);
+int watchFd(struct loop *, int, int);
+int waitLoop(struct loop *, int);
+void destroyLoop(struct loop *);
+
+#endif /*__HOG_LOOP_H__*/
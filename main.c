@@ -2,9 +2,293 @@
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
-#include "camera.h"
+#include <signal.h>
+#include <time.h>
+#include "source.h"
 #include "window.h"
 #include "process.h"
+#include "stats.h"
+#include "writer.h"
+#include "loop.h"
+
+/* Largest number of regions given on the command line */
+#define MAX_REGIONS 16
+
+/* Cleared by SIGINT and SIGTERM to stop headless runs */
+static volatile sig_atomic_t running = 1;
+
+static void
+onSignal(int sig)
+{
+  (void)sig;
+  running = 0;
+}
+
+/**
+ * Returns the monotonic clock in nanoseconds, the one capture times use
+ */
+static uint64_t
+monotonic(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Writes the last finished frame as raw RGBA straight from its pixels
+ * Batched streams follow each other without the padding between them.
+ */
+static int
+writeResult(FILE *out, struct process *proc)
+{
+  size_t row = proc->width * 4;
+  const uint8_t *base;
+  uint32_t i, y;
+
+  if (proc->pitch == row && proc->streams == 1)
+  {
+    return fwrite(proc->result, row * proc->height, 1, out) == 1;
+  }
+
+  for (i = 0; i < proc->streams; ++i)
+  {
+    base = proc->result + (size_t)i * proc->stripe * proc->pitch;
+    for (y = 0; y < proc->stream_height; ++y)
+    {
+      if (fwrite(base + y * proc->pitch, row, 1, out) != 1)
+      {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Queues the edge bitmap of the last finished frame, a record per stream
+ */
+static int
+writeEdges(struct writer *w, struct process *proc, uint64_t frame)
+{
+  const uint8_t *base;
+  uint32_t i;
+
+  for (i = 0; i < proc->streams; ++i)
+  {
+    base = (const uint8_t*)proc->packed +
+           (size_t)i * proc->stripe * proc->packed_pitch;
+    if (!pushEdges(w, frame, i, (const uint32_t*)base, proc->packed_pitch))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Restricts processing to the regions or the mask of the command line,
+ * the same in every stream of a batch
+ * @param mask File of one byte per pixel of a stream, NULL if none
+ */
+static int
+initRegions(struct process *proc, uint32_t (*regions)[4], uint32_t count,
+            const char *mask)
+{
+  uint8_t *pixels;
+  size_t size;
+  uint32_t i, j;
+  FILE *file;
+  int ret;
+
+  for (i = 0; i < proc->streams; ++i)
+  {
+    for (j = 0; j < count; ++j)
+    {
+      if (!addRegion(proc, regions[j][0], regions[j][1] + i * proc->stripe,
+                     regions[j][2], regions[j][3]))
+      {
+        return 0;
+      }
+    }
+  }
+
+  if (!mask)
+  {
+    return 1;
+  }
+
+  size = (size_t)proc->width * proc->stream_height;
+  if (!(pixels = (uint8_t*)calloc(proc->width, proc->height)))
+  {
+    return 0;
+  }
+
+  if (!(file = fopen(mask, "rb")) || fread(pixels, size, 1, file) != 1)
+  {
+    fprintf(stderr, "Cannot read a %ux%u mask from '%s'\n", proc->width,
+            proc->stream_height, mask);
+    if (file)
+    {
+      fclose(file);
+    }
+    free(pixels);
+    return 0;
+  }
+
+  fclose(file);
+  for (i = 1; i < proc->streams; ++i)
+  {
+    memcpy(pixels + (size_t)i * proc->stripe * proc->width, pixels, size);
+  }
+
+  ret = maskRegions(proc, pixels);
+  free(pixels);
+  return ret;
+}
+
+/**
+ * Opens the sources of a batch
+ * @return 0 unless all of them open with the same size and format
+ */
+static int
+initSources(struct source *srcs, uint32_t count)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; ++i)
+  {
+    if (!initSource(&srcs[i]))
+    {
+      fprintf(stderr, "Cannot open source '%s'\n", srcs[i].path);
+      return 0;
+    }
+
+    if (srcs[i].width != srcs[0].width || srcs[i].height != srcs[0].height ||
+        srcs[i].format != srcs[0].format ||
+        srcs[i].studio != srcs[0].studio)
+    {
+      fprintf(stderr, "Source '%s' does not match '%s'\n", srcs[i].path,
+              srcs[0].path);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Fills a batch with the next frame of every source
+ * @return 0 if any of them has no frame
+ */
+static int
+getFrames(struct source *srcs, uint32_t count, struct process *proc,
+          uint8_t *buf)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; ++i)
+  {
+    if (!getFrame(&srcs[i], buf + streamOffset(proc, i)))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Returns the milliseconds until every source of a batch has a frame
+ * @return 0 if they all have one, -1 if cameras have yet to signal
+ */
+static int
+untilFrames(struct source *srcs, uint32_t count)
+{
+  int64_t due, wait;
+  uint32_t i;
+
+  for (i = 0, wait = 0; i < count; ++i)
+  {
+    if ((due = untilFrame(&srcs[i])) < 0)
+    {
+      return -1;
+    }
+    wait = due > wait ? due : wait;
+  }
+
+  return (int)((wait + 999999) / 1000000);
+}
+
+/**
+ * Sets up the loop to wake on frames of cameras, finished frames and
+ * window events, files are only waited for until they are due
+ */
+static int
+initEvents(struct loop *loop, struct source *srcs, uint32_t count,
+           struct process *proc, struct window *wnd)
+{
+  uint32_t i;
+  int fd;
+
+  if (!initLoop(loop))
+  {
+    return 0;
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    if ((fd = sourceFd(&srcs[i])) >= 0 && !watchFd(loop, fd, 1))
+    {
+      return 0;
+    }
+  }
+
+  return (proc->signal < 0 || watchFd(loop, proc->signal, 1)) &&
+         (proc->headless || watchFd(loop, windowFd(wnd), 0));
+}
+
+/**
+ * Destroys the sources of a batch
+ */
+static void
+destroySources(struct source *srcs, uint32_t count)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; ++i)
+  {
+    destroySource(&srcs[i]);
+  }
+}
+
+/**
+ * Wraps the camera buffers as device inputs
+ */
+static int
+wrapSource(struct source *src, struct process *proc)
+{
+  uint8_t **ptrs;
+  uint32_t i;
+  int ret;
+
+  if (!(ptrs = (uint8_t**)malloc(sizeof(uint8_t*) * src->dev.buffer_count)))
+  {
+    return 0;
+  }
+
+  for (i = 0; i < src->dev.buffer_count; ++i)
+  {
+    ptrs[i] = (uint8_t*)src->dev.buffers[i].ptr;
+  }
+
+  ret = wrapInputs(proc, ptrs, src->dev.buffer_count, src->dev.stride);
+  free(ptrs);
+  return ret;
+}
 
 /**
  * Entry point of the application
@@ -15,90 +299,638 @@ main(int argc, char **argv)
   static struct option options[] =
   {
     { "width",  required_argument, 0, 'w' },
-    { "height", required_argument, 0, 'h' }
+    { "height", required_argument, 0, 'h' },
+    { "format", required_argument, 0, 'f' },
+    { "fps",    required_argument, 0, 'r' },
+    { "fast",   no_argument,       0, 'x' },
+    { "zero-copy", no_argument,    0, 'z' },
+    { "depth",  required_argument, 0, 'd' },
+    { "sigma",  required_argument, 0, 's' },
+    { "radius", required_argument, 0, 'k' },
+    { "split",  no_argument,       0, 'S' },
+    { "passes", required_argument, 0, 'p' },
+    { "low",    required_argument, 0, 'l' },
+    { "high",   required_argument, 0, 'u' },
+    { "auto",   required_argument, 0, 'a' },
+    { "percentile", required_argument, 0, 'q' },
+    { "ratio",  required_argument, 0, 'R' },
+    { "backend", required_argument, 0, 'b' },
+    { "threads", required_argument, 0, 'j' },
+    { "verify", no_argument,       0, 'V' },
+    { "platform", required_argument, 0, 'P' },
+    { "device", required_argument, 0, 'D' },
+    { "device-type", required_argument, 0, 't' },
+    { "devices", required_argument, 0, 'm' },
+    { "list-devices", no_argument, 0, 'L' },
+    { "headless", no_argument,     0, 'n' },
+    { "output", required_argument, 0, 'o' },
+    { "stats",  required_argument, 0, 'T' },
+    { "cache",  required_argument, 0, 'C' },
+    { "edges",  required_argument, 0, 'e' },
+    { "encoding", required_argument, 0, 'E' },
+    { "roi",    required_argument, 0, 'i' },
+    { "mask",   required_argument, 0, 'M' },
+    { "incremental", required_argument, 0, 'I' },
+    { "swap",   required_argument, 0, 'y' },
+    { "every",  required_argument, 0, 'N' },
+    { "capture", required_argument, 0, 'c' },
+    { 0, 0, 0, 0 }
   };
 
-  struct camera dev;
+  struct source src[PROCESS_MAX_STREAMS];
   struct window wnd;
   struct process proc;
+  struct writer writer;
+  struct loop loop;
+  enum encoding encoding;
+  struct timespec start, end;
+  uint64_t frames;
+  uint32_t i, streams, spare;
+  double elapsed;
+  const char *output, *report, *edges, *mask;
+  uint32_t regions[MAX_REGIONS][4], region_count;
+  FILE *out;
   uint8_t *buf;
-  int c, idx;
+  int c, idx, busy, timeout;
+  /* Capture times of the frames in flight, by ring slot, and the latency
+     up to display of the frames that had one */
+  uint64_t stamps[PROCESS_DEPTH], latency, latency_sum, latency_max, timed;
+  uint32_t slot;
 
   /* Retrieve settings from the command line */
-  memset(&dev, 0, sizeof(dev));
-  while ((c = getopt_long(argc, argv, "w:h:", options, &idx)) != -1)
+  memset(src, 0, sizeof(src));
+  memset(&proc, 0, sizeof(proc));
+  proc.platform = proc.device = -1;
+  proc.low = proc.high = -1.0f;
+  memset(&wnd, 0, sizeof(wnd));
+  wnd.interval = 1;
+  memset(&writer, 0, sizeof(writer));
+  writer.fd = -1;
+  encoding = ENCODING_BITS;
+  output = report = edges = mask = NULL;
+  region_count = 0;
+  out = NULL;
+  while ((c = getopt_long(argc, argv,
+                          "w:h:f:r:xzd:s:k:Sp:l:u:a:q:R:b:j:VP:D:t:m:L"
+                          "no:T:C:e:E:i:M:I:y:N:c:",
+                          options, &idx)) != -1)
   {
     switch (c)
     {
       case 'w':
       {
-        dev.width = atoi(optarg);
+        src[0].width = atoi(optarg);
         break;
       }
       case 'h':
       {
-        dev.height = atoi(optarg);
+        src[0].height = atoi(optarg);
+        break;
+      }
+      case 'f':
+      {
+        if (!strcmp(optarg, "yuyv"))
+        {
+          src[0].file.format = READER_YUYV;
+        }
+        else if (!strcmp(optarg, "rgba"))
+        {
+          src[0].file.format = READER_RGBA;
+        }
+        else if (!strcmp(optarg, "y4m"))
+        {
+          src[0].file.format = READER_Y4M;
+        }
+        else
+        {
+          fprintf(stderr, "Unknown format '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case 'r':
+      {
+        src[0].fps = atof(optarg);
+        break;
+      }
+      case 'x':
+      {
+        src[0].fast = 1;
+        break;
+      }
+      case 'z':
+      {
+        src[0].zero_copy = 1;
+        break;
+      }
+      case 'd':
+      {
+        proc.depth = atoi(optarg);
+        break;
+      }
+      case 's':
+      {
+        proc.sigma = atof(optarg);
+        break;
+      }
+      case 'k':
+      {
+        proc.radius = atoi(optarg);
+        break;
+      }
+      case 'S':
+      {
+        proc.split = 1;
+        break;
+      }
+      case 'p':
+      {
+        proc.passes = atoi(optarg);
+        break;
+      }
+      case 'l':
+      {
+        proc.low = atof(optarg);
+        break;
+      }
+      case 'u':
+      {
+        proc.high = atof(optarg);
+        break;
+      }
+      case 'a':
+      {
+        if (!strcmp(optarg, "percentile"))
+        {
+          proc.threshold = THRESHOLD_PERCENTILE;
+        }
+        else if (!strcmp(optarg, "otsu"))
+        {
+          proc.threshold = THRESHOLD_OTSU;
+        }
+        else
+        {
+          fprintf(stderr, "Unknown threshold mode '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case 'q':
+      {
+        proc.percentile = atof(optarg);
+        break;
+      }
+      case 'R':
+      {
+        proc.ratio = atof(optarg);
+        break;
+      }
+      case 'b':
+      {
+        if (!strcmp(optarg, "opencl"))
+        {
+          proc.backend = BACKEND_OPENCL;
+        }
+        else if (!strcmp(optarg, "cpu"))
+        {
+          proc.backend = BACKEND_CPU;
+        }
+        else
+        {
+          fprintf(stderr, "Unknown backend '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case 'j':
+      {
+        proc.threads = atoi(optarg);
+        break;
+      }
+      case 'V':
+      {
+        proc.verify = 1;
+        break;
+      }
+      case 'P':
+      {
+        proc.platform = atoi(optarg);
+        break;
+      }
+      case 'D':
+      {
+        proc.device = atoi(optarg);
+        break;
+      }
+      case 't':
+      {
+        if (!strcmp(optarg, "gpu"))
+        {
+          proc.device_type = CL_DEVICE_TYPE_GPU;
+        }
+        else if (!strcmp(optarg, "cpu"))
+        {
+          proc.device_type = CL_DEVICE_TYPE_CPU;
+        }
+        else if (!strcmp(optarg, "accelerator"))
+        {
+          proc.device_type = CL_DEVICE_TYPE_ACCELERATOR;
+        }
+        else if (!strcmp(optarg, "all"))
+        {
+          proc.device_type = CL_DEVICE_TYPE_ALL;
+        }
+        else
+        {
+          fprintf(stderr, "Unknown device type '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case 'm':
+      {
+        proc.spread = atoi(optarg);
+        break;
+      }
+      case 'L':
+      {
+        listDevices();
+        return EXIT_SUCCESS;
+      }
+      case 'n':
+      {
+        proc.headless = 1;
+        break;
+      }
+      case 'o':
+      {
+        output = optarg;
+        break;
+      }
+      case 'T':
+      {
+        report = optarg;
+        proc.profile = 1;
+        break;
+      }
+      case 'C':
+      {
+        proc.cache = optarg;
+        break;
+      }
+      case 'e':
+      {
+        edges = optarg;
+        break;
+      }
+      case 'i':
+      {
+        if (region_count == MAX_REGIONS ||
+            sscanf(optarg, "%u,%u,%u,%u", &regions[region_count][0],
+                   &regions[region_count][1], &regions[region_count][2],
+                   &regions[region_count][3]) != 4)
+        {
+          fprintf(stderr, "Invalid region '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        ++region_count;
+        break;
+      }
+      case 'M':
+      {
+        mask = optarg;
+        break;
+      }
+      case 'I':
+      {
+        proc.incremental = atoi(optarg);
+        break;
+      }
+      case 'y':
+      {
+        wnd.interval = atoi(optarg);
+        break;
+      }
+      case 'N':
+      {
+        proc.every = atoi(optarg);
+        break;
+      }
+      case 'c':
+      {
+        if (!strcmp(optarg, "every"))
+        {
+          src[0].mode = CAPTURE_EVERY;
+        }
+        else if (!strcmp(optarg, "latest"))
+        {
+          src[0].mode = CAPTURE_LATEST;
+        }
+        else
+        {
+          fprintf(stderr, "Unknown capture mode '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case 'E':
+      {
+        if (!strcmp(optarg, "bits"))
+        {
+          encoding = ENCODING_BITS;
+        }
+        else if (!strcmp(optarg, "runs"))
+        {
+          encoding = ENCODING_RUNS;
+        }
+        else if (!strcmp(optarg, "points"))
+        {
+          encoding = ENCODING_POINTS;
+        }
+        else
+        {
+          fprintf(stderr, "Unknown encoding '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
         break;
       }
     }
   }
 
-  dev.camera = (optind < argc) ? argv[optind] : "/dev/video0";
+  if (report && !initStats(report, STATS_INTERVAL))
+  {
+    fprintf(stderr, "Cannot write stats to '%s', build with STATS=1\n",
+            report);
+    return EXIT_FAILURE;
+  }
 
-  if (!initCamera(&dev))
+  /* Every further source is another stream of the batch */
+  streams = optind < argc ? argc - optind : 1;
+  if (streams > PROCESS_MAX_STREAMS)
   {
-    destroyCamera(&dev);
-    fprintf(stderr, "Cannot open camera '%s'\n", dev.camera);
+    fprintf(stderr, "At most %d sources can be batched\n",
+            PROCESS_MAX_STREAMS);
     return EXIT_FAILURE;
   }
 
-  memset(&wnd, 0, sizeof(wnd));
-  wnd.width = dev.width;
-  wnd.height = dev.height;
-  if (!initWindow(&wnd))
+  if (streams > 1 && src[0].zero_copy)
+  {
+    fprintf(stderr, "Batched sources are copied, ignoring zero copy\n");
+    src[0].zero_copy = 0;
+  }
+
+  /* All of them share the settings of the command line */
+  for (i = 0; i < streams; ++i)
+  {
+    src[i] = src[0];
+    src[i].path = optind < argc ? argv[optind + i] : "/dev/video0";
+  }
+
+  if (!initSources(src, streams))
+  {
+    destroySources(src, streams);
+    return EXIT_FAILURE;
+  }
+
+  wnd.width = src[0].width;
+  wnd.height = src[0].height * streams;
+  if (!proc.headless && !initWindow(&wnd))
   {
-    destroyCamera(&dev);
+    destroySources(src, streams);
     destroyWindow(&wnd);
     fprintf(stderr, "Cannot create window\n");
     return EXIT_FAILURE;
   }
 
-  memset(&proc, 0, sizeof(proc));
-  proc.width = dev.width;
-  proc.height = dev.height;
+  /* The camera needs a buffer to fill while the others are in flight, the
+     latest frame waits in one more */
+  spare = src[0].mode == CAPTURE_LATEST ? 2 : 1;
+  if (src[0].zero_copy && src[0].dev.buffer_count <= spare)
+  {
+    fprintf(stderr, "Too few camera buffers, ignoring zero copy\n");
+    src[0].zero_copy = 0;
+  }
+  else if (src[0].zero_copy && proc.depth + spare > src[0].dev.buffer_count)
+  {
+    proc.depth = src[0].dev.buffer_count - spare;
+  }
+
+  proc.width = src[0].width;
+  proc.height = src[0].height;
+  proc.format = src[0].format;
+  proc.studio = src[0].studio;
+  proc.streams = streams;
+  proc.pack = edges != NULL;
+  proc.pack_only = proc.headless && !output;
   if (!initProcess(&proc))
   {
-    destroyCamera(&dev);
+    destroySources(src, streams);
     destroyWindow(&wnd);
     destroyProcess(&proc);
     fprintf(stderr, "Cannot create process\n");
     return EXIT_FAILURE;
   }
 
-  if (!(buf = (uint8_t*)malloc(dev.width * dev.height * 4)))
+  if (!initRegions(&proc, regions, region_count, mask))
+  {
+    destroySources(src, streams);
+    destroyWindow(&wnd);
+    destroyProcess(&proc);
+    return EXIT_FAILURE;
+  }
+
+  /* Let the device read camera buffers in place */
+  if (src[0].zero_copy && !wrapSource(&src[0], &proc))
+  {
+    destroySources(src, streams);
+    destroyWindow(&wnd);
+    destroyProcess(&proc);
+    fprintf(stderr, "Cannot share camera buffers\n");
+    return EXIT_FAILURE;
+  }
+
+  /* Without a window results can only go to a file */
+  if (output && !(out = strcmp(output, "-") ? fopen(output, "wb") : stdout))
+  {
+    destroySources(src, streams);
+    destroyWindow(&wnd);
+    destroyProcess(&proc);
+    fprintf(stderr, "Cannot open output '%s'\n", output);
+    return EXIT_FAILURE;
+  }
+
+  /* Edges are encoded and written by a thread of their own */
+  if (edges && !initWriter(&writer, edges, encoding, proc.width,
+                           proc.stream_height))
   {
-    destroyCamera(&dev);
+    destroyWriter(&writer);
+    destroySources(src, streams);
     destroyWindow(&wnd);
     destroyProcess(&proc);
-    fprintf(stderr, "Cannot allocate buffer");
     return EXIT_FAILURE;
   }
 
-  startCamera(&dev);
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGPIPE, SIG_IGN);
+  for (i = 0; i < streams; ++i)
+  {
+    startSource(&src[i]);
+  }
 
-  while (updateWindow(&wnd))
+  if (!initEvents(&loop, src, streams, &proc, &wnd))
   {
-    getImage(&dev, buf);
-    processImage(&proc, buf);
-    displayImage(&wnd, &proc);
+    destroyLoop(&loop);
+    destroyWriter(&writer);
+    destroySources(src, streams);
+    destroyWindow(&wnd);
+    destroyProcess(&proc);
+    return EXIT_FAILURE;
   }
 
-  stopCamera(&dev);
+  frames = timed = latency_sum = latency_max = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (running && (proc.headless || updateWindow(&wnd)))
+  {
+    /* Keep the pipeline full with batches whose frames all arrived */
+    busy = 0;
+    timeout = -1;
+    if (!src[0].eof && proc.pending < proc.depth &&
+        (timeout = untilFrames(src, streams)) == 0)
+    {
+      busy = 1;
+      slot = (proc.head + proc.pending) % proc.depth;
+      if (src[0].zero_copy)
+      {
+        if ((idx = acquireFrame(&src[0])) >= 0)
+        {
+          submitFrame(&proc, idx);
+        }
+      }
+      else if ((buf = beginFrame(&proc)) &&
+               getFrames(src, streams, &proc, buf))
+      {
+        submitFrame(&proc, -1);
+      }
+
+      /* The batch ends with its shortest source */
+      for (i = 1; i < streams; ++i)
+      {
+        src[0].eof |= src[i].eof;
+      }
+
+      /* Latency counts from the oldest capture of the batch, files are
+         only stamped by builds with stats */
+      stamps[slot] = 0;
+      for (i = 0; i < streams; ++i)
+      {
+        if (src[i].timestamp &&
+            (!stamps[slot] || src[i].timestamp < stamps[slot]))
+        {
+          stamps[slot] = src[i].timestamp;
+        }
+      }
+    }
 
-  free(buf);
+    /* Show the oldest frame as soon as it finished */
+    if (frameFinished(&proc))
+    {
+      busy = 1;
+      slot = proc.head;
+      finishFrame(&proc, &idx);
+      if (out && !writeResult(out, &proc))
+      {
+        fprintf(stderr, "Cannot write output\n");
+        running = 0;
+      }
+      if (edges && !writeEdges(&writer, &proc, frames))
+      {
+        running = 0;
+      }
+      releaseFrame(&src[0], idx);
+      if (!proc.headless && proc.output)
+      {
+        STAT_START(display);
+        displayImage(&wnd, &proc);
+        STAT_STOP(STAT_DISPLAY, display);
+      }
+      if (stamps[slot])
+      {
+        latency = monotonic() - stamps[slot];
+        recordStat(STAT_LATENCY, latency);
+        latency_sum += latency;
+        latency_max = latency > latency_max ? latency : latency_max;
+        ++timed;
+      }
+      ++frames;
+    }
+    else if (src[0].eof && proc.pending == 0)
+    {
+      break;
+    }
+
+    /* Sleep until a frame arrives or finishes or the window has events */
+    if (!busy)
+    {
+      STAT_START(wait);
+      waitLoop(&loop, timeout);
+      STAT_STOP(STAT_WAIT, wait);
+    }
+  }
+
+  while (finishFrame(&proc, &idx))
+  {
+    releaseFrame(&src[0], idx);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (i = 0; i < streams; ++i)
+  {
+    stopSource(&src[i]);
+  }
+
+  /* Report throughput */
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  if (elapsed > 0.0)
+  {
+    fprintf(stderr, "%llu frames in %.3fs (%.2f fps)\n",
+            (unsigned long long)frames, elapsed, frames / elapsed);
+  }
+
+  if (timed > 0)
+  {
+    fprintf(stderr, "Latency from capture %.2fms mean, %.2fms max\n",
+            latency_sum * 1e-6 / timed, latency_max * 1e-6);
+  }
+
+  for (i = 0; i < streams; ++i)
+  {
+    if (src[i].cap.dropped > 0)
+    {
+      fprintf(stderr, "%llu of %llu frames of '%s' dropped for newer ones\n",
+              (unsigned long long)src[i].cap.dropped,
+              (unsigned long long)src[i].cap.captured, src[i].path);
+    }
+  }
+
+  if (proc.cells_total > 0)
+  {
+    fprintf(stderr, "%llu of %llu cells skipped (%.1f%%)\n",
+            (unsigned long long)proc.cells_skipped,
+            (unsigned long long)proc.cells_total,
+            100.0 * proc.cells_skipped / proc.cells_total);
+  }
+
+  if (out && out != stdout)
+  {
+    fclose(out);
+  }
+
+  destroyLoop(&loop);
+  destroyWriter(&writer);
+  destroyStats();
   destroyWindow(&wnd);
-  destroyCamera(&dev);
+  destroySources(src, streams);
   destroyProcess(&proc);
   return EXIT_SUCCESS;
 }
-
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include "pool.h"
+
+struct worker
+{
+  struct pool *pool;
+  uint32_t id;
+};
+
+/**
+ * Runs tasks of the current batch until none are left
+ * @return Number of tasks run
+ */
+static uint32_t
+drainPool(struct pool *pool, uint32_t id)
+{
+  uint32_t task, ran;
+
+  ran = 0;
+  while ((task = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+         pool->tasks)
+  {
+    pool->fn(pool->arg, task, id);
+    ++ran;
+  }
+
+  return ran;
+}
+
+/**
+ * Worker thread, sleeps until a batch is posted
+ */
+static void *
+workerMain(void *arg)
+{
+  struct worker *self = (struct worker*)arg;
+  struct pool *pool = self->pool;
+  uint64_t seen;
+  uint32_t ran;
+
+  seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+  {
+    while (!pool->quit && pool->batch == seen)
+    {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+
+    if (pool->quit)
+    {
+      break;
+    }
+
+    /* A batch only completes once every worker that joined it left */
+    seen = pool->batch;
+    pool->active++;
+    pthread_mutex_unlock(&pool->lock);
+    ran = drainPool(pool, self->id);
+    pthread_mutex_lock(&pool->lock);
+
+    pool->finished += ran;
+    pool->active--;
+    if (pool->finished == pool->tasks && pool->active == 0)
+    {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  free(self);
+  return NULL;
+}
+
+/**
+ * Starts the worker threads
+ * @param count Number of threads including the caller, 0 for one per core
+ */
+int
+initPool(struct pool *pool, uint32_t count)
+{
+  struct worker *w;
+  long cores;
+  uint32_t i;
+
+  if (count == 0)
+  {
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    count = cores > 0 ? (uint32_t)cores : 1;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->tasks = pool->next = pool->finished = pool->active = 0;
+  pool->batch = 0;
+  pool->quit = 0;
+  pool->count = 1;
+
+  if (!(pool->threads = (pthread_t*)calloc(count, sizeof(pthread_t))))
+  {
+    return 0;
+  }
+
+  for (i = 1; i < count; ++i)
+  {
+    if (!(w = (struct worker*)malloc(sizeof(struct worker))))
+    {
+      return 0;
+    }
+
+    w->pool = pool;
+    w->id = i;
+    if (pthread_create(&pool->threads[i], NULL, workerMain, w) != 0)
+    {
+      free(w);
+      return 0;
+    }
+
+    pool->count++;
+  }
+
+  return 1;
+}
+
+/**
+ * Runs a batch of tasks on the pool and waits for all of them
+ */
+void
+runPool(struct pool *pool, task_fn fn, void *arg, uint32_t tasks)
+{
+  uint32_t ran;
+
+  if (tasks == 0)
+  {
+    return;
+  }
+
+  /* Workers that woke up late for the previous batch must leave first */
+  pthread_mutex_lock(&pool->lock);
+  while (pool->active > 0)
+  {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->tasks = tasks;
+  pool->next = 0;
+  pool->finished = 0;
+  pool->batch++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  /* The caller takes tasks as well instead of idling */
+  ran = drainPool(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->finished += ran;
+  while (pool->finished < pool->tasks || pool->active > 0)
+  {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void
+destroyPool(struct pool *pool)
+{
+  uint32_t i;
+
+  if (!pool->threads)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 1; i < pool->count; ++i)
+  {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  free(pool->threads);
+  pool->threads = NULL;
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+}
@@ -0,0 +1,34 @@
+#ifndef __HOG_POOL_H__
+#define __HOG_POOL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Task callback, receives the task index and the worker running it */
+typedef void (*task_fn)(void *, uint32_t, uint32_t);
+
+struct pool
+{
+  /* Worker threads, the caller of runPool is worker 0 */
+  pthread_t *threads;
+  uint32_t count;
+
+  /* Current batch of tasks */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  task_fn fn;
+  void *arg;
+  uint32_t tasks;
+  uint32_t next;
+  uint32_t finished;
+  uint32_t active;
+  uint64_t batch;
+  int quit;
+};
+
+int initPool(struct pool *, uint32_t);
+void runPool(struct pool *, task_fn, void *, uint32_t);
+void destroyPool(struct pool *);
+
+#endif /*__HOG_POOL_H__*/
@@ -1,230 +1,2210 @@
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <GL/glxew.h>
 #include "process.h"
 #include "program.h"
+#include "cpu.h"
+#include "stats.h"
+#include "build.h"
+
+/**
+ * Returns the pixels of an input texel as a power of two, YUYV packs two
+ * pixels into a texel, GREY four
+ */
+static inline int
+inputShift(struct process *proc)
+{
+  return proc->format == V4L2_PIX_FMT_YUYV ? 1 :
+         proc->format == V4L2_PIX_FMT_GREY ? 2 : 0;
+}
+
+/**
+ * Returns the width of the input image in texels
+ */
+static inline size_t
+inputWidth(struct process *proc)
+{
+  return proc->width >> inputShift(proc);
+}
+
+/**
+ * Rounds a global work size up to a multiple of the tile size
+ */
+static inline size_t
+roundUp(size_t size, size_t tile)
+{
+  return (size + tile - 1) / tile * tile;
+}
+
+/* Candidate formats of the intermediate images, best first */
+static const cl_image_format FMT_UNORM[] =
+{
+  { CL_R, CL_UNORM_INT8 }, { CL_RGBA, CL_UNORM_INT8 }, { 0, 0 }
+};
+static const cl_image_format FMT_FLOAT[] =
+{
+  { CL_R, CL_HALF_FLOAT }, { CL_R, CL_FLOAT }, { CL_RGBA, CL_HALF_FLOAT },
+  { 0, 0 }
+};
+static const cl_image_format FMT_UINT[] =
+{
+  { CL_R, CL_UNSIGNED_INT8 }, { CL_RGBA, CL_UNSIGNED_INT8 }, { 0, 0 }
+};
+
+/* Formats of luma, temp, blur, mag, dir and nms */
+static const cl_image_format *formats[] =
+{
+  FMT_UNORM, FMT_FLOAT, FMT_FLOAT, FMT_FLOAT, FMT_UINT, FMT_FLOAT
+};
+
+/* Names of the profiled stages, as used in reports */
+const char * const stageNames[STAGE_COUNT] =
+{
+  "upload", "luma", "blur_h", "blur_v", "sobel", "nms", "histogram",
+  "thresholds", "hyst_init", "hyst_tile", "final", "pack", "output"
+};
+
+/* Kernels in the order of proc->kernels, the luma and final ones have
+   YUYV and GREY versions */
+static const char *KERNELS[] =
+{
+  "krnLuma", "krnBlurH", "krnBlurV", "krnSobel", "krnNMS", "krnHystInit",
+  "krnFinal", "krnSobelNMS", "krnHystTile", "krnHistogram", "krnThresholds",
+  "krnPack", "krnDiff", "krnDilate"
+};
+
+/* Kernels bound to the tile size, krnThresholds runs as a single group of
+   a tile's size without requiring it */
+static const int TILED[] = { 1, 2, 7, 8, 9, 10 };
+
+/* Pass flags at the start of a frame, the first pass always runs */
+static const cl_int HYST_FLAGS[PROCESS_MAX_PASSES + 1] = { 1 };
+
+/**
+ * Picks the first candidate format the device supports
+ */
+static int
+pickFormat(struct process *proc, const cl_image_format *fmts,
+           cl_image_format *fmt)
+{
+  cl_image_format supported[128];
+  cl_uint count, i;
+
+  if (clGetSupportedImageFormats(proc->context, CL_MEM_READ_WRITE,
+                                 CL_MEM_OBJECT_IMAGE2D, 128, supported,
+                                 &count) != CL_SUCCESS)
+  {
+    return 0;
+  }
+
+  count = count > 128 ? 128 : count;
+  for (; fmts->image_channel_order; ++fmts)
+  {
+    for (i = 0; i < count; ++i)
+    {
+      if (supported[i].image_channel_order == fmts->image_channel_order &&
+          supported[i].image_channel_data_type == fmts->image_channel_data_type)
+      {
+        *fmt = *fmts;
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Shrinks a square work group until the kernel can run with it
+ */
+static size_t
+fitTile(cl_kernel kernel, cl_device_id dev, size_t tile)
+{
+  size_t max;
+
+  if (clGetKernelWorkGroupInfo(kernel, dev, CL_KERNEL_WORK_GROUP_SIZE,
+                               sizeof(max), &max, NULL) != CL_SUCCESS)
+  {
+    return tile;
+  }
+
+  while (tile > 1 && tile * tile > max)
+  {
+    tile >>= 1;
+  }
+
+  return tile;
+}
+
+/**
+ * Computes the normalised weights of the separable Gaussian blur
+ */
+static void
+initWeights(struct process *proc, float *weights)
+{
+  float sum;
+  int i, r;
+
+  proc->sigma = proc->sigma > 0.0f ? proc->sigma : 1.4f;
+  if (proc->radius == 0)
+  {
+    proc->radius = (uint32_t)ceilf(3.0f * proc->sigma);
+  }
+  if (proc->radius > PROCESS_MAX_RADIUS)
+  {
+    proc->radius = PROCESS_MAX_RADIUS;
+  }
+
+  r = proc->radius;
+  sum = 0.0f;
+  for (i = -r; i <= r; ++i)
+  {
+    weights[i + r] = expf(-(i * i) / (2.0f * proc->sigma * proc->sigma));
+    sum += weights[i + r];
+  }
+
+  for (i = 0; i <= 2 * r; ++i)
+  {
+    weights[i] /= sum;
+  }
+}
+
+/**
+ * Applies the threshold defaults
+ */
+static void
+initThresholds(struct process *proc)
+{
+  proc->low = proc->low >= 0.0f ? proc->low : 0.01f;
+  proc->high = proc->high >= 0.0f ? proc->high : 0.3f;
+  proc->percentile = proc->percentile > 0.0f && proc->percentile <= 1.0f
+                   ? proc->percentile : 0.8f;
+  proc->ratio = proc->ratio > 0.0f && proc->ratio <= 1.0f
+              ? proc->ratio : 0.4f;
+  if (proc->threshold < THRESHOLD_FIXED || proc->threshold > THRESHOLD_OTSU)
+  {
+    proc->threshold = THRESHOLD_FIXED;
+  }
+}
+
+/**
+ * Returns the slot for the first or last event of a stage
+ * @return NULL unless profiling, so nothing is recorded
+ */
+static inline cl_event *
+stageEvent(struct process *proc, struct frame *frame, enum stage stage,
+           int last)
+{
+  return proc->profile ? &frame->events[stage][last] : NULL;
+}
+
+/**
+ * Stores the stage times of a finished frame and releases its events
+ */
+static void
+collectTimes(struct process *proc, struct frame *frame)
+{
+  cl_ulong start, end;
+  cl_event first, last;
+  size_t i, j;
+
+  for (i = 0; i < STAGE_COUNT; ++i)
+  {
+    first = frame->events[i][0];
+    last = frame->events[i][1] ? frame->events[i][1] : first;
+    proc->times[i] = 0;
+    if (first &&
+        clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START,
+                                sizeof(start), &start, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_END,
+                                sizeof(end), &end, NULL) == CL_SUCCESS &&
+        end > start)
+    {
+      proc->times[i] = end - start;
+    }
+
+    for (j = 0; j < 2; ++j)
+    {
+      if (frame->events[i][j])
+      {
+        clReleaseEvent(frame->events[i][j]);
+        frame->events[i][j] = NULL;
+      }
+    }
+  }
+}
+
+/**
+ * Packs edges into a bitmap on the host, as krnPack does on devices
+ */
+static void
+packEdges(struct process *proc, const uint8_t *edges, uint32_t *bits)
+{
+  size_t words = proc->packed_pitch / 4;
+  uint32_t x, y, word;
+
+  for (y = 0; y < proc->height; ++y, edges += proc->width, bits += words)
+  {
+    for (x = 0, word = 0; x < proc->width; ++x)
+    {
+      /* Strong edges, the only ones left after hysteresis */
+      word |= (uint32_t)(edges[x] == 2) << (x & 31);
+      if ((x & 31) == 31 || x == proc->width - 1)
+      {
+        bits[x >> 5] = word;
+        word = 0;
+      }
+    }
+  }
+}
+
+/**
+ * Creates the staging buffer, input image and output texture of a frame
+ */
+static int
+initFrame(struct process *proc, struct frame *frame)
+{
+  cl_image_format fmt = { CL_RGBA, CL_UNORM_INT8 };
+  size_t size;
+  cl_int err;
+
+  frame->index = -1;
+  frame->done = NULL;
+
+  /* Output texture, shared with OpenCL if possible */
+  if (!proc->headless)
+  {
+    glGenTextures(1, &frame->texture);
+    glBindTexture(GL_TEXTURE_2D, frame->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, proc->width, proc->height, 0,
+                 GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glFinish();
+  }
+
+  /* The native engine composes into plain memory */
+  if (proc->backend == BACKEND_CPU)
+  {
+    size = inputWidth(proc) * proc->height * 4;
+    frame->pitch = proc->width * 4;
+    if (posix_memalign((void**)&frame->data, 4096, size) ||
+        posix_memalign((void**)&frame->pixels, 4096,
+                       frame->pitch * proc->height) ||
+        (proc->pack &&
+         posix_memalign((void**)&frame->bits, 4096,
+                        proc->packed_pitch * proc->height)))
+    {
+      fprintf(stderr, "CPU: Cannot allocate frame\n");
+      return 0;
+    }
+
+    return 1;
+  }
+
+  if (proc->shared)
+  {
+    frame->out = clCreateFromGLTexture2D(proc->context, CL_MEM_READ_WRITE,
+                                         GL_TEXTURE_2D, 0, frame->texture,
+                                         &err);
+  }
+  else
+  {
+    /* Pinned, so mapping it once the frame is done costs no copy */
+    frame->out = clCreateImage2D(proc->context,
+                                 CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                                 &fmt, proc->width, proc->height, 0, NULL,
+                                 &err);
+  }
+
+  if (!frame->out)
+  {
+    fprintf(stderr, "OpenCL: Cannot create buffer (%d)\n", err);
+    return 0;
+  }
+
+  /* Pinned as well, the bitmap is all that is read back */
+  if (proc->pack &&
+      !(frame->packed = clCreateBuffer(proc->context,
+                                       CL_MEM_WRITE_ONLY |
+                                       CL_MEM_ALLOC_HOST_PTR,
+                                       proc->packed_pitch * proc->height,
+                                       NULL, &err)))
+  {
+    fprintf(stderr, "OpenCL: Cannot create buffer (%d)\n", err);
+    return 0;
+  }
+
+  /* Input image, YUYV packs two pixels into a texel */
+  if (!(frame->input = clCreateImage2D(proc->context, CL_MEM_READ_ONLY, &fmt,
+                                       inputWidth(proc), proc->height,
+                                       0, NULL, &err)))
+  {
+    fprintf(stderr, "OpenCL: Cannot create buffer (%d)\n", err);
+    return 0;
+  }
+
+  /* Pinned host memory, so non-blocking writes can be DMA transfers */
+  size = inputWidth(proc) * proc->height * 4;
+  if (!(frame->host = clCreateBuffer(proc->context, CL_MEM_ALLOC_HOST_PTR,
+                                     size, NULL, &err)) ||
+      !(frame->data = clEnqueueMapBuffer(proc->devices[0].upload,
+                                         frame->host, CL_TRUE,
+                                         CL_MAP_WRITE, 0, size, 0, NULL,
+                                         NULL, &err)))
+  {
+    fprintf(stderr, "OpenCL: Cannot create staging buffer (%d)\n", err);
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Releases the resources of a frame
+ */
+static void
+destroyFrame(struct process *proc, struct frame *frame)
+{
+  if (frame->done)
+  {
+    clWaitForEvents(1, &frame->done);
+    clReleaseEvent(frame->done);
+    frame->done = NULL;
+  }
+
+  collectTimes(proc, frame);
+
+  if (proc->backend == BACKEND_CPU)
+  {
+    free(frame->data);
+    free(frame->pixels);
+    free(frame->bits);
+    frame->data = frame->pixels = NULL;
+    frame->bits = NULL;
+  }
+
+  if (frame->pixels)
+  {
+    clEnqueueUnmapMemObject(proc->devices[0].queue, frame->out, frame->pixels,
+                            0, NULL, NULL);
+    clFinish(proc->devices[0].queue);
+    frame->pixels = NULL;
+  }
+
+  if (frame->bits)
+  {
+    clEnqueueUnmapMemObject(proc->devices[0].queue, frame->packed,
+                            frame->bits, 0, NULL, NULL);
+    clFinish(proc->devices[0].queue);
+    frame->bits = NULL;
+  }
+
+  if (frame->data)
+  {
+    clEnqueueUnmapMemObject(proc->devices[0].upload, frame->host,
+                            frame->data, 0, NULL, NULL);
+    clFinish(proc->devices[0].upload);
+    frame->data = NULL;
+  }
+
+  if (frame->host)
+  {
+    clReleaseMemObject(frame->host);
+    frame->host = 0;
+  }
+
+  if (frame->input)
+  {
+    clReleaseMemObject(frame->input);
+    frame->input = 0;
+  }
+
+  if (frame->out)
+  {
+    clReleaseMemObject(frame->out);
+    frame->out = 0;
+  }
+
+  if (frame->packed)
+  {
+    clReleaseMemObject(frame->packed);
+    frame->packed = 0;
+  }
+
+  if (frame->texture)
+  {
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDeleteTextures(1, &frame->texture);
+    frame->texture = 0;
+  }
+}
+
+/**
+ * Streams the pixels of a frame into its texture through an orphaned
+ * unpack buffer, so the upload never waits for the previous draw
+ */
+static void
+uploadOutput(struct process *proc, struct frame *frame)
+{
+  size_t size = frame->pitch * proc->height;
+  void *ptr;
+
+  if (!proc->pbo)
+  {
+    glGenBuffers(1, &proc->pbo);
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, proc->pbo);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+  if ((ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                              GL_MAP_WRITE_BIT |
+                              GL_MAP_INVALIDATE_BUFFER_BIT)))
+  {
+    memcpy(ptr, frame->pixels, size);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    glBindTexture(GL_TEXTURE_2D, frame->texture);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, frame->pitch / 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, proc->width, proc->height,
+                    GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+/**
+ * Initialises the ring of frames
+ */
+static int
+initRing(struct process *proc)
+{
+  uint32_t i;
+
+  proc->depth = proc->depth ? proc->depth : 1;
+  proc->depth = proc->depth > PROCESS_DEPTH ? PROCESS_DEPTH : proc->depth;
+  proc->head = proc->pending = 0;
+  for (i = 0; i < proc->depth; ++i)
+  {
+    if (!initFrame(proc, &proc->frames[i]))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Checks whether a device supports an extension
+ */
+static int
+hasExtension(cl_device_id dev, const char *name)
+{
+  char *ext;
+  size_t size;
+  int found;
+
+  if (clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, NULL,
+                      &size) != CL_SUCCESS ||
+      !(ext = (char*)malloc(size + 1)))
+  {
+    return 0;
+  }
+
+  found = clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, size, ext,
+                          NULL) == CL_SUCCESS;
+  ext[found ? size : 0] = '\0';
+  found = strstr(ext, name) != NULL;
+  free(ext);
+  return found;
+}
+
+/**
+ * Prints the platforms and devices with the indices used to select them
+ */
+void
+listDevices(void)
+{
+  cl_platform_id platforms[16];
+  cl_device_id ids[16];
+  cl_device_type type;
+  cl_uint np, nd, p, d;
+  char name[256];
+
+  if (clGetPlatformIDs(16, platforms, &np) != CL_SUCCESS)
+  {
+    fprintf(stderr, "OpenCL: No platforms found\n");
+    return;
+  }
+
+  for (p = 0; p < np && p < 16; ++p)
+  {
+    clGetPlatformInfo(platforms[p], CL_PLATFORM_NAME, sizeof(name), name,
+                      NULL);
+    printf("Platform %u: %s\n", p, name);
+    if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 16, ids,
+                       &nd) != CL_SUCCESS)
+    {
+      continue;
+    }
+
+    for (d = 0; d < nd && d < 16; ++d)
+    {
+      clGetDeviceInfo(ids[d], CL_DEVICE_NAME, sizeof(name), name, NULL);
+      clGetDeviceInfo(ids[d], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+      printf("  Device %u: %s (%s%s)\n", d, name,
+             (type & CL_DEVICE_TYPE_GPU) ? "gpu" :
+             (type & CL_DEVICE_TYPE_CPU) ? "cpu" : "accelerator",
+             (hasExtension(ids[d], "cl_khr_gl_sharing") ||
+              hasExtension(ids[d], "cl_APPLE_gl_sharing")) ? ", gl sharing"
+                                                            : "");
+    }
+  }
+}
+
+/**
+ * Selects the devices of the first platform matching the settings
+ * Device indices count devices of the requested type on that platform.
+ */
+static int
+pickDevices(struct process *proc, cl_platform_id *platform)
+{
+  cl_platform_id platforms[16];
+  cl_device_id ids[16];
+  cl_device_type type;
+  cl_uint np, nd, p, d, limit;
+
+  if (clGetPlatformIDs(16, platforms, &np) != CL_SUCCESS || np == 0)
+  {
+    fprintf(stderr, "OpenCL: No platforms found\n");
+    return 0;
+  }
+
+  type = proc->device_type ? proc->device_type : CL_DEVICE_TYPE_GPU;
+  limit = proc->spread ? proc->spread : 1;
+  limit = limit > PROCESS_MAX_DEVICES ? PROCESS_MAX_DEVICES : limit;
+  for (p = 0; p < np && p < 16; ++p)
+  {
+    if ((proc->platform >= 0 && p != (cl_uint)proc->platform) ||
+        clGetDeviceIDs(platforms[p], type, 16, ids, &nd) != CL_SUCCESS)
+    {
+      continue;
+    }
+
+    nd = nd > 16 ? 16 : nd;
+    if (proc->device >= 0)
+    {
+      if ((cl_uint)proc->device >= nd)
+      {
+        continue;
+      }
+
+      ids[0] = ids[proc->device];
+      nd = 1;
+    }
+
+    proc->device_count = 0;
+    for (d = 0; d < nd && d < limit; ++d)
+    {
+      proc->devices[proc->device_count++].id = ids[d];
+    }
+
+    *platform = platforms[p];
+    return 1;
+  }
+
+  fprintf(stderr, "OpenCL: No matching device found\n");
+  return 0;
+}
+
+/**
+ * Creates the queues and intermediate buffers of a device
+ */
+static int
+initDevice(struct process *proc, struct device *dev)
+{
+  cl_command_queue_properties props;
+  cl_uint hist[PROCESS_HIST_BINS];
+  cl_float limits[2];
+  cl_image_format fmt;
+  cl_int err;
+  size_t i;
+
+  props = proc->profile ? CL_QUEUE_PROFILING_ENABLE : 0;
+  if (!(dev->queue = clCreateCommandQueue(proc->context, dev->id, props,
+                                          &err)) ||
+      !(dev->upload = clCreateCommandQueue(proc->context, dev->id, props,
+                                           &err)))
+  {
+    fprintf(stderr, "OpenCL: Cannot create command queue\n");
+    return 0;
+  }
+
+  /* Kernels built for a tile run with nothing else, it was checked to fit
+     every device, otherwise the largest square work group that fits */
+  dev->tile = proc->variant->tile ? proc->variant->tile : 16;
+  dev->tile = fitTile(proc->krnBlurH, dev->id, dev->tile);
+  dev->tile = fitTile(proc->krnBlurV, dev->id, dev->tile);
+  dev->tile = fitTile(proc->krnSobelNMS, dev->id, dev->tile);
+  dev->tile = fitTile(proc->krnHystTile, dev->id, dev->tile);
+  dev->tile = fitTile(proc->krnHistogram, dev->id, dev->tile);
+  dev->tile = fitTile(proc->krnThresholds, dev->id, dev->tile);
+
+  /* Create the intermediate buffers, each in the smallest format */
+  for (i = 0; i < sizeof(dev->images) / sizeof(dev->images[0]); ++i)
+  {
+    /* Gradients never leave local memory in the fused kernel */
+    if (!proc->split && (&dev->images[i] == &dev->mag ||
+                         &dev->images[i] == &dev->dir))
+    {
+      continue;
+    }
+
+    if (!pickFormat(proc, formats[i], &fmt))
+    {
+      fprintf(stderr, "OpenCL: No suitable image format\n");
+      return 0;
+    }
+
+    if (!(dev->images[i] = clCreateImage2D(proc->context, CL_MEM_READ_WRITE,
+                                           &fmt, proc->width, proc->height,
+                                           0, NULL, &err)))
+    {
+      fprintf(stderr, "OpenCL: Cannot create buffer (%d)\n", err);
+      return 0;
+    }
+  }
+
+  /* Hysteresis state, one byte per pixel, and the histogram, which starts
+     cleared as krnThresholds clears it after each frame. Adaptive mode
+     starts from the fixed thresholds until edges show up. */
+  memset(hist, 0, sizeof(hist));
+  limits[0] = proc->low;
+  limits[1] = proc->high;
+  if (!(dev->edges = clCreateBuffer(proc->context, CL_MEM_READ_WRITE,
+                                    proc->width * proc->height, NULL,
+                                    &err)) ||
+      !(dev->flags = clCreateBuffer(proc->context, CL_MEM_READ_WRITE,
+                                    sizeof(HYST_FLAGS), NULL, &err)) ||
+      !(dev->hist = clCreateBuffer(proc->context,
+                                   CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                   sizeof(hist), hist, &err)) ||
+      !(dev->limits = clCreateBuffer(proc->context,
+                                     CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                     sizeof(limits), limits, &err)))
+  {
+    fprintf(stderr, "OpenCL: Cannot create buffer (%d)\n", err);
+    return 0;
+  }
+
+  /* Previous input and the cell flags of the incremental mode */
+  if (proc->incremental &&
+      (!(dev->prev = clCreateBuffer(proc->context, CL_MEM_READ_WRITE,
+                                    inputWidth(proc) * proc->height * 4,
+                                    NULL, &err)) ||
+       !(dev->changed = clCreateBuffer(proc->context, CL_MEM_READ_WRITE,
+                                       proc->cells, NULL, &err)) ||
+       !(dev->dirty = clCreateBuffer(proc->context, CL_MEM_READ_WRITE,
+                                     proc->cells, NULL, &err)) ||
+       !(dev->count = clCreateBuffer(proc->context, CL_MEM_READ_WRITE,
+                                     sizeof(cl_uint), NULL, &err))))
+  {
+    fprintf(stderr, "OpenCL: Cannot create buffer (%d)\n", err);
+    return 0;
+  }
+
+  /* Edges start undefined, only whole frames write all of them */
+  dev->stale = 1;
+  dev->since = 0;
+  return 1;
+}
+
+/**
+ * Releases the queues and buffers of a device
+ */
+static void
+destroyDevice(struct device *dev)
+{
+  cl_mem *mems[] = {
+    &dev->edges, &dev->flags, &dev->hist, &dev->limits, &dev->prev,
+    &dev->changed, &dev->dirty, &dev->count
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof(dev->images) / sizeof(dev->images[0]); ++i)
+  {
+    if (dev->images[i]) 
+    {
+      clReleaseMemObject(dev->images[i]);
+      dev->images[i] = 0;
+    }
+  }
+
+  for (i = 0; i < sizeof(mems) / sizeof(mems[0]); ++i)
+  {
+    if (*mems[i])
+    {
+      clReleaseMemObject(*mems[i]);
+      *mems[i] = 0;
+    }
+  }
+
+  if (dev->upload)
+  {
+    clReleaseCommandQueue(dev->upload);
+    dev->upload = 0;
+  }
+
+  if (dev->queue)
+  {
+    clReleaseCommandQueue(dev->queue);
+    dev->queue = 0;
+  }
+}
+
+/**
+ * Returns the largest square work group every device can run
+ */
+static uint32_t
+commonTile(struct process *proc)
+{
+  uint32_t tile, i;
+  size_t max;
+
+  tile = 16;
+  for (i = 0; i < proc->device_count; ++i)
+  {
+    if (clGetDeviceInfo(proc->devices[i].id, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                        sizeof(max), &max, NULL) != CL_SUCCESS)
+    {
+      return 0;
+    }
+
+    while (tile > 1 && tile * tile > max)
+    {
+      tile >>= 1;
+    }
+  }
+
+  return tile;
+}
+
+/**
+ * Checks whether a variant was built for the given settings
+ */
+static int
+sameVariant(const struct variant *a, const struct variant *b)
+{
+  return a->width == b->width && a->height == b->height &&
+         a->stream == b->stream && a->stripe == b->stripe &&
+         a->radius == b->radius && a->tile == b->tile &&
+         a->incremental == b->incremental && a->half == b->half &&
+         a->threshold == b->threshold &&
+         (a->threshold != THRESHOLD_FIXED ||
+          (a->low == b->low && a->high == b->high));
+}
+
+static void
+destroyVariant(struct variant *v)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(v->kernels) / sizeof(v->kernels[0]); ++i)
+  {
+    if (v->kernels[i])
+    {
+      clReleaseKernel(v->kernels[i]);
+      v->kernels[i] = 0;
+    }
+  }
+
+  if (v->prog)
+  {
+    clReleaseProgram(v->prog);
+    v->prog = 0;
+  }
+}
+
+/**
+ * Builds the program and kernels of a variant, the settings are passed
+ * as macros so the compiler can fold them
+ */
+static int
+buildVariant(struct process *proc, struct variant *v)
+{
+  float weights[2 * PROCESS_MAX_RADIUS + 1];
+  cl_device_id ids[PROCESS_MAX_DEVICES];
+  char options[2048];
+  const char *name;
+  size_t n, i, j;
+  cl_int err;
+
+  initWeights(proc, weights);
+  n = snprintf(options, sizeof(options),
+               "-Werror -DWIDTH=%u -DHEIGHT=%u -DRADIUS=%u -DWEIGHTS=",
+               v->width, v->height, v->radius);
+  for (i = 0; i <= 2 * v->radius && n < sizeof(options); ++i)
+  {
+    n += snprintf(options + n, sizeof(options) - n, "%s%af", i ? "," : "",
+                  weights[i]);
+  }
+
+  if (v->tile && n < sizeof(options))
+  {
+    n += snprintf(options + n, sizeof(options) - n, " -DTILE=%u", v->tile);
+  }
+
+  if (v->stripe && n < sizeof(options))
+  {
+    n += snprintf(options + n, sizeof(options) - n,
+                  " -DSTREAM=%u -DSTRIPE=%u", v->stream, v->stripe);
+  }
+
+  if (v->incremental && n < sizeof(options))
+  {
+    n += snprintf(options + n, sizeof(options) - n, " -DINCREMENTAL=%u",
+                  v->incremental);
+  }
+
+  if (v->half && n < sizeof(options))
+  {
+    n += snprintf(options + n, sizeof(options) - n, " -DHALF_TILES");
+  }
+
+  if (v->threshold >= 0 && n < sizeof(options))
+  {
+    n += snprintf(options + n, sizeof(options) - n, " -DADAPTIVE=%d",
+                  v->threshold != THRESHOLD_FIXED);
+  }
+
+  if (v->threshold == THRESHOLD_FIXED && n < sizeof(options))
+  {
+    n += snprintf(options + n, sizeof(options) - n, " -DLOW=%af -DHIGH=%af",
+                  v->low, v->high);
+  }
+
+  if (n >= sizeof(options))
+  {
+    return 0;
+  }
+
+  /* Build the program, or load it from the binary cache */
+  for (i = 0; i < proc->device_count; ++i)
+  {
+    ids[i] = proc->devices[i].id;
+  }
+
+  if (!(v->prog = buildProgram(proc->context, ids, proc->device_count,
+                               (const char*)program_cl, program_cl_len,
+                               options, proc->cache)))
+  {
+    return 0;
+  }
+
+  for (i = 0; i < sizeof(KERNELS) / sizeof(KERNELS[0]); ++i)
+  {
+    name = KERNELS[i];
+    if (proc->format == V4L2_PIX_FMT_YUYV && (i == 0 || i == 6))
+    {
+      name = i == 0 ? "krnLumaYUYV" : "krnFinalYUYV";
+    }
+    else if (proc->format == V4L2_PIX_FMT_GREY && (i == 0 || i == 6))
+    {
+      name = i == 6 ? "krnFinalGrey" :
+             proc->studio ? "krnLumaPlanar" : "krnLumaGrey";
+    }
+
+    if (!(v->kernels[i] = clCreateKernel(v->prog, name, &err)))
+    {
+      fprintf(stderr, "OpenCL: Cannot create kernel '%s'\n", name);
+      destroyVariant(v);
+      return 0;
+    }
+  }
+
+  /* The required work group size must still fit the compiled kernels */
+  for (i = 0; v->tile && i < proc->device_count; ++i)
+  {
+    for (j = 0; j < sizeof(TILED) / sizeof(TILED[0]); ++j)
+    {
+      if (fitTile(v->kernels[TILED[j]], proc->devices[i].id,
+                  v->tile) != v->tile)
+      {
+        destroyVariant(v);
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Makes the kernels of a variant current, building it unless cached
+ * A variant that does not build is replaced by one that runs with any
+ * tile size and thresholds.
+ */
+static int
+useVariant(struct process *proc, const struct variant *want)
+{
+  struct variant *v;
+  uint32_t i;
+
+  if (proc->variant && sameVariant(proc->variant, want))
+  {
+    return 1;
+  }
+
+  for (i = 0, v = NULL; i < PROCESS_VARIANTS && !v; ++i)
+  {
+    if (proc->variants[i].prog && sameVariant(&proc->variants[i], want))
+    {
+      v = &proc->variants[i];
+    }
+  }
+
+  if (!v)
+  {
+    /* The current kernels stay valid in case the build fails */
+    if (&proc->variants[proc->next_variant] == proc->variant)
+    {
+      proc->next_variant = (proc->next_variant + 1) % PROCESS_VARIANTS;
+    }
+    v = &proc->variants[proc->next_variant];
+    proc->next_variant = (proc->next_variant + 1) % PROCESS_VARIANTS;
+
+    destroyVariant(v);
+    v->width = want->width;
+    v->height = want->height;
+    v->stream = want->stream;
+    v->stripe = want->stripe;
+    v->radius = want->radius;
+    v->tile = want->tile;
+    v->incremental = want->incremental;
+    v->half = want->half;
+    v->threshold = want->threshold;
+    v->low = want->low;
+    v->high = want->high;
+    if (!buildVariant(proc, v))
+    {
+      if (!v->tile && v->threshold < 0)
+      {
+        return 0;
+      }
+
+      v->tile = 0;
+      v->threshold = -1;
+      if (!buildVariant(proc, v))
+      {
+        return 0;
+      }
+    }
+  }
+
+  proc->variant = v;
+  memcpy(proc->kernels, v->kernels, sizeof(proc->kernels));
+  return 1;
+}
+
+/**
+ * Switches variants if thresholds baked into the current one changed
+ */
+static void
+updateVariant(struct process *proc)
+{
+  struct variant want = *proc->variant;
+
+  if (want.threshold < 0)
+  {
+    return;
+  }
+
+  want.threshold = proc->threshold;
+  want.low = proc->low;
+  want.high = proc->high;
+  if (!useVariant(proc, &want))
+  {
+    fprintf(stderr, "OpenCL: Cannot build kernels for the new thresholds\n");
+  }
+}
 
 int
 initProcess(struct process * proc)
 {    
+  float weights[2 * PROCESS_MAX_RADIUS + 1];
+  cl_device_id ids[PROCESS_MAX_DEVICES];
+  struct variant want;
+  cl_image_format fmt;
 	cl_int err;
-  cl_uint count;
-  cl_device_id dev;
 	cl_platform_id platform;
-  size_t log, i;
-  char * tmp;
+  size_t i;
+
+  proc->signal = -1;
+  proc->callbacks = 0;
+  if (proc->format != V4L2_PIX_FMT_YUYV &&
+      proc->format != V4L2_PIX_FMT_RGBA32 &&
+      proc->format != V4L2_PIX_FMT_GREY)
+  {
+    fprintf(stderr, "OpenCL: Unsupported pixel format\n");
+    return 0;
+  }
+
+  /* Texels must not straddle the right border */
+  if (proc->width & ((1 << inputShift(proc)) - 1))
+  {
+    fprintf(stderr, "OpenCL: Width does not fill whole input texels\n");
+    return 0;
+  }
+
+  initWeights(proc, weights);
+  initThresholds(proc);
+
+  /* Stack the streams, padded so no work group straddles two of them */
+  proc->streams = proc->streams ? proc->streams : 1;
+  if (proc->streams > PROCESS_MAX_STREAMS)
+  {
+    fprintf(stderr, "OpenCL: At most %d streams can be batched\n",
+            PROCESS_MAX_STREAMS);
+    return 0;
+  }
+
+  proc->stream_height = proc->height;
+  proc->stripe = proc->height;
+  if (proc->streams > 1)
+  {
+    if (proc->backend == BACKEND_CPU || proc->verify)
+    {
+      fprintf(stderr, "OpenCL: Batched streams need the OpenCL backend "
+                      "without verification\n");
+      return 0;
+    }
+
+    proc->stripe = roundUp(proc->height, PROCESS_STRIPE_ALIGN);
+    proc->height = proc->stripe * proc->streams;
+  }
+
+  /* Cells of the incremental mode, zeros clear their flags each frame */
+  if (proc->incremental)
+  {
+    if (proc->backend == BACKEND_CPU || proc->verify)
+    {
+      fprintf(stderr, "OpenCL: Incremental mode needs the OpenCL backend "
+                      "without verification\n");
+      return 0;
+    }
+
+    proc->cells = roundUp(proc->width, PROCESS_CELL) / PROCESS_CELL *
+                  (roundUp(proc->height, PROCESS_CELL) / PROCESS_CELL);
+    if (!(proc->zeros = (uint8_t*)calloc(proc->cells + sizeof(cl_uint), 1)))
+    {
+      return 0;
+    }
+  }
+
+  /* Rows of the edge bitmap are whole words */
+  proc->packed_pitch = (proc->width + 31) / 32 * 4;
+  proc->pack_only &= proc->pack && proc->headless &&
+                     proc->backend == BACKEND_OPENCL;
+
+  /* The native engine needs neither a device nor shared textures */
+  if (proc->backend == BACKEND_CPU)
+  {
+    return initRing(proc) && initCPU(proc, weights);
+  }
+
+  if (!pickDevices(proc, &platform))
+  {
+    return 0;
+  }
+
+  /* Signalled as frames finish, so the host never blocks on them */
+  if ((proc->signal = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+  {
+    fprintf(stderr, "OpenCL: Cannot create eventfd\n");
+    return 0;
+  }
+
+  /* Share textures only if all devices can, otherwise map frames */
+  proc->shared = !proc->headless;
+  for (i = 0; i < proc->device_count; ++i)
+  {
+    ids[i] = proc->devices[i].id;
+    proc->shared &= hasExtension(ids[i], "cl_khr_gl_sharing") ||
+                    hasExtension(ids[i], "cl_APPLE_gl_sharing");
+  }
+  
+  /* Create the OpenCL context, GL is only queried when shared with */
+  cl_context_properties prop[] =
+  {
+    CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+    0, 0,
+    0, 0,
+    0
+  };
+
+  if (proc->shared)
+  {
+    prop[2] = CL_GL_CONTEXT_KHR;
+    prop[3] = (cl_context_properties)glXGetCurrentContext();
+    prop[4] = CL_GLX_DISPLAY_KHR;
+    prop[5] = (cl_context_properties)glXGetCurrentDisplay();
+  }
+
+	if (!(proc->context = clCreateContext(prop,
+                                        proc->device_count, ids, NULL, NULL,
+                                        &err)))
+	{
+		fprintf(stderr, "OpenCL: Cannot create context (%d)\n", err);
+		return 0;
+	}	
+
+  /* Specialise the kernels for the frame, the blur, the work group size
+     all devices can run, the storage of the intermediates and the
+     thresholds */
+  memset(&want, 0, sizeof(want));
+  want.width = proc->width;
+  want.height = proc->height;
+  want.stream = proc->stream_height;
+  want.stripe = proc->streams > 1 ? proc->stripe : 0;
+  want.radius = proc->radius;
+  want.tile = commonTile(proc);
+  want.incremental = proc->incremental ? PROCESS_CELL : 0;
+  want.half = pickFormat(proc, formats[2], &fmt) &&
+              fmt.image_channel_data_type == CL_HALF_FLOAT;
+  want.threshold = proc->threshold;
+  want.low = proc->low;
+  want.high = proc->high;
+  if (!useVariant(proc, &want))
+  {
+    return 0;
+  }
+
+  if (!(proc->weights = clCreateBuffer(proc->context,
+                                       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                       sizeof(float) * (2 * proc->radius + 1),
+                                       weights, &err)))
+  {
+    fprintf(stderr, "OpenCL: Cannot create buffer (%d)\n", err);
+    return 0;
+  }
+
+  proc->passes = proc->passes ? proc->passes : 16;
+  proc->passes = proc->passes > PROCESS_MAX_PASSES
+               ? PROCESS_MAX_PASSES : proc->passes;
+  proc->next_device = 0;
+  for (i = 0; i < proc->device_count; ++i)
+  {
+    if (!initDevice(proc, &proc->devices[i]))
+    {
+      return 0;
+    }
+  }
+
+  if (!initRing(proc))
+  {
+    return 0;
+  }
+
+  /* Reference results to check the kernels against */
+  if (proc->verify && !initCPU(proc, weights))
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Wraps host buffers as input images
+ * The buffers must be page aligned and stay valid until destroyProcess.
+ */
+int
+wrapInputs(struct process *proc, uint8_t * const *ptrs, uint32_t count,
+           size_t stride)
+{
+  cl_image_format fmt = { CL_RGBA, CL_UNORM_INT8 };
+  cl_int err;
+  uint32_t i;
+
+  /* Camera buffers hold a single stream each */
+  if (proc->streams > 1)
+  {
+    fprintf(stderr, "OpenCL: Batched streams cannot be wrapped\n");
+    return 0;
+  }
+
+  if (proc->cpu && !wrapCPU(proc->cpu, ptrs, count, stride))
+  {
+    return 0;
+  }
+
+  if (proc->backend == BACKEND_CPU)
+  {
+    return 1;
+  }
+
+  if (!(proc->inputs = (cl_mem*)calloc(count, sizeof(cl_mem))))
+  {
+    return 0;
+  }
+
+  proc->input_count = count;
+  for (i = 0; i < count; ++i)
+  {
+    proc->inputs[i] = clCreateImage2D(proc->context,
+                                      CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+                                      &fmt, inputWidth(proc), proc->height,
+                                      stride, ptrs[i], &err);
+    if (!proc->inputs[i])
+    {
+      fprintf(stderr, "OpenCL: Cannot wrap buffer (%d)\n", err);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Marks every pixel of a device as no edge, blocks but only runs when the
+ * regions change
+ */
+static void
+clearEdges(struct process *proc, struct device *dev)
+{
+  uint8_t *zero;
+
+  if ((zero = (uint8_t*)calloc(proc->width, proc->height)))
+  {
+    clEnqueueWriteBuffer(dev->queue, dev->edges, CL_TRUE, 0,
+                         proc->width * proc->height, zero, 0, NULL, NULL);
+    free(zero);
+    dev->stale = 0;
+  }
+}
 
-  /* Retrieve device information */
-  clGetPlatformIDs(1, &platform, &count);
-  if (count <= 0) 
+/**
+ * Flags the cells whose input changed since the previous frame of the
+ * device, and the cells within reach of those, which are then processed
+ * Devices refresh every cell periodically, as well as on their first frame
+ * and when the regions change.
+ */
+static void
+findChanges(struct process *proc, struct frame *frame, cl_mem input)
+{
+  struct device *dev = frame->dev;
+  size_t inputSize[] = { inputWidth(proc), proc->height, 1 };
+  size_t cellSize[] = {
+    roundUp(proc->width, PROCESS_CELL) / PROCESS_CELL,
+    roundUp(proc->height, PROCESS_CELL) / PROCESS_CELL, 1
+  };
+  cl_int cell = PROCESS_CELL, cols = cellSize[0];
+  cl_int shift = inputShift(proc);
+  cl_int change = PROCESS_CHANGE;
+  cl_int reach = (proc->radius + 3 + PROCESS_CELL - 1) / PROCESS_CELL;
+  cl_int full = dev->stale || dev->since == 0;
+
+  dev->since = (dev->since + 1) % proc->incremental;
+  clEnqueueWriteBuffer(dev->queue, dev->changed, CL_FALSE, 0, proc->cells,
+                       proc->zeros, 0, NULL, NULL);
+  clEnqueueWriteBuffer(dev->queue, dev->count, CL_FALSE, 0, sizeof(cl_uint),
+                       proc->zeros, 0, NULL, NULL);
+
+  clSetKernelArg(proc->krnDiff, 0, sizeof(cl_mem), &input);
+  clSetKernelArg(proc->krnDiff, 1, sizeof(cl_mem), &dev->prev);
+  clSetKernelArg(proc->krnDiff, 2, sizeof(cl_mem), &dev->changed);
+  clSetKernelArg(proc->krnDiff, 3, sizeof(cl_int), &cell);
+  clSetKernelArg(proc->krnDiff, 4, sizeof(cl_int), &cols);
+  clSetKernelArg(proc->krnDiff, 5, sizeof(cl_int), &shift);
+  clSetKernelArg(proc->krnDiff, 6, sizeof(cl_int), &change);
+  clEnqueueNDRangeKernel(dev->queue, proc->krnDiff, 2, NULL, inputSize,
+                         NULL, 0, NULL, NULL);
+
+  clSetKernelArg(proc->krnDilate, 0, sizeof(cl_mem), &dev->changed);
+  clSetKernelArg(proc->krnDilate, 1, sizeof(cl_mem), &dev->dirty);
+  clSetKernelArg(proc->krnDilate, 2, sizeof(cl_mem), &dev->count);
+  clSetKernelArg(proc->krnDilate, 3, sizeof(cl_int), &reach);
+  clSetKernelArg(proc->krnDilate, 4, sizeof(cl_int), &full);
+  clEnqueueNDRangeKernel(dev->queue, proc->krnDilate, 2, NULL, cellSize,
+                         NULL, 0, NULL, NULL);
+
+  /* Lands before the frame is done, the queue is in order */
+  clEnqueueReadBuffer(dev->queue, dev->count, CL_FALSE, 0, sizeof(cl_uint),
+                      &frame->dirty, 0, NULL, NULL);
+}
+
+/**
+ * Returns the launch box of a region, grown by the halo and out to whole
+ * tiles so work groups line up with those of a full frame
+ * @param box Set to x0, y0, x1 and y1
+ */
+static void
+launchBox(const struct launch *l, const struct rect *r, size_t *box)
+{
+  size_t tile = l->dev->tile;
+
+  box[0] = r->x > l->grow ? (r->x - l->grow) / tile * tile : 0;
+  box[1] = r->y > l->grow ? (r->y - l->grow) / tile * tile : 0;
+  box[2] = roundUp(r->x + r->w + l->grow, tile);
+  box[3] = roundUp(r->y + r->h + l->grow, tile);
+  box[2] = box[2] < l->limit[0] ? box[2] : l->limit[0];
+  box[3] = box[3] < l->limit[1] ? box[3] : l->limit[1];
+}
+
+/**
+ * Enqueues the part of a box the boxes of the regions from up to until
+ * leave uncovered, split around the first one it overlaps. Boxes are
+ * tile aligned, and so are the parts.
+ */
+static void
+launchPart(struct launch *l, const size_t *box, const struct rect *from,
+           const struct rect *until)
+{
+  size_t tile[] = { l->dev->tile, l->dev->tile, 1 };
+  size_t other[4], part[4], offset[2], size[2];
+  const struct rect *r;
+  cl_event *event;
+
+  for (r = from; r != until; r = r->next)
   {
-    fprintf(stderr, "OpenCL: platforms found!\n");
-    return 0;
+    launchBox(l, r, other);
+    if (other[0] >= box[2] || other[2] <= box[0] ||
+        other[1] >= box[3] || other[3] <= box[1])
+    {
+      continue;
+    }
+
+    /* Rows above and below the overlap, then columns left and right */
+    memcpy(part, box, sizeof(part));
+    if (box[1] < other[1])
+    {
+      part[3] = other[1];
+      launchPart(l, part, r->next, until);
+    }
+    if (box[3] > other[3])
+    {
+      part[1] = other[3];
+      part[3] = box[3];
+      launchPart(l, part, r->next, until);
+    }
+
+    part[1] = box[1] > other[1] ? box[1] : other[1];
+    part[3] = box[3] < other[3] ? box[3] : other[3];
+    if (box[0] < other[0])
+    {
+      part[0] = box[0];
+      part[2] = other[0];
+      launchPart(l, part, r->next, until);
+    }
+    if (box[2] > other[2])
+    {
+      part[0] = other[2];
+      part[2] = box[2];
+      launchPart(l, part, r->next, until);
+    }
+    return;
   }
 
-  clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, &count);
-  if (count <= 0)
+  /* Uncovered, launch it unless the launches are only counted */
+  l->count++;
+  if (!l->total)
   {
-    fprintf(stderr, "OpenCL: devices found!\n");
-    return 0;
+    return;
   }
-	
-  clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, NULL, &i);
-  if (!(tmp = malloc(sizeof(char) * (i + 1))) || 
-      clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, i, tmp, NULL) != CL_SUCCESS)
+
+  offset[0] = box[0] >> l->shift;
+  offset[1] = box[1];
+  size[0] = ((box[2] + (1 << l->shift) - 1) >> l->shift) - offset[0];
+  size[1] = box[3] - box[1];
+
+  event = l->count == 1 ? l->first : l->count == l->total ? l->last : NULL;
+  clEnqueueNDRangeKernel(l->dev->queue, l->kernel, 2, offset, size,
+                         l->tiled ? tile : NULL, l->waits, l->wait, event);
+}
+
+/**
+ * Enqueues, or only counts, the launches of all regions
+ */
+static void
+launchRegions(struct launch *l)
+{
+  const struct rect *r;
+  size_t box[4];
+
+  for (l->count = 0, r = l->regions; r; r = r->next)
   {
-    if (tmp)
-    {
-      free(tmp);
-    }
+    launchBox(l, r, box);
+    launchPart(l, box, l->regions, r);
+  }
+}
 
-    fprintf(stderr, "OpenCL: Cannot retrieve extensions\n");
-    return 0;
+/**
+ * Enqueues a kernel over every region, or the whole frame without any
+ * Regions grow by the halo the later stages read and out to whole tiles.
+ * Where those overlap the kernel runs once, which keeps histograms exact.
+ * @param grow Halo around the regions in pixels
+ * @param tiled Run in tiles, untiled kernels stop at the image border
+ * @param shift Pixels per work item along x as a power of two
+ * @param first Event of the first launch, NULL if not needed
+ * @param last Event of the last launch if there are several
+ */
+static void
+enqueueRegions(struct process *proc, struct device *dev, cl_kernel kernel,
+               size_t grow, int tiled, int shift, cl_uint waits,
+               const cl_event *wait, cl_event *first, cl_event *last)
+{
+  struct rect full = { 0, 0, proc->width, proc->height, NULL };
+  struct launch l;
+
+  l.dev = dev;
+  l.kernel = kernel;
+  l.regions = proc->regions ? proc->regions : &full;
+  l.grow = grow;
+  l.limit[0] = tiled ? roundUp(proc->width, dev->tile) : proc->width;
+  l.limit[1] = tiled ? roundUp(proc->height, dev->tile) : proc->height;
+  l.tiled = tiled;
+  l.shift = shift;
+  l.waits = waits;
+  l.wait = wait;
+  l.first = first;
+  l.last = last;
+
+  /* Count the launches first, the last one signals its own event */
+  l.total = 0;
+  launchRegions(&l);
+  l.total = l.count;
+  launchRegions(&l);
+}
+
+/**
+ * Enqueues the kernels of a frame once its input is ready
+ */
+static void
+runPipeline(struct process *proc, struct frame *frame, cl_mem input,
+            cl_event ready)
+{
+  struct device *dev = frame->dev;
+  size_t workSize[] = { proc->width, proc->height, 1 };
+  size_t orig[] = { 0, 0, 0 };
+  size_t tileSize[] = { dev->tile, dev->tile, 1 };
+  size_t halo = proc->radius + 3;
+  const cl_mem *dirty = proc->incremental ? &dev->dirty : NULL;
+  cl_int radius = proc->radius;
+  cl_int width = proc->width, height = proc->height, pass;
+  cl_int adaptive = proc->threshold != THRESHOLD_FIXED;
+  size_t histSize = dev->tile * dev->tile;
+  size_t texel = proc->variant->half ? sizeof(cl_half) : sizeof(cl_float);
+  size_t packSize[] = { proc->packed_pitch / 4, proc->height, 1 };
+
+  if (proc->shared)
+  {
+    clEnqueueAcquireGLObjects(dev->queue, 1, &frame->out, 0, NULL, NULL);
+  }
+  else if (frame->pixels)
+  {
+    /* Done with the previous result of this frame */
+    clEnqueueUnmapMemObject(dev->queue, frame->out, frame->pixels,
+                            0, NULL, NULL);
+    frame->pixels = NULL;
   }
 
-  tmp[i] = '\0';
-  if (!strstr(tmp, "cl_khr_gl_sharing") && !strstr(tmp, "cl_APPLE_gl_sharing"))
+  if (frame->bits)
   {
-    free(tmp);
-    fprintf(stderr, "OpenCL: cl_khr_gl_sharing unavailable\n");
-    return 0;
+    clEnqueueUnmapMemObject(dev->queue, frame->packed, frame->bits,
+                            0, NULL, NULL);
+    frame->bits = NULL;
   }
-  
-  /* Create the OpenCL context */
-  const cl_context_properties prop[] =
+
+  /* Only cells within reach of a change are processed */
+  if (proc->incremental)
   {
-    CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
-    CL_GL_CONTEXT_KHR,   (cl_context_properties)glXGetCurrentContext(),
-    CL_GLX_DISPLAY_KHR,  (cl_context_properties)glXGetCurrentDisplay(),
-    0
-  };
+    findChanges(proc, frame, input);
+  }
 
-  free(tmp);
-	if (!(proc->context = clCreateContext(prop, 1, &dev, NULL, NULL, &err)))
-	{
-		fprintf(stderr, "OpenCL: Cannot create context (%d)\n", err);
-		return 0;
-	}	
+  /* Pixels outside of new regions are never classified again */
+  if (dev->stale)
+  {
+    clearEdges(proc, dev);
+  }
 
-  if (!(proc->queue = clCreateCommandQueue(proc->context, dev, 0, &err)))
+  /* Extract luma, packed inputs convert a texel of pixels per work item */
+  clSetKernelArg(proc->krnLuma, 0, sizeof(cl_mem), &input);
+  clSetKernelArg(proc->krnLuma, 1, sizeof(cl_mem), &dev->luma);
+  clSetKernelArg(proc->krnLuma, 2, sizeof(cl_mem), dirty);
+  enqueueRegions(proc, dev, proc->krnLuma, halo, 0, inputShift(proc), 1,
+                 &ready, stageEvent(proc, frame, STAGE_LUMA, 0),
+                 stageEvent(proc, frame, STAGE_LUMA, 1));
+
+  /* Blur it, rows first, then columns */
+  clSetKernelArg(proc->krnBlurH, 0, sizeof(cl_mem), &dev->luma);
+  clSetKernelArg(proc->krnBlurH, 1, sizeof(cl_mem), &dev->temp);
+  clSetKernelArg(proc->krnBlurH, 2, sizeof(cl_mem), &proc->weights);
+  clSetKernelArg(proc->krnBlurH, 3, sizeof(cl_int), &radius);
+  clSetKernelArg(proc->krnBlurH, 4, texel * tileSize[1] *
+                 (tileSize[0] + 2 * radius), NULL);
+  clSetKernelArg(proc->krnBlurH, 5, sizeof(cl_mem), dirty);
+  enqueueRegions(proc, dev, proc->krnBlurH, halo, 1, 0, 0, NULL,
+                 stageEvent(proc, frame, STAGE_BLUR_H, 0),
+                 stageEvent(proc, frame, STAGE_BLUR_H, 1));
+
+  clSetKernelArg(proc->krnBlurV, 0, sizeof(cl_mem), &dev->temp);
+  clSetKernelArg(proc->krnBlurV, 1, sizeof(cl_mem), &dev->blur);
+  clSetKernelArg(proc->krnBlurV, 2, sizeof(cl_mem), &proc->weights);
+  clSetKernelArg(proc->krnBlurV, 3, sizeof(cl_int), &radius);
+  clSetKernelArg(proc->krnBlurV, 4, texel * tileSize[0] *
+                 (tileSize[1] + 2 * radius), NULL);
+  clSetKernelArg(proc->krnBlurV, 5, sizeof(cl_mem), dirty);
+  enqueueRegions(proc, dev, proc->krnBlurV, halo, 1, 0, 0, NULL,
+                 stageEvent(proc, frame, STAGE_BLUR_V, 0),
+                 stageEvent(proc, frame, STAGE_BLUR_V, 1));
+
+  if (proc->split)
   {
-    fprintf(stderr, "OpenCL: Cannot create command queue\n");
-    return 0;
+    /* Reference path, gradients go through global memory */
+    clSetKernelArg(proc->krnSobel, 0, sizeof(cl_mem), &dev->blur);
+    clSetKernelArg(proc->krnSobel, 1, sizeof(cl_mem), &dev->mag);
+    clSetKernelArg(proc->krnSobel, 2, sizeof(cl_mem), &dev->dir);
+    clSetKernelArg(proc->krnSobel, 3, sizeof(cl_mem), dirty);
+    enqueueRegions(proc, dev, proc->krnSobel, halo, 0, 0, 0, NULL,
+                   stageEvent(proc, frame, STAGE_SOBEL, 0),
+                   stageEvent(proc, frame, STAGE_SOBEL, 1));
+
+    clSetKernelArg(proc->krnNMS, 0, sizeof(cl_mem), &dev->mag);
+    clSetKernelArg(proc->krnNMS, 1, sizeof(cl_mem), &dev->dir);
+    clSetKernelArg(proc->krnNMS, 2, sizeof(cl_mem), &dev->nms);
+    clSetKernelArg(proc->krnNMS, 3, sizeof(cl_mem), dirty);
+    enqueueRegions(proc, dev, proc->krnNMS, halo, 0, 0, 0, NULL,
+                   stageEvent(proc, frame, STAGE_NMS, 0),
+                   stageEvent(proc, frame, STAGE_NMS, 1));
+  }
+  else
+  {
+    clSetKernelArg(proc->krnSobelNMS, 0, sizeof(cl_mem), &dev->blur);
+    clSetKernelArg(proc->krnSobelNMS, 1, sizeof(cl_mem), &dev->nms);
+    clSetKernelArg(proc->krnSobelNMS, 2, texel *
+                   (tileSize[0] + 4) * (tileSize[1] + 4), NULL);
+    clSetKernelArg(proc->krnSobelNMS, 3, texel *
+                   (tileSize[0] + 2) * (tileSize[1] + 2), NULL);
+    clSetKernelArg(proc->krnSobelNMS, 4, sizeof(cl_mem), dirty);
+    enqueueRegions(proc, dev, proc->krnSobelNMS, halo, 1, 0, 0, NULL,
+                   stageEvent(proc, frame, STAGE_SOBEL, 0),
+                   stageEvent(proc, frame, STAGE_SOBEL, 1));
   }
 
-  /* Build the program */
-  tmp = (char*)program_cl;
-  if (!(proc->prog = clCreateProgramWithSource(proc->context, 1, 
-                                               (const char**)&tmp,
-                                               (const size_t*)&program_cl_len, 
-                                               &err)))
+  /* Derive the thresholds on the device, nothing is read back */
+  if (adaptive)
   {
-    fprintf(stderr, "OpenCL: Cannot create program\n");
-    return 0;
+    clSetKernelArg(proc->krnHistogram, 0, sizeof(cl_mem), &dev->nms);
+    clSetKernelArg(proc->krnHistogram, 1, sizeof(cl_mem), &dev->hist);
+    clSetKernelArg(proc->krnHistogram, 2, 
+                   sizeof(cl_uint) * PROCESS_HIST_BINS, NULL);
+    enqueueRegions(proc, dev, proc->krnHistogram, 0, 1, 0, 0, NULL,
+                   stageEvent(proc, frame, STAGE_HISTOGRAM, 0),
+                   stageEvent(proc, frame, STAGE_HISTOGRAM, 1));
+
+    clSetKernelArg(proc->krnThresholds, 0, sizeof(cl_mem), &dev->hist);
+    clSetKernelArg(proc->krnThresholds, 1, sizeof(cl_mem), &dev->limits);
+    clSetKernelArg(proc->krnThresholds, 2, sizeof(cl_int), &proc->threshold);
+    clSetKernelArg(proc->krnThresholds, 3, sizeof(cl_float), 
+                   &proc->percentile);
+    clSetKernelArg(proc->krnThresholds, 4, sizeof(cl_float), &proc->ratio);
+    clEnqueueNDRangeKernel(dev->queue, proc->krnThresholds, 1, NULL,
+                           &histSize, &histSize, 0, NULL,
+                           stageEvent(proc, frame, STAGE_THRESHOLDS, 0));
+  }
+
+  /* Classify pixels, then propagate strong edges along weak ones */
+  clSetKernelArg(proc->krnHystInit, 0, sizeof(cl_mem), &dev->nms);
+  clSetKernelArg(proc->krnHystInit, 1, sizeof(cl_mem), &dev->edges);
+  clSetKernelArg(proc->krnHystInit, 2, sizeof(cl_mem), &dev->limits);
+  clSetKernelArg(proc->krnHystInit, 3, sizeof(cl_int), &adaptive);
+  clSetKernelArg(proc->krnHystInit, 4, sizeof(cl_float), &proc->low);
+  clSetKernelArg(proc->krnHystInit, 5, sizeof(cl_float), &proc->high);
+  clSetKernelArg(proc->krnHystInit, 6, sizeof(cl_mem), dirty);
+  enqueueRegions(proc, dev, proc->krnHystInit, 0, 0, 0, 0, NULL,
+                 stageEvent(proc, frame, STAGE_HYST_INIT, 0),
+                 stageEvent(proc, frame, STAGE_HYST_INIT, 1));
+
+  clEnqueueWriteBuffer(dev->queue, dev->flags, CL_FALSE, 0,
+                       sizeof(cl_int) * (proc->passes + 1), HYST_FLAGS,
+                       0, NULL, NULL);
+  clSetKernelArg(proc->krnHystTile, 0, sizeof(cl_mem), &dev->edges);
+  clSetKernelArg(proc->krnHystTile, 1, sizeof(cl_mem), &dev->flags);
+  clSetKernelArg(proc->krnHystTile, 3, sizeof(cl_int), &width);
+  clSetKernelArg(proc->krnHystTile, 4, sizeof(cl_int), &height);
+  clSetKernelArg(proc->krnHystTile, 5, sizeof(cl_uchar) *
+                 (tileSize[0] + 2) * (tileSize[1] + 2), NULL);
+  clSetKernelArg(proc->krnHystTile, 6, sizeof(cl_mem), dirty);
+  for (pass = 0; pass < (cl_int)proc->passes; ++pass)
+  {
+    /* All passes count as one stage, from the first to the last */
+    clSetKernelArg(proc->krnHystTile, 2, sizeof(cl_int), &pass);
+    enqueueRegions(proc, dev, proc->krnHystTile, 0, 1, 0, 0, NULL,
+                   pass == 0 ?
+                   stageEvent(proc, frame, STAGE_HYST_TILE, 0) : NULL,
+                   pass == (cl_int)proc->passes - 1 ?
+                   stageEvent(proc, frame, STAGE_HYST_TILE, 1) : NULL);
+  }
+
+  /* Pack the edges, a 32nd of the composite. The queue is in order, the
+     composite read back after it finishes last unless it is skipped. */
+  if (proc->pack)
+  {
+    clSetKernelArg(proc->krnPack, 0, sizeof(cl_mem), &dev->edges);
+    clSetKernelArg(proc->krnPack, 1, sizeof(cl_mem), &frame->packed);
+    clSetKernelArg(proc->krnPack, 2, sizeof(cl_int), &width);
+    clEnqueueNDRangeKernel(dev->queue, proc->krnPack, 2, NULL,
+                           packSize, NULL, 0, NULL,
+                           stageEvent(proc, frame, STAGE_PACK, 0));
+    frame->bits = clEnqueueMapBuffer(dev->queue, frame->packed, CL_FALSE,
+                                     CL_MAP_READ, 0,
+                                     proc->packed_pitch * proc->height,
+                                     0, NULL,
+                                     proc->pack_only ? &frame->done : NULL,
+                                     NULL);
+  }
+
+  if (!proc->pack_only)
+  {
+    clSetKernelArg(proc->krnFinal, 0, sizeof(cl_mem), &dev->edges);
+    clSetKernelArg(proc->krnFinal, 1, sizeof(cl_mem), &input);
+    clSetKernelArg(proc->krnFinal, 2, sizeof(cl_mem), &frame->out);
+    clEnqueueNDRangeKernel(dev->queue, proc->krnFinal, 2, NULL, 
+                           workSize, NULL, 0, NULL,
+                           stageEvent(proc, frame, STAGE_FINAL, 0));
+  }
+
+  if (proc->shared)
+  {
+    clEnqueueReleaseGLObjects(dev->queue, 1, &frame->out, 0, NULL,
+                              &frame->done);
+  }
+  else if (!proc->pack_only)
+  {
+    frame->pixels = clEnqueueMapImage(dev->queue, frame->out, CL_FALSE,
+                                      CL_MAP_READ, orig, workSize,
+                                      &frame->pitch, NULL, 0, NULL,
+                                      &frame->done, NULL);
+  }
+
+  if (proc->profile)
+  {
+    clRetainEvent(frame->done);
+    frame->events[STAGE_OUTPUT][0] = frame->done;
+  }
+}
+
+/**
+ * Wakes the loop of the host once a frame finished, called by the runtime
+ * from a thread of its own
+ */
+static void CL_CALLBACK
+onFrameDone(cl_event event, cl_int status, void *arg)
+{
+  struct process *proc = (struct process*)arg;
+  uint64_t one = 1;
+
+  (void)event;
+  (void)status;
+  while (write(proc->signal, &one, sizeof(one)) < 0 && errno == EINTR);
+  __atomic_sub_fetch(&proc->callbacks, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Runs the native engine on a frame with the current settings
+ */
+static void
+runHost(struct process *proc, const uint8_t *data, int index, uint8_t *dest)
+{
+  struct cpu *cpu = proc->cpu;
+
+  cpu->threshold = proc->threshold;
+  cpu->percentile = proc->percentile;
+  cpu->ratio = proc->ratio;
+  if (proc->threshold == THRESHOLD_FIXED)
+  {
+    cpu->low = proc->low;
+    cpu->high = proc->high;
+  }
+
+  if (index >= 0)
+  {
+    runCPU(cpu, cpu->inputs[index], cpu->input_stride, dest);
+  }
+  else
+  {
+    runCPU(cpu, data, inputWidth(proc) * 4, dest);
+  }
+}
+
+/**
+ * Compares the edges of the frame just enqueued with the native engine
+ * Blocks until the device is done, only meant for testing.
+ */
+static void
+verifyFrame(struct process *proc, struct frame *frame, const uint8_t *data,
+            int index)
+{
+  uint32_t diff, total;
+
+  clEnqueueReadBuffer(frame->dev->queue, frame->dev->edges, CL_TRUE, 0,
+                      proc->width * proc->height, proc->cpu->check,
+                      0, NULL, NULL);
+  runHost(proc, data, index, NULL);
+
+  total = proc->width * proc->height;
+  if ((diff = compareCPU(proc->cpu, proc->cpu->check)) > 0)
+  {
+    fprintf(stderr, "Verify: %u of %u pixels differ (%.3f%%)\n",
+            diff, total, 100.0 * diff / total);
   }
+}
+
+/**
+ * Uploads the next frame and enqueues its kernels without waiting
+ * @param data Host image to upload
+ * @param index Wrapped input to use instead, -1 if none
+ */
+static void
+enqueueFrame(struct process *proc, const uint8_t *data, int index)
+{
+  size_t inputSize[] = { inputWidth(proc), proc->height, 1 };
+  size_t orig[] = { 0, 0, 0 };
+  struct device *dev;
+  struct frame *frame;
+  cl_event ready;
+  size_t pitch;
+  cl_mem input;
+  void *ptr;
 
-  tmp = "-Werror";
-  if (clBuildProgram(proc->prog, 1, &dev, tmp, NULL, NULL) != CL_SUCCESS)
+  frame = &proc->frames[(proc->head + proc->pending) % proc->depth];
+  frame->index = index;
+  if (proc->backend == BACKEND_CPU)
   {
-    clGetProgramBuildInfo(proc->prog, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log);
-    if ((tmp = (char*)malloc(sizeof(char) * (log + 1))) == NULL)
+    /* Finished by the time it returns, only the upload is left */
+    runHost(proc, data, index, frame->pixels);
+    if (proc->pack)
     {
-      fprintf(stderr, "OpenCL: Cannot build program\n");
-      return 0;
+      packEdges(proc, proc->cpu->edges, frame->bits);
     }
+    proc->pending++;
+    return;
+  }
 
-    clGetProgramBuildInfo(proc->prog, dev, CL_PROGRAM_BUILD_LOG, log, tmp, 0);
-    fprintf(stderr, "OpenCL: \n%s\n", tmp);
-    free(tmp);
-    return 0;
+  updateVariant(proc);
+
+  /* Devices take frames in turn */
+  frame->dev = dev = &proc->devices[proc->next_device];
+  proc->next_device = (proc->next_device + 1) % proc->device_count;
+  if (index >= 0)
+  {
+    /* Map and unmap to tell the runtime the host changed the buffer */
+    input = proc->inputs[index];
+    ptr = clEnqueueMapImage(dev->upload, input, CL_FALSE, CL_MAP_WRITE,
+                            orig, inputSize, &pitch, NULL, 0, NULL, NULL,
+                            NULL);
+    clEnqueueUnmapMemObject(dev->upload, input, ptr, 0, NULL, &ready);
+  }
+  else
+  {
+    input = frame->input;
+    clEnqueueWriteImage(dev->upload, input, CL_FALSE, orig, inputSize, 
+                        0, 0, data, 0, NULL, &ready);
+  }
+
+  if (proc->profile)
+  {
+    clRetainEvent(ready);
+    frame->events[STAGE_UPLOAD][0] = ready;
   }
-  
-  /* Retrieve the kernels */
-  const char * kernels[] = { 
-      "krnBlur", "krnSobel", "krnNMS", 
-      "krnHysteresis", "krnFinal"
-  };
 
-  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) 
+  /* Kernels wait for the upload, the next upload can start right away */
+  clFlush(dev->upload);
+  runPipeline(proc, frame, input, ready);
+  if (proc->signal >= 0)
   {
-    if (!(proc->kernels[i] = clCreateKernel(proc->prog, kernels[i], &err)))
+    __atomic_add_fetch(&proc->callbacks, 1, __ATOMIC_RELAXED);
+    if (clSetEventCallback(frame->done, CL_COMPLETE, onFrameDone,
+                           proc) != CL_SUCCESS)
     {
-      fprintf(stderr, "OpenCL: Cannot create kernel '%s'\n", kernels[i]);
-      return 0;
+      __atomic_sub_fetch(&proc->callbacks, 1, __ATOMIC_RELAXED);
     }
   }
+  clFlush(dev->queue);
+  clReleaseEvent(ready);
+
+  if (proc->verify)
+  {
+    verifyFrame(proc, frame, data, index);
+  }
+
+  proc->pending++;
+}
 
-  /* Initialise the output image */
-  glGenTextures(1, &proc->output);
-  glBindTexture(GL_TEXTURE_2D, proc->output);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, proc->width, proc->height, 0,
-               GL_RGB, GL_UNSIGNED_BYTE, NULL);
-  glBindTexture(GL_TEXTURE_2D, 0);
-  glFinish();
+/**
+ * Processes a single frame, waiting for the result
+ */
+void 
+processImage(struct process *proc, uint8_t *data)
+{
+  STAT_START(submit);
+  enqueueFrame(proc, data, -1);
+  STAT_STOP(STAT_SUBMIT, submit);
+  while (finishFrame(proc, NULL));
+}
 
-  if (!(proc->out = clCreateFromGLTexture2D(proc->context, CL_MEM_READ_WRITE,
-                                            GL_TEXTURE_2D, 0, proc->output,
-                                            &err)))
+/**
+ * Returns the staging buffer of the next frame
+ * @return NULL if all frames are in flight
+ */
+uint8_t *
+beginFrame(struct process *proc)
+{
+  if (proc->pending >= proc->depth)
   {
-    fprintf(stderr, "OpenCL: Cannot create buffer (%d)\n", err);
+    return NULL;
+  }
+
+  return proc->frames[(proc->head + proc->pending) % proc->depth].data;
+}
+
+/**
+ * Returns where the image of a stream goes in the staging buffer
+ * @param stream Index of the stream in the batch
+ */
+size_t
+streamOffset(struct process *proc, uint32_t stream)
+{
+  return (size_t)stream * proc->stripe * inputWidth(proc) * 4;
+}
+
+/**
+ * Flags the edges of every device for clearing once regions change
+ */
+static void
+regionsChanged(struct process *proc)
+{
+  uint32_t i;
+
+  for (i = 0; i < proc->device_count; ++i)
+  {
+    proc->devices[i].stale = 1;
+  }
+}
+
+/**
+ * Restricts processing to a rectangle, on top of those added before
+ * Pixels outside of all regions are never edges. Regions cover the whole
+ * batch, each stream is stripe rows below the previous one.
+ * @return 0 if the rectangle is empty or outside of the frame
+ */
+int
+addRegion(struct process *proc, uint32_t x, uint32_t y, uint32_t w,
+          uint32_t h)
+{
+  struct rect *r;
+
+  if (proc->backend != BACKEND_OPENCL || proc->verify)
+  {
+    fprintf(stderr, "OpenCL: Regions need the OpenCL backend without "
+                    "verification\n");
     return 0;
   }
 
-  /* Create the buffers */
-  cl_image_format fmt = { CL_RGBA, CL_UNORM_INT8 };
-  for (i = 1; i < sizeof(proc->images) / sizeof(proc->images[0]); ++i)
+  if (w == 0 || h == 0 || x >= proc->width || y >= proc->height ||
+      w > proc->width - x || h > proc->height - y)
   {
-    if (!(proc->images[i] = clCreateImage2D(proc->context, CL_MEM_READ_WRITE,
-                                            &fmt, proc->width, proc->height,
-                                            0, NULL, &err)))
+    fprintf(stderr, "OpenCL: Region %ux%u+%u+%u is outside of the frame\n",
+            w, h, x, y);
+    return 0;
+  }
+
+  if (!(r = (struct rect*)malloc(sizeof(struct rect))))
+  {
+    return 0;
+  }
+
+  r->x = x;
+  r->y = y;
+  r->w = w;
+  r->h = h;
+  r->next = proc->regions;
+  proc->regions = r;
+  regionsChanged(proc);
+  return 1;
+}
+
+/**
+ * Derives the regions from a mask of the frame, non zero bytes mark the
+ * pixels of interest
+ * The mask is covered with cells of PROCESS_STRIPE_ALIGN pixels, runs of
+ * cells with any pixel set make a region, which grows down as long as the
+ * rows below have the same run. An empty mask processes whole frames.
+ */
+int
+maskRegions(struct process *proc, const uint8_t *mask)
+{
+  const uint32_t cell = PROCESS_STRIPE_ALIGN;
+  uint32_t cx, cy, x, y, x0, x1, y1, end, run;
+  struct rect *r;
+  int active;
+
+  clearRegions(proc);
+  for (cy = 0; cy < proc->height; cy += cell)
+  {
+    y1 = cy + cell < proc->height ? cy + cell : proc->height;
+    for (cx = 0, x0 = 0, run = 0; cx < proc->width + cell; cx += cell)
     {
-      fprintf(stderr, "OpenCL: Cannot create buffer (%d)\n", err);
-      return 0;
+      /* Cells past the border end the last run */
+      x1 = cx + cell < proc->width ? cx + cell : proc->width;
+      for (y = cy, active = 0; cx < proc->width && y < y1 && !active; ++y)
+      {
+        for (x = cx; x < x1 && !active; ++x)
+        {
+          active = mask[y * proc->width + x] != 0;
+        }
+      }
+
+      if (active)
+      {
+        x0 = run++ ? x0 : cx;
+        continue;
+      }
+
+      if (run == 0)
+      {
+        continue;
+      }
+
+      /* Extend the region of the same run ending right above */
+      end = cx < proc->width ? cx : proc->width;
+      for (r = proc->regions; r; r = r->next)
+      {
+        if (r->x == x0 && r->w == end - x0 && r->y + r->h == cy)
+        {
+          r->h = y1 - r->y;
+          break;
+        }
+      }
+
+      if (!r && !addRegion(proc, x0, cy, end - x0, y1 - cy))
+      {
+        return 0;
+      }
+      run = 0;
     }
   }
 
   return 1;
 }
 
-void 
-processImage(struct process *proc, uint8_t *data)
+/**
+ * Goes back to processing whole frames
+ */
+void
+clearRegions(struct process *proc)
 {
-  size_t workSize[] = { proc->width, proc->height, 1 };
-  size_t orig[] = { 0, 0, 0 };
-
-  clEnqueueAcquireGLObjects(proc->queue, 1, &proc->out, 0, NULL, NULL);
+  struct rect *r;
 
-  /* Upload the source image */
-  clEnqueueWriteImage(proc->queue, proc->input, CL_FALSE, orig, workSize, 
-                      0, 0, data, 0, NULL, NULL);
+  while ((r = proc->regions))
+  {
+    proc->regions = r->next;
+    free(r);
+  }
 
-  /* Blur it */
-  clSetKernelArg(proc->krnBlur, 0, sizeof(cl_mem), &proc->input);
-  clSetKernelArg(proc->krnBlur, 1, sizeof(cl_mem), &proc->blur);
-  clEnqueueNDRangeKernel(proc->queue, proc->krnBlur, 2, NULL, 
-                         workSize, NULL, 0, NULL, NULL);  
-  
-  clSetKernelArg(proc->krnSobel, 0, sizeof(cl_mem), &proc->blur);
-  clSetKernelArg(proc->krnSobel, 1, sizeof(cl_mem), &proc->sobel);
-  clEnqueueNDRangeKernel(proc->queue, proc->krnSobel, 2, NULL, 
-                         workSize, NULL, 0, NULL, NULL);  
-  
-  clSetKernelArg(proc->krnNMS, 0, sizeof(cl_mem), &proc->sobel);
-  clSetKernelArg(proc->krnNMS, 1, sizeof(cl_mem), &proc->nms);
-  clEnqueueNDRangeKernel(proc->queue, proc->krnNMS, 2, NULL, 
-                         workSize, NULL, 0, NULL, NULL);  
-  
-  clSetKernelArg(proc->krnHysteresis, 0, sizeof(cl_mem), &proc->nms);
-  clSetKernelArg(proc->krnHysteresis, 1, sizeof(cl_mem), &proc->edges);
-  clEnqueueNDRangeKernel(proc->queue, proc->krnHysteresis, 2, NULL, 
-                         workSize, NULL, 0, NULL, NULL);  
-  
-  clSetKernelArg(proc->krnFinal, 0, sizeof(cl_mem), &proc->edges);
-  clSetKernelArg(proc->krnFinal, 1, sizeof(cl_mem), &proc->input);
-  clSetKernelArg(proc->krnFinal, 2, sizeof(cl_mem), &proc->out);
-  clEnqueueNDRangeKernel(proc->queue, proc->krnFinal, 2, NULL, 
-                         workSize, NULL, 0, NULL, NULL); 
-  
-  clEnqueueReleaseGLObjects(proc->queue, 1, &proc->out, 0, NULL, NULL);
-  clFinish(proc->queue);
+  regionsChanged(proc);
 }
 
+/**
+ * Submits the frame filled through beginFrame or a wrapped input
+ * @param index Wrapped input, -1 to upload the staging buffer
+ */
 void
-destroyProcess(struct process *proc)
+submitFrame(struct process *proc, int index)
+{
+  struct frame *frame;
+
+  if (proc->pending >= proc->depth)
+  {
+    return;
+  }
+
+  STAT_START(submit);
+  frame = &proc->frames[(proc->head + proc->pending) % proc->depth];
+  enqueueFrame(proc, frame->data, index);
+  STAT_STOP(STAT_SUBMIT, submit);
+}
+
+/**
+ * Checks whether the oldest frame in flight finished, without waiting
+ * Frames of the native engine finish as they are submitted.
+ */
+int
+frameFinished(struct process *proc)
+{
+  struct frame *frame;
+  cl_int status;
+
+  if (proc->pending == 0)
+  {
+    return 0;
+  }
+
+  frame = &proc->frames[proc->head];
+  if (!frame->done)
+  {
+    return 1;
+  }
+
+  /* Errors count as finished, finishFrame does not wait for them */
+  return clGetEventInfo(frame->done, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                        sizeof(status), &status, NULL) != CL_SUCCESS ||
+         status <= CL_COMPLETE;
+}
+
+/**
+ * Waits for the oldest frame in flight and makes it the output
+ * @param index Set to the wrapped input the frame used, which can be reused
+ * @return 0 if no frames are in flight
+ */
+int
+finishFrame(struct process *proc, int *index)
 {
+  struct frame *frame;
   size_t i;
+  int show;
+
+  if (proc->pending == 0)
+  {
+    return 0;
+  }
+
+  STAT_START(finish);
+  frame = &proc->frames[proc->head];
+  if (frame->done)
+  {
+    clWaitForEvents(1, &frame->done);
+    clReleaseEvent(frame->done);
+    frame->done = NULL;
+  }
 
-  for (i = 0; i < sizeof(proc->images) / sizeof(proc->images[0]); ++i)
+  STAT_STOP(STAT_FINISH, finish);
+  if (proc->profile)
   {
-    if (proc->images[i]) 
+    collectTimes(proc, frame);
+    for (i = 0; i < STAGE_COUNT; ++i)
     {
-      clReleaseMemObject(proc->images[i]);
-      proc->images[i] = 0;
+      if (proc->times[i])
+      {
+        recordStat(STAT_DEVICE + i, proc->times[i]);
+      }
     }
   }
 
-  for (i = 0; i < sizeof(proc->kernels) / sizeof(proc->kernels[0]); ++i)
+  /* Frames composed on the host or mapped from devices without texture
+     sharing are only uploaded if they are shown */
+  show = !proc->headless &&
+         proc->finished++ % (proc->every ? proc->every : 1) == 0;
+  if (show && !proc->shared)
+  {
+    uploadOutput(proc, frame);
+  }
+
+  proc->result = frame->pixels;
+  proc->pitch = frame->pitch;
+  proc->packed = frame->bits;
+  if (proc->incremental)
   {
-    if (proc->kernels[i]) 
+    proc->cells_total += proc->cells;
+    proc->cells_skipped += proc->cells - frame->dirty;
+  }
+
+  if (index)
+  {
+    *index = frame->index;
+  }
+
+  proc->output = show ? frame->texture : 0;
+  frame->index = -1;
+  proc->head = (proc->head + 1) % proc->depth;
+  proc->pending--;
+  return 1;
+}
+
+void
+destroyProcess(struct process *proc)
+{
+  struct pollfd fd;
+  uint64_t count;
+  size_t i;
+
+  clearRegions(proc);
+  free(proc->zeros);
+  proc->zeros = NULL;
+
+  if (proc->inputs)
+  {
+    for (i = 0; i < proc->input_count; ++i)
     {
-      clReleaseKernel(proc->kernels[i]);
-      proc->kernels[i] = 0;
+      if (proc->inputs[i])
+      {
+        clReleaseMemObject(proc->inputs[i]);
+      }
     }
+
+    free(proc->inputs);
+    proc->inputs = NULL;
   }
 
-  if (proc->queue)
+  if (proc->weights)
   {
-    clReleaseCommandQueue(proc->queue);
-    proc->queue = 0;
+    clReleaseMemObject(proc->weights);
+    proc->weights = 0;
   }
 
-  if (proc->prog)
+  for (i = 0; i < PROCESS_DEPTH; ++i)
   {
-    clReleaseProgram(proc->prog);
-    proc->prog = 0;
+    destroyFrame(proc, &proc->frames[i]);
   }
+  proc->pending = 0;
+
+  if (proc->pbo)
+  {
+    glDeleteBuffers(1, &proc->pbo);
+    proc->pbo = 0;
+  }
+
+  if (proc->cpu)
+  {
+    destroyCPU(proc->cpu);
+    proc->cpu = NULL;
+  }
+
+  /* The kernels are owned by the variants */
+  for (i = 0; i < PROCESS_VARIANTS; ++i)
+  {
+    destroyVariant(&proc->variants[i]);
+  }
+  memset(proc->kernels, 0, sizeof(proc->kernels));
+  proc->variant = NULL;
+  proc->next_variant = 0;
+
+  /* Frames are unmapped through the queues, so those go last */
+  for (i = 0; i < PROCESS_MAX_DEVICES; ++i)
+  {
+    destroyDevice(&proc->devices[i]);
+  }
+  proc->device_count = 0;
 
 	if (proc->context)
 	{
@@ -232,10 +2212,24 @@ destroyProcess(struct process *proc)
 		proc->context = 0;
 	}
 
-  if (proc->output)
+  /* Callbacks may still run after the queues finished, the descriptor
+     is only closed once every registered one wrote to it */
+  if (proc->signal >= 0)
   {
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glDeleteTextures(1, &proc->output);
-    proc->output = 0;
+    fd.fd = proc->signal;
+    fd.events = POLLIN;
+    while (__atomic_load_n(&proc->callbacks, __ATOMIC_ACQUIRE) > 0)
+    {
+      /* A callback counts down right after it wrote, hence the timeout */
+      if (poll(&fd, 1, 1) > 0)
+      {
+        while (read(proc->signal, &count, sizeof(count)) < 0 &&
+               errno == EINTR);
+      }
+    }
+    close(proc->signal);
+    proc->signal = -1;
   }
+
+  proc->output = 0;
 }
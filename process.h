@@ -1,58 +1,372 @@
 #ifndef __HOG_PROCESS_H__
 #define __HOG_PROCESS_H__
 
+#include <stdint.h>
+#include <linux/videodev2.h>
 #include <CL/cl.h>
 #include <CL/cl_gl.h>
 #include <GL/glew.h>
 
+/* Maximum number of frames in flight */
+#define PROCESS_DEPTH 8
+/* Largest supported blur radius */
+#define PROCESS_MAX_RADIUS 32
+/* Largest number of hysteresis propagation passes */
+#define PROCESS_MAX_PASSES 256
+/* Largest number of devices frames are spread over */
+#define PROCESS_MAX_DEVICES 4
+/* Largest number of streams batched into one frame */
+#define PROCESS_MAX_STREAMS 8
+/* Stream rows are padded to this, a multiple of every tile size */
+#define PROCESS_STRIPE_ALIGN 16
+/* Cells the incremental mode tracks changes in, a multiple of every tile
+   size, and the smallest change of a channel that counts, out of 255 */
+#define PROCESS_CELL 16
+#define PROCESS_CHANGE 8
+/* Program variants kept built, switching between them costs nothing */
+#define PROCESS_VARIANTS 4
+/* Bins of the magnitude histogram and the magnitude they cover */
+#define PROCESS_HIST_BINS  1024
+#define PROCESS_HIST_RANGE 2.0f
+
+/* Pipeline stages timed when profiling, the fused kernel counts as Sobel */
+enum stage
+{
+  STAGE_UPLOAD,
+  STAGE_LUMA,
+  STAGE_BLUR_H,
+  STAGE_BLUR_V,
+  STAGE_SOBEL,
+  STAGE_NMS,
+  STAGE_HISTOGRAM,
+  STAGE_THRESHOLDS,
+  STAGE_HYST_INIT,
+  STAGE_HYST_TILE,
+  STAGE_FINAL,
+  STAGE_PACK,
+  STAGE_OUTPUT,
+  STAGE_COUNT
+};
+
+/* Engines behind the process interface */
+enum backend
+{
+  BACKEND_OPENCL,
+  BACKEND_CPU
+};
+
+/* Threshold modes */
+enum
+{
+  THRESHOLD_FIXED = 0,
+  THRESHOLD_PERCENTILE = 1,
+  THRESHOLD_OTSU = 2
+};
+
+struct cpu;
+
 struct rect
 {
   uint32_t x, y, w, h;
   struct rect * next;
 };
 
+/* Kernel enqueued over the regions, launches are clipped to what earlier
+   regions left uncovered so no pixel is processed twice */
+struct launch
+{
+  struct device *dev;
+  cl_kernel kernel;
+  const struct rect *regions;
+  size_t grow;
+  size_t limit[2];
+  int tiled;
+  int shift;
+  cl_uint waits;
+  const cl_event *wait;
+  cl_event *first;
+  cl_event *last;
+
+  /* Launches so far and in all, nothing is enqueued while the latter is
+     still being counted */
+  uint32_t count;
+  uint32_t total;
+};
+
+/* Settings a program variant is specialised for, a tile of 0 runs with
+   any work group size and a threshold mode of -1 leaves them unspecialised */
+struct variant
+{
+  uint32_t width;
+  uint32_t height;
+  uint32_t stream;
+  uint32_t stripe;
+  uint32_t radius;
+  uint32_t tile;
+  uint32_t incremental;
+  int half;
+  int threshold;
+  float low;
+  float high;
+
+  /* Program and kernels built for it */
+  cl_program prog;
+  cl_kernel kernels[14];
+};
+
+struct device
+{
+  cl_device_id id;
+
+  /* Uploads go to a separate queue to overlap kernels */
+  cl_command_queue queue;
+  cl_command_queue upload;
+
+  /* Work group size along each axis of the tiled kernels */
+  size_t tile;
+
+  /* Intermediate images */
+  union {
+    cl_mem images[6];
+    struct {
+      cl_mem luma;
+      cl_mem temp;
+      cl_mem blur;
+      cl_mem mag;
+      cl_mem dir;
+      cl_mem nms;
+    };
+  };
+
+  /* Hysteresis state of each pixel and per pass change flags */
+  cl_mem edges;
+  cl_mem flags;
+
+  /* Magnitude histogram and the thresholds derived from it */
+  cl_mem hist;
+  cl_mem limits;
+
+  /* Set when the regions changed and the edges need clearing */
+  int stale;
+
+  /* Incremental mode, input of the previous frame, cells that changed
+     since, cells within reach of those and their count. Frames since the
+     last full refresh. */
+  cl_mem prev;
+  cl_mem changed;
+  cl_mem dirty;
+  cl_mem count;
+  uint32_t since;
+};
+
+struct frame
+{
+  /* Pinned staging buffer, mapped for the lifetime of the frame, plain
+     memory with the CPU backend */
+  cl_mem host;
+  uint8_t *data;
+
+  /* Input image and output texture, the output image is mapped to pixels
+     if it is not shared with OpenGL, the CPU backend composes there */
+  cl_mem input;
+  cl_mem out;
+  GLuint texture;
+  uint8_t *pixels;
+  size_t pitch;
+
+  /* Edge bitmap, mapped once read back, plain memory with the CPU
+     backend */
+  cl_mem packed;
+  uint32_t *bits;
+
+  /* Device the frame runs on */
+  struct device *dev;
+
+  /* Cells processed in incremental mode */
+  cl_uint dirty;
+
+  /* Wrapped camera buffer in use, -1 if staged */
+  int index;
+
+  /* Signalled once the output was released or read back */
+  cl_event done;
+
+  /* First and last command of each stage when profiling */
+  cl_event events[STAGE_COUNT][2];
+};
+
 struct process
 {
-  /* Texture size */
+  /* Texture size, covers all streams once initialised */
   uint32_t width;
   uint32_t height;
 
-  /* Output texture */
+  /* Streams of the same size batched into each frame, 0 for one. They are
+     stacked vertically, stripe rows apart, with the rows in between
+     padding, so every kernel runs once for the whole batch. */
+  uint32_t streams;
+  uint32_t stream_height;
+  uint32_t stripe;
+
+  /* Input pixel format, YUYV, RGBA32 or GREY, the latter limited range
+     when studio is set */
+  uint32_t format;
+  int studio;
+
+  /* OpenCL or native engine, threads of the latter, 0 for one per core */
+  enum backend backend;
+  uint32_t threads;
+
+  /* Platform and device indices, -1 picks the first match, the type
+     defaults to GPUs */
+  int platform;
+  int device;
+  cl_device_type device_type;
+
+  /* Matching devices frames are handed to in turn, 0 for one */
+  uint32_t spread;
+
+  /* Directory of cached program binaries, NULL for ~/.cache/canny, empty
+     to always build from source */
+  const char *cache;
+
+  /* Check the OpenCL edges of every frame against the native engine */
+  int verify;
+  struct cpu *cpu;
+
+  /* Time every stage with queue profiling, which costs some overhead.
+     Times of the last finished frame in nanoseconds, 0 if skipped. */
+  int profile;
+  cl_ulong times[STAGE_COUNT];
+
+  /* Output texture of the last finished frame, 0 if it is not shown.
+     Only every that many frames are, 0 for all of them, and those that
+     are not shared with OpenCL are streamed through the unpack buffer. */
   GLuint output;
+  uint32_t every;
+  uint64_t finished;
+  GLuint pbo;
+
+  /* Run without OpenGL, finished frames are only available as pixels,
+     valid until the next submitFrame */
+  int headless;
+  const uint8_t *result;
+  size_t pitch;
+
+  /* Pack the edges into a bitmap read back with every frame, bit x % 32
+     of word x / 32 of a row is pixel x. Packed only skips the composite,
+     for headless runs that need nothing else. */
+  int pack;
+  int pack_only;
+  const uint32_t *packed;
+  size_t packed_pitch;
+
+  /* Gaussian blur, default sigma is 1.4 with a radius of 3 sigma */
+  float sigma;
+  uint32_t radius;
+
+  /* Run Sobel and NMS as separate kernels instead of the fused one */
+  int split;
+
+  /* Hysteresis propagation passes, bounds the frame time */
+  uint32_t passes;
 
-  /* OpenCL state */
+  /* Hysteresis thresholds, read at every frame so they can change,
+     negative for the defaults as 0 is a valid threshold */
+  float low;
+  float high;
+
+  /* Adaptive thresholds, the high one is the percentile of edge pixels or
+     the Otsu split of their magnitudes, the low one is ratio times that */
+  int threshold;
+  float percentile;
+  float ratio;
+
+  /* Regions of interest, kernels only run over these and the halo the
+     filters need, whole frames if there are none */
+  struct rect *regions;
+
+  /* Only process cells whose input changed and their halo, the rest keeps
+     the edges of the previous frame. Every that many frames a device
+     refreshes all cells, 0 to always process whole frames. Cells per
+     frame, and in total and skipped so far. */
+  uint32_t incremental;
+  uint32_t cells;
+  uint64_t cells_total;
+  uint64_t cells_skipped;
+  uint8_t *zeros;
+
+  /* Ring of frames, depth of 1 processes frames one by one */
+  uint32_t depth;
+  uint32_t head;
+  uint32_t pending;
+  struct frame frames[PROCESS_DEPTH];
+
+  /* OpenCL state, textures are shared if every device supports it */
   cl_context context;
-  cl_command_queue queue;
-  cl_program prog;
+  int shared;
+
+  /* Eventfd incremented as frames finish, -1 for the native engine whose
+     frames finish as they are submitted */
+  int signal;
+
+  /* Callbacks registered on frames that have yet to write to signal */
+  uint32_t callbacks;
+
+  /* Built program variants, the kernels below belong to the current one,
+     the next variant built replaces the oldest */
+  struct variant variants[PROCESS_VARIANTS];
+  struct variant *variant;
+  uint32_t next_variant;
 
-  /* OpenCL kernels */
+  /* Selected devices and the one the next frame goes to */
+  struct device devices[PROCESS_MAX_DEVICES];
+  uint32_t device_count;
+  uint32_t next_device;
+
+  /* OpenCL kernels of the current variant */
   union {
-    cl_kernel kernels[5];
+    cl_kernel kernels[14];
     struct {
-      cl_kernel krnBlur;
+      cl_kernel krnLuma;
+      cl_kernel krnBlurH;
+      cl_kernel krnBlurV;
       cl_kernel krnSobel;
       cl_kernel krnNMS;
-      cl_kernel krnHysteresis;
+      cl_kernel krnHystInit;
       cl_kernel krnFinal;
+      cl_kernel krnSobelNMS;
+      cl_kernel krnHystTile;
+      cl_kernel krnHistogram;
+      cl_kernel krnThresholds;
+      cl_kernel krnPack;
+      cl_kernel krnDiff;
+      cl_kernel krnDilate;
     };
   };
 
-  /* OpenCL buffers */
-  union {
-    cl_mem images[6];
-    struct {
-      cl_mem out; 
-      cl_mem input;
-      cl_mem blur;
-      cl_mem sobel;
-      cl_mem nms;
-      cl_mem edges;
-    };
-  };
+  /* Blur weights */
+  cl_mem weights;
+
+  /* Host buffers wrapped for zero copy input */
+  cl_mem *inputs;
+  uint32_t input_count;
 };
 
+extern const char * const stageNames[STAGE_COUNT];
+
 int initProcess(struct process *);
+void listDevices(void);
 void processImage(struct process *, uint8_t *);
+int wrapInputs(struct process *, uint8_t * const *, uint32_t, size_t);
+uint8_t *beginFrame(struct process *);
+size_t streamOffset(struct process *, uint32_t);
+int addRegion(struct process *, uint32_t, uint32_t, uint32_t, uint32_t);
+int maskRegions(struct process *, const uint8_t *);
+void clearRegions(struct process *);
+void submitFrame(struct process *, int);
+int frameFinished(struct process *);
+int finishFrame(struct process *, int *);
 void destroyProcess(struct process *);
 
 #endif /*__HOG_PROCESS_H__*/
@@ -5,10 +5,23 @@ __constant sampler_t sampler = CLK_FILTER_NEAREST |
                                CLK_NORMALIZED_COORDS_FALSE | 
                                CLK_ADDRESS_CLAMP_TO_EDGE;
 
-/* Low threshold for hysteresis supression */
-__constant float TLOW = 0.01;
-/* High threshold for hysteresis supression */
-__constant float THIGH = 0.3;
+/* Magnitude histogram, must match PROCESS_HIST_BINS and PROCESS_HIST_RANGE */
+#define HIST_BINS  1024
+#define HIST_RANGE 2.0f
+
+/* Threshold modes, same values as in process.h */
+#define THRESHOLD_FIXED      0
+#define THRESHOLD_PERCENTILE 1
+#define THRESHOLD_OTSU       2
+
+/* Expands studio swing luma to 0 - 1 */
+#define YSCALE(y) (((y) - 16.0 / 255.0) * (255.0 / 219.0))
+
+/* Neighbours along the quantized gradient directions */
+__constant int2 DIRS[] =
+{
+  (int2)(1, 0), (int2)(1, 1), (int2)(0, 1), (int2)(-1, 1)
+};
 
 /* 3x3 kernel border offsets */
 __constant int2 OFF3X3[] =
@@ -18,205 +31,872 @@ __constant int2 OFF3X3[] =
   (int2)(-1,  1), (int2)( 0,  1), (int2)(1,  1),
 };
 
-/* 5x5 kernel border offsets */
-__constant int2 OFF5X5[] =
+/* Hysteresis states of a pixel */
+#define EDGE_NONE   0
+#define EDGE_WEAK   1
+#define EDGE_STRONG 2
+
+/* Specialisation, each macro is optional and replaces a runtime value so
+   loops unroll and constants fold:
+   WIDTH, HEIGHT   frame size
+   RADIUS, WEIGHTS blur radius and its 2 * RADIUS + 1 weights
+   TILE            work group size along each axis of the tiled kernels
+   ADAPTIVE        1 if the thresholds come from the histogram
+   LOW, HIGH       fixed thresholds
+   HALF_TILES      stage local tiles as half, for half intermediates
+   STREAM, STRIPE  batched streams, STREAM rows each, stacked STRIPE rows
+                   apart, a multiple of the tile height
+   INCREMENTAL     cell size, skip cells whose input and halo are unchanged,
+                   a multiple of the tile size */
+#ifdef WIDTH
+#define IMAGE_W(img) WIDTH
+#define IMAGE_H(img) HEIGHT
+#else
+#define IMAGE_W(img) get_image_width(img)
+#define IMAGE_H(img) get_image_height(img)
+#endif
+
+/* Rows are clamped to the stream of a home row the way the sampler clamps
+   to the image, work groups never straddle two streams, padding rows
+   between them are outside of every stream */
+#ifdef STRIPE
+#define ROW(y, home) clamp((y), (home) / STRIPE * STRIPE, \
+                           (home) / STRIPE * STRIPE + STREAM - 1)
+#define INSIDE(y)    ((y) % STRIPE < STREAM)
+#else
+#define ROW(y, home) (y)
+#define INSIDE(y)    true
+#endif
+
+/* Whether the cell of a pixel can be skipped, all pixels of a work group
+   share their cell so tiled kernels leave as a whole */
+#ifdef INCREMENTAL
+#define CELLS_W ((WIDTH + INCREMENTAL - 1) / INCREMENTAL)
+#define SKIP(x, y) (!dirty[(y) / INCREMENTAL * CELLS_W + (x) / INCREMENTAL])
+#else
+#define SKIP(x, y) false
+#endif
+
+#ifdef TILE
+#define TILED __attribute__((reqd_work_group_size(TILE, TILE, 1)))
+#define LOCAL_W TILE
+#define LOCAL_H TILE
+#else
+#define TILED
+#define LOCAL_W get_local_size(0)
+#define LOCAL_H get_local_size(1)
+#endif
+
+#ifdef WEIGHTS
+__constant float BLUR_WEIGHTS[] = { WEIGHTS };
+#define WEIGHT(w, i) BLUR_WEIGHTS[i]
+#else
+#define WEIGHT(w, i) (w)[i]
+#endif
+
+/* Local tiles, vload_half and vstore_half need no fp16 support */
+#ifdef HALF_TILES
+typedef half tile_t;
+#define LOAD(p, i)     vload_half((i), (p))
+#define STORE(p, i, v) vstore_half((v), (i), (p))
+#else
+typedef float tile_t;
+#define LOAD(p, i)     ((p)[i])
+#define STORE(p, i, v) ((p)[i] = (v))
+#endif
+
+
+/**
+ * BT.601 luma of an RGB pixel
+ */
+__kernel void krnLuma(__read_only image2d_t input,
+                      __write_only image2d_t luma,
+                      __global const uchar *dirty)
 {
-  (int2)(-2, -2), (int2)(-1, -2), (int2)(0, -2), (int2)(1, -2), (int2)(2, -2),
-  (int2)(-2, -1),                                               (int2)(2, -1), 
-  (int2)(-2,  0),                                               (int2)(2,  0),
-  (int2)(-2,  1),                                               (int2)(2,  1),
-  (int2)(-2,  2), (int2)(-1,  2), (int2)(0,  2), (int2)(1,  2), (int2)(2,  2)
-};
+  int2 uv;
+  float4 pix;
+  float y;
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  if (SKIP(uv.x, uv.y))
+  {
+    return;
+  }
+
+  pix = read_imagef(input, sampler, uv);
+  y = dot(pix.xyz, (float3)(0.299, 0.587, 0.114));
+
+  write_imagef(luma, uv, (float4)(y));
+}
+
+/**
+ * Luma of packed YUYV, each texel holds Y0 U Y1 V of two pixels
+ */
+__kernel void krnLumaYUYV(__read_only image2d_t input,
+                          __write_only image2d_t luma,
+                          __global const uchar *dirty)
+{
+  int2 uv;
+  float4 pix;
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  if (SKIP(uv.x * 2, uv.y))
+  {
+    return;
+  }
+
+  pix = read_imagef(input, sampler, uv);
+
+  write_imagef(luma, (int2)(uv.x * 2 + 0, uv.y), (float4)(YSCALE(pix.x)));
+  write_imagef(luma, (int2)(uv.x * 2 + 1, uv.y), (float4)(YSCALE(pix.z)));
+}
+
+/**
+ * Luma of GREY, each texel holds four pixels, which are taken as they are
+ */
+__kernel void krnLumaGrey(__read_only image2d_t input,
+                          __write_only image2d_t luma,
+                          __global const uchar *dirty)
+{
+  int2 uv;
+  float4 pix;
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  if (SKIP(uv.x * 4, uv.y))
+  {
+    return;
+  }
 
+  pix = read_imagef(input, sampler, uv);
+
+  write_imagef(luma, (int2)(uv.x * 4 + 0, uv.y), (float4)(pix.x));
+  write_imagef(luma, (int2)(uv.x * 4 + 1, uv.y), (float4)(pix.y));
+  write_imagef(luma, (int2)(uv.x * 4 + 2, uv.y), (float4)(pix.z));
+  write_imagef(luma, (int2)(uv.x * 4 + 3, uv.y), (float4)(pix.w));
+}
 
 /**
- * Gaussian blur with a 5x5 kernel
- * This pass also converts an image to grayscale
+ * Luma plane of planar formats, four pixels per texel like GREY but
+ * limited range like YUYV
  */
-__kernel void krnBlur(__read_only image2d_t input,
-                      __write_only image2d_t blur)
+__kernel void krnLumaPlanar(__read_only image2d_t input,
+                            __write_only image2d_t luma,
+                            __global const uchar *dirty)
 {
   int2 uv;
-  float4 acc;
-
-  uv = (int2){ get_global_id(0), get_global_id(1) };
-
-  acc = (float4)(0.0);
-  acc +=  2.0 * read_imagef(input, sampler, uv + (int2)(-2, -2));
-  acc +=  4.0 * read_imagef(input, sampler, uv + (int2)(-1, -2));
-  acc +=  5.0 * read_imagef(input, sampler, uv + (int2)( 0, -2));
-  acc +=  4.0 * read_imagef(input, sampler, uv + (int2)( 1, -2));
-  acc +=  2.0 * read_imagef(input, sampler, uv + (int2)( 2, -2));
-  acc +=  4.0 * read_imagef(input, sampler, uv + (int2)(-2, -1));
-  acc +=  9.0 * read_imagef(input, sampler, uv + (int2)(-1, -1));
-  acc += 12.0 * read_imagef(input, sampler, uv + (int2)( 0, -1));
-  acc +=  9.0 * read_imagef(input, sampler, uv + (int2)( 1, -1));
-  acc +=  4.0 * read_imagef(input, sampler, uv + (int2)( 2, -1));
-  acc +=  5.0 * read_imagef(input, sampler, uv + (int2)(-2,  0));
-  acc += 12.0 * read_imagef(input, sampler, uv + (int2)(-1,  0));
-  acc += 15.0 * read_imagef(input, sampler, uv + (int2)( 0,  0));
-  acc += 12.0 * read_imagef(input, sampler, uv + (int2)( 1,  0));
-  acc +=  5.0 * read_imagef(input, sampler, uv + (int2)( 2,  0));
-  acc +=  4.0 * read_imagef(input, sampler, uv + (int2)(-2,  1));
-  acc +=  9.0 * read_imagef(input, sampler, uv + (int2)(-1,  1));
-  acc += 12.0 * read_imagef(input, sampler, uv + (int2)( 0,  1));
-  acc +=  9.0 * read_imagef(input, sampler, uv + (int2)( 1,  1));
-  acc +=  4.0 * read_imagef(input, sampler, uv + (int2)( 2,  1));
-  acc +=  2.0 * read_imagef(input, sampler, uv + (int2)(-2,  2));
-  acc +=  4.0 * read_imagef(input, sampler, uv + (int2)(-1,  2));
-  acc +=  5.0 * read_imagef(input, sampler, uv + (int2)( 0,  2));
-  acc +=  4.0 * read_imagef(input, sampler, uv + (int2)( 1,  2));
-  acc +=  2.0 * read_imagef(input, sampler, uv + (int2)( 2,  2));
-
-  write_imagef(blur, uv, length(acc / 159.0));
-}
-
-/**
- * Horizontal Sobel pass
+  float4 pix;
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  if (SKIP(uv.x * 4, uv.y))
+  {
+    return;
+  }
+
+  pix = read_imagef(input, sampler, uv);
+
+  write_imagef(luma, (int2)(uv.x * 4 + 0, uv.y), (float4)(YSCALE(pix.x)));
+  write_imagef(luma, (int2)(uv.x * 4 + 1, uv.y), (float4)(YSCALE(pix.y)));
+  write_imagef(luma, (int2)(uv.x * 4 + 2, uv.y), (float4)(YSCALE(pix.z)));
+  write_imagef(luma, (int2)(uv.x * 4 + 3, uv.y), (float4)(YSCALE(pix.w)));
+}
+
+/**
+ * Horizontal Gaussian blur pass
+ * Each row of the work group stages its pixels and a halo of radius pixels
+ * on either side in local memory, weights are computed on the host.
+ */
+__kernel TILED void krnBlurH(__read_only image2d_t src,
+                             __write_only image2d_t dst,
+                             __constant float *weights,
+                             int radius,
+                             __local tile_t *tile,
+                             __global const uchar *dirty)
+{
+  int2 uv;
+  int lx, lw, base, row, i;
+  float acc;
+
+#ifdef RADIUS
+  radius = RADIUS;
+#endif
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  if (SKIP(uv.x, uv.y))
+  {
+    return;
+  }
+
+  lx = get_local_id(0);
+  lw = LOCAL_W;
+  base = uv.x - lx - radius;
+  row = get_local_id(1) * (lw + 2 * radius);
+
+  for (i = lx; i < lw + 2 * radius; i += lw)
+  {
+    STORE(tile, row + i,
+          read_imagef(src, sampler, (int2)(base + i, uv.y)).x);
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (uv.x >= IMAGE_W(dst) || uv.y >= IMAGE_H(dst))
+  {
+    return;
+  }
+
+  acc = 0.0;
+  for (i = 0; i <= 2 * radius; ++i)
+  {
+    acc += WEIGHT(weights, i) * LOAD(tile, row + lx + i);
+  }
+
+  write_imagef(dst, uv, (float4)(acc));
+}
+
+/**
+ * Vertical Gaussian blur pass
+ * Same as the horizontal one, with columns staged in local memory.
+ */
+__kernel TILED void krnBlurV(__read_only image2d_t src,
+                             __write_only image2d_t dst,
+                             __constant float *weights,
+                             int radius,
+                             __local tile_t *tile,
+                             __global const uchar *dirty)
+{
+  int2 uv;
+  int lx, ly, lw, lh, base, i;
+  float acc;
+
+#ifdef RADIUS
+  radius = RADIUS;
+#endif
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  if (SKIP(uv.x, uv.y))
+  {
+    return;
+  }
+
+  lx = get_local_id(0);
+  ly = get_local_id(1);
+  lw = LOCAL_W;
+  lh = LOCAL_H;
+  base = uv.y - ly - radius;
+
+  for (i = ly; i < lh + 2 * radius; i += lh)
+  {
+    STORE(tile, i * lw + lx,
+          read_imagef(src, sampler,
+                      (int2)(uv.x, ROW(base + i, uv.y - ly))).x);
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (uv.x >= IMAGE_W(dst) || uv.y >= IMAGE_H(dst))
+  {
+    return;
+  }
+
+  acc = 0.0;
+  for (i = 0; i <= 2 * radius; ++i)
+  {
+    acc += WEIGHT(weights, i) * LOAD(tile, (ly + i) * lw + lx);
+  }
+
+  write_imagef(dst, uv, (float4)(acc));
+}
+
+/**
+ * Quantizes the gradient direction to one of the DIRS neighbours
+ * tan(22.5) and tan(67.5) split the half circle into the four sectors.
+ */
+uchar quantize(float vert, float horz)
+{
+  float ax, ay;
+
+  ax = fabs(horz);
+  ay = fabs(vert);
+  if (ay <= 0.41421356 * ax)
+  {
+    return 0; // 0 degrees
+  }
+  if (ay >= 2.41421356 * ax)
+  {
+    return 2; // 90 degrees
+  }
+
+  return (vert * horz > 0.0) ? 1 : 3; // 45 or 135 degrees
+}
+
+/**
+ * Sobel pass
+ * Writes the gradient magnitude and the quantized direction.
  */
 __kernel void krnSobel(__read_only image2d_t blur,
-                       __write_only image2d_t sobel)
+                       __write_only image2d_t mag,
+                       __write_only image2d_t dir,
+                       __global const uchar *dirty)
 {
   int2 uv;
-  float4 vert, horz, pix;
-  float4 orig;
+  float vert, horz;
 
   uv = (int2){ get_global_id(0), get_global_id(1) };
+  if (SKIP(uv.x, uv.y))
+  {
+    return;
+  }
+
+  int up = ROW(uv.y - 1, uv.y), down = ROW(uv.y + 1, uv.y);
 
-  float4 p_nw = read_imagef(blur, sampler, uv + (int2)(-1, -1));
-  float4 p_n  = read_imagef(blur, sampler, uv + (int2)( 0, -1));
-  float4 p_ne = read_imagef(blur, sampler, uv + (int2)( 1, -1));
-  float4 p_e  = read_imagef(blur, sampler, uv + (int2)( 1,  0));
-  float4 p_se = read_imagef(blur, sampler, uv + (int2)( 1,  1));
-  float4 p_s  = read_imagef(blur, sampler, uv + (int2)( 0,  1));
-  float4 p_sw = read_imagef(blur, sampler, uv + (int2)(-1,  1));
-  float4 p_w  = read_imagef(blur, sampler, uv + (int2)(-1,  0));
+  float p_nw = read_imagef(blur, sampler, (int2)(uv.x - 1, up  )).x;
+  float p_n  = read_imagef(blur, sampler, (int2)(uv.x    , up  )).x;
+  float p_ne = read_imagef(blur, sampler, (int2)(uv.x + 1, up  )).x;
+  float p_e  = read_imagef(blur, sampler, (int2)(uv.x + 1, uv.y)).x;
+  float p_se = read_imagef(blur, sampler, (int2)(uv.x + 1, down)).x;
+  float p_s  = read_imagef(blur, sampler, (int2)(uv.x    , down)).x;
+  float p_sw = read_imagef(blur, sampler, (int2)(uv.x - 1, down)).x;
+  float p_w  = read_imagef(blur, sampler, (int2)(uv.x - 1, uv.y)).x;
 
   vert = p_nw + 2 * p_n + p_ne - p_sw - 2 * p_s - p_se;
   horz = p_nw + 2 * p_w + p_sw - p_ne - 2 * p_e - p_se;
 
-  pix.x = hypot(vert, horz).x;          // G = sqrt(Gx^2+Gy^2)
-  pix.y = atanpi(vert / horz).x + 0.5;  // theta = atan(vert/horz)
-  pix.z = vert.x;
-  pix.w = horz.x;
-
-  write_imagef(sobel, uv, pix);
+  write_imagef(mag, uv, (float4)(hypot(vert, horz)));
+  write_imageui(dir, uv, (uint4)(quantize(vert, horz)));
 }
 
 /**
  * Non maximum supression
  */
-__kernel void krnNMS(__read_only image2d_t sobel,
-                     __write_only image2d_t nms)
+__kernel void krnNMS(__read_only image2d_t mag,
+                     __read_only image2d_t dir,
+                     __write_only image2d_t nms,
+                     __global const uchar *dirty)
 {
-  float left, right;
-  int2 uv, dir;
-  float4 center, pix, out;
+  float center, left, right;
+  int2 uv, off;
 
   uv = (int2){ get_global_id(0), get_global_id(1) };
-  pix = read_imagef(sobel, sampler, uv);
-  
-  if (pix.y < 0.125) 
+  if (SKIP(uv.x, uv.y))
   {
-    dir = (int2)(0, 1); // 90 degrees
-  } 
-  else if (pix.y < 0.375) 
-  {   
-    dir = (int2)(-1, 1); // 135 degrees
-  } 
-  else if (pix.y < 0.625) 
+    return;
+  }
+
+  off = DIRS[read_imageui(dir, sampler, uv).x & 3];
+
+  center = read_imagef(mag, sampler, uv).x;
+  left   = read_imagef(mag, sampler,
+                       (int2)(uv.x + off.x, ROW(uv.y + off.y, uv.y))).x;
+  right  = read_imagef(mag, sampler,
+                       (int2)(uv.x - off.x, ROW(uv.y - off.y, uv.y))).x;
+
+  if (center <= left || center <= right) 
   {
-    dir = (int2)(1, 0); // 0 degrees
-  } 
-  else if (pix.y < 0.875) 
+    center = 0.0;
+  }
+
+  write_imagef(nms, uv, (float4)(center));
+}
+
+/**
+ * Sobel gradients of a pixel staged in local memory
+ * @return (vert, horz)
+ */
+float2 sobelAt(__local tile_t *p, int w, int x, int y)
+{
+  float p_nw = LOAD(p, (y - 1) * w + x - 1);
+  float p_n  = LOAD(p, (y - 1) * w + x    );
+  float p_ne = LOAD(p, (y - 1) * w + x + 1);
+  float p_e  = LOAD(p, (y    ) * w + x + 1);
+  float p_se = LOAD(p, (y + 1) * w + x + 1);
+  float p_s  = LOAD(p, (y + 1) * w + x    );
+  float p_sw = LOAD(p, (y + 1) * w + x - 1);
+  float p_w  = LOAD(p, (y    ) * w + x - 1);
+
+  return (float2)(p_nw + 2 * p_n + p_ne - p_sw - 2 * p_s - p_se,
+                  p_nw + 2 * p_w + p_sw - p_ne - 2 * p_e - p_se);
+}
+
+/**
+ * Fused Sobel and non maximum supression
+ * The blurred tile with a 2 pixel halo is staged in local memory, the
+ * magnitudes of the tile and a 1 pixel halo are computed there as well,
+ * so only the thinned magnitude is written back to global memory.
+ */
+__kernel TILED void krnSobelNMS(__read_only image2d_t blur,
+                                __write_only image2d_t nms,
+                                __local tile_t *pix,
+                                __local tile_t *mag,
+                                __global const uchar *dirty)
+{
+  int2 uv, off;
+  int lx, ly, lw, lh, pw, mw, bx, by, i, j;
+  float2 grad;
+  float center, left, right;
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  if (SKIP(uv.x, uv.y))
   {
-    dir = (int2)(1, 1); // 45 degrees
-  } 
-  else 
-  { 
-    dir = (int2)(0, 1); // 90 degrees
+    return;
   }
-  
-  center = read_imagef(sobel, sampler, uv);
-  left   = read_imagef(sobel, sampler, uv + dir).x;
-  right  = read_imagef(sobel, sampler, uv - dir).x;
 
-  out = (float4)(0.0);
-  if (center.x > left && center.x > right) 
+  lx = get_local_id(0);
+  ly = get_local_id(1);
+  lw = LOCAL_W;
+  lh = LOCAL_H;
+  pw = lw + 4;
+  mw = lw + 2;
+  bx = uv.x - lx - 2;
+  by = uv.y - ly - 2;
+
+  for (j = ly; j < lh + 4; j += lh)
   {
-    out = center;
+    for (i = lx; i < pw; i += lw)
+    {
+      STORE(pix, j * pw + i,
+            read_imagef(blur, sampler,
+                        (int2)(bx + i, ROW(by + j, uv.y - ly))).x);
+    }
   }
 
-  write_imagef(nms, uv, out);
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (j = ly; j < lh + 2; j += lh)
+  {
+    for (i = lx; i < mw; i += lw)
+    {
+      grad = sobelAt(pix, pw, i + 1, j + 1);
+      STORE(mag, j * mw + i, hypot(grad.x, grad.y));
+    }
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (uv.x >= IMAGE_W(nms) || uv.y >= IMAGE_H(nms))
+  {
+    return;
+  }
+
+  grad = sobelAt(pix, pw, lx + 2, ly + 2);
+  off = DIRS[quantize(grad.x, grad.y)];
+
+  center = LOAD(mag, (ly + 1) * mw + lx + 1);
+  left   = LOAD(mag, (ly + 1 + off.y) * mw + lx + 1 + off.x);
+  right  = LOAD(mag, (ly + 1 - off.y) * mw + lx + 1 - off.x);
+
+  if (center <= left || center <= right) 
+  {
+    center = 0.0;
+  }
+
+  write_imagef(nms, uv, (float4)(center));
 }
 
 /**
- * Hysteresis thresholding
+ * Histogram of the thinned gradient magnitudes
+ * Each work group counts its tile in local memory and merges the non empty
+ * bins into the global histogram, suppressed pixels are not counted.
  */
-__kernel void krnHysteresis(__read_only image2d_t nms,
-                            __write_only image2d_t out)
+__kernel TILED void krnHistogram(__read_only image2d_t nms,
+                                 __global uint *hist,
+                                 __local uint *bins)
 {
   int2 uv;
-  int i;
-  bool cont;
-  float4 pix, neigh;
+  int li, ls, i;
+  float pix;
 
   uv = (int2){ get_global_id(0), get_global_id(1) };
-  pix = read_imagef(nms, sampler, uv);
+  li = get_local_id(1) * LOCAL_W + get_local_id(0);
+  ls = LOCAL_W * LOCAL_H;
 
-  if (pix.x >= THIGH) 
+  for (i = li; i < HIST_BINS; i += ls)
   {
-    write_imagef(out, uv, (float4)(1));
-    return;
-  } 
-  else if (pix.x >= TLOW) 
+    bins[i] = 0;
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (uv.x < IMAGE_W(nms) && uv.y < IMAGE_H(nms) && INSIDE(uv.y))
   {
-    cont = false;
-    for (i = 0; i < 8; ++i) 
+    pix = read_imagef(nms, sampler, uv).x;
+    if (pix > 0.0f)
     {
-      neigh = read_imagef(nms, sampler, uv + OFF3X3[i]);
-      if (neigh.x >= THIGH) 
-      {
-        write_imagef(out, uv, (float4)(1));
-        return;
-      }
-      else if (neigh.x >= TLOW) 
+      atomic_inc(&bins[min((int)(pix * (HIST_BINS / HIST_RANGE)),
+                           HIST_BINS - 1)]);
+    }
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (i = li; i < HIST_BINS; i += ls)
+  {
+    if (bins[i])
+    {
+      atomic_add(&hist[i], bins[i]);
+    }
+  }
+}
+
+/**
+ * Derives the hysteresis thresholds from the histogram
+ * Runs as a single work group, the first work item scans the histogram
+ * and all of them clear it for the next frame afterwards.
+ * @param param Fraction of edge pixels below the high threshold, only used
+ *              in percentile mode
+ * @param ratio Low threshold relative to the high one
+ */
+__kernel void krnThresholds(__global uint *hist,
+                            __global float *limits,
+                            int mode,
+                            float param,
+                            float ratio)
+{
+  int li, ls, i, best;
+  float total, sum, acc, w0, m0, var, max;
+
+  li = get_local_id(0);
+  ls = get_local_size(0);
+
+  if (li == 0)
+  {
+    total = sum = 0.0f;
+    for (i = 0; i < HIST_BINS; ++i)
+    {
+      total += hist[i];
+      sum += i * (float)hist[i];
+    }
+
+    best = -1;
+    if (total > 0.0f && mode == THRESHOLD_PERCENTILE)
+    {
+      /* First bin reaching the requested fraction of edge pixels */
+      acc = 0.0f;
+      for (i = 0; i < HIST_BINS && best < 0; ++i)
       {
-        cont = true;
+        acc += hist[i];
+        best = acc >= param * total ? i : -1;
       }
     }
-
-    if (cont) 
+    else if (total > 0.0f && mode == THRESHOLD_OTSU)
     {
-      for (i = 0; i < 16; ++i) 
+      /* Split maximising the between class variance */
+      w0 = m0 = max = 0.0f;
+      for (i = 0; i < HIST_BINS - 1; ++i)
       {
-        neigh = read_imagef(nms, sampler, uv + OFF5X5[i]);
-        if (neigh.x >= THIGH) 
+        w0 += hist[i];
+        m0 += i * (float)hist[i];
+        if (w0 == 0.0f || w0 == total)
         {
-          write_imagef(out, uv, (float4)(1));
-          return;
+          continue;
+        }
+
+        var = m0 / w0 - (sum - m0) / (total - w0);
+        var = w0 * (total - w0) * var * var;
+        if (var > max)
+        {
+          max = var;
+          best = i;
         }
       }
     }
+
+    /* Keep the previous thresholds if the frame has no edges */
+    if (best >= 0)
+    {
+      limits[1] = (best + 1) * (HIST_RANGE / HIST_BINS);
+      limits[0] = limits[1] * ratio;
+    }
+  }
+
+  barrier(CLK_GLOBAL_MEM_FENCE);
+  for (i = li; i < HIST_BINS; i += ls)
+  {
+    hist[i] = 0;
+  }
+}
+
+/**
+ * Hysteresis classification
+ * Marks pixels as strong (EDGE_STRONG), weak (EDGE_WEAK) or none.
+ * @param limits Low and high thresholds computed on the device, used
+ *               instead of the arguments if adaptive is set
+ */
+__kernel void krnHystInit(__read_only image2d_t nms,
+                          __global uchar *edges,
+                          __global const float *limits,
+                          int adaptive,
+                          float low,
+                          float high,
+                          __global const uchar *dirty)
+{
+  int2 uv;
+  float pix;
+
+#ifdef ADAPTIVE
+  adaptive = ADAPTIVE;
+#endif
+#ifdef HIGH
+  low = LOW;
+  high = HIGH;
+#endif
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  if (SKIP(uv.x, uv.y))
+  {
+    return;
+  }
+
+  pix = read_imagef(nms, sampler, uv).x;
+
+  if (adaptive)
+  {
+    low = limits[0];
+    high = limits[1];
   }
 
-  write_imagef(out, uv, (float)(0.0));
+  edges[uv.y * IMAGE_W(nms) + uv.x] = !INSIDE(uv.y) ? EDGE_NONE :
+      pix >= high ? EDGE_STRONG : (pix >= low ? EDGE_WEAK : EDGE_NONE);
 }
 
+/**
+ * Hysteresis propagation pass
+ * Weak pixels connected to strong ones are promoted inside the tile until
+ * it converges, tiles exchange edges through their halo on the next pass.
+ * Passes are skipped once the previous one changed nothing.
+ */
+__kernel TILED void krnHystTile(__global uchar *edges,
+                                __global int *flags,
+                                int pass,
+                                int width,
+                                int height,
+                                __local uchar *tile,
+                                __global const uchar *dirty)
+{
+  __local int changed;
+  int2 uv, pos;
+  int lx, ly, lw, lh, tw, i, j, c;
+  uchar orig;
+  bool promote, inside;
+
+  if (flags[pass] == 0 || SKIP(get_global_id(0), get_global_id(1)))
+  {
+    return;
+  }
+
+#ifdef WIDTH
+  width = WIDTH;
+  height = HEIGHT;
+#endif
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  lx = get_local_id(0);
+  ly = get_local_id(1);
+  lw = LOCAL_W;
+  lh = LOCAL_H;
+  tw = lw + 2;
+
+  /* Stage the tile with a 1 pixel halo */
+  for (j = ly; j < lh + 2; j += lh)
+  {
+    for (i = lx; i < tw; i += lw)
+    {
+      pos = (int2)(uv.x - lx - 1 + i, uv.y - ly - 1 + j);
+      tile[j * tw + i] =
+          (pos.x >= 0 && pos.y >= 0 && pos.x < width && pos.y < height &&
+           ROW(pos.y, uv.y - ly) == pos.y)
+          ? edges[pos.y * width + pos.x] : EDGE_NONE;
+    }
+  }
+
+  inside = uv.x < width && uv.y < height && INSIDE(uv.y);
+  c = (ly + 1) * tw + lx + 1;
+  orig = tile[c];
+
+  /* Iterate until no weak pixel in the tile touches a strong one */
+  do
+  {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lx == 0 && ly == 0)
+    {
+      changed = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    promote = false;
+    if (inside && tile[c] == EDGE_WEAK)
+    {
+      for (i = 0; i < 8; ++i)
+      {
+        promote |= tile[c + OFF3X3[i].y * tw + OFF3X3[i].x] == EDGE_STRONG;
+      }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (promote)
+    {
+      tile[c] = EDGE_STRONG;
+      changed = 1;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  } while (changed);
+
+  if (inside && tile[c] != orig)
+  {
+    edges[uv.y * width + uv.x] = tile[c];
+    flags[pass + 1] = 1;
+  }
+}
 
 /**
  * Final composition
  */
-__kernel void krnFinal(__read_only image2d_t edges,
+__kernel void krnFinal(__global const uchar *edges,
                        __read_only image2d_t input,
                        __write_only image2d_t out)
 {
-  float4 edge, pix;
+  float4 pix;
+  float edge;
   int2 uv;
 
   uv = (int2){ get_global_id(0), get_global_id(1) };
-  edge = read_imagef(edges, sampler, uv);
+  edge = edges[uv.y * IMAGE_W(out) + uv.x] == EDGE_STRONG;
   pix = read_imagef(input, sampler, uv);
 
-  write_imagef(out, uv, edge.x + pix);
+  write_imagef(out, uv, edge + pix);
+}
+
+/**
+ * Final composition, chroma is only reconstructed here
+ */
+__kernel void krnFinalYUYV(__global const uchar *edges,
+                           __read_only image2d_t input,
+                           __write_only image2d_t out)
+{
+  float4 pix, rgb;
+  float c, d, e, edge;
+  int2 uv;
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  edge = edges[uv.y * IMAGE_W(out) + uv.x] == EDGE_STRONG;
+  pix = read_imagef(input, sampler, (int2)(uv.x >> 1, uv.y));
+
+  /* BT.601, same coefficients as the host conversion */
+  c = ((uv.x & 1) ? pix.z : pix.x) - 16.0 / 255.0;
+  d = pix.y - 0.5;
+  e = pix.w - 0.5;
+  rgb.x = 1.164 * c             + 1.596 * e;
+  rgb.y = 1.164 * c - 0.391 * d - 0.813 * e;
+  rgb.z = 1.164 * c + 2.018 * d;
+  rgb.w = 0.0;
+
+  write_imagef(out, uv, edge + rgb);
+}
+
+/**
+ * Final composition over the grey input
+ */
+__kernel void krnFinalGrey(__global const uchar *edges,
+                           __read_only image2d_t input,
+                           __write_only image2d_t out)
+{
+  float4 pix;
+  float y, edge;
+  int2 uv;
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  edge = edges[uv.y * IMAGE_W(out) + uv.x] == EDGE_STRONG;
+  pix = read_imagef(input, sampler, (int2)(uv.x >> 2, uv.y));
+  y = (uv.x & 2) ? ((uv.x & 1) ? pix.w : pix.z)
+                 : ((uv.x & 1) ? pix.y : pix.x);
+
+  write_imagef(out, uv, edge + (float4)(y, y, y, 0.0));
+}
+
+/**
+ * Packs strong edges into a bitmap, each work item fills one word of 32
+ * pixels, bit x % 32 of word x / 32 is pixel x
+ */
+__kernel void krnPack(__global const uchar *edges,
+                      __global uint *bits,
+                      int width)
+{
+  __global const uchar *row;
+  uint word;
+  int2 uv;
+  int i, n;
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  row = edges + uv.y * width + uv.x * 32;
+  n = min(32, width - uv.x * 32);
+
+  word = 0;
+  for (i = 0; i < n; ++i)
+  {
+    word |= (uint)(row[i] == EDGE_STRONG) << i;
+  }
+
+  bits[uv.y * get_global_size(0) + uv.x] = word;
+}
+
+/**
+ * Compares the input with the previous one of the device and flags the
+ * cells that changed, the previous input is updated as it goes
+ * @param cell Size of the cells in pixels
+ * @param cols Cells per row
+ * @param shift Pixels per texel as a power of two
+ * @param threshold Smallest change of a channel that counts
+ */
+__kernel void krnDiff(__read_only image2d_t input,
+                      __global uchar4 *prev,
+                      __global uchar *changed,
+                      int cell,
+                      int cols,
+                      int shift,
+                      int threshold)
+{
+  uchar4 pix, old;
+  int2 uv;
+  int i;
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  i = uv.y * get_global_size(0) + uv.x;
+  pix = convert_uchar4_sat_rte(read_imagef(input, sampler, uv) * 255.0f);
+  old = prev[i];
+  prev[i] = pix;
+
+  if (any(convert_int4(abs_diff(pix, old)) >= threshold))
+  {
+    changed[uv.y / cell * cols + (uv.x << shift) / cell] = 1;
+  }
+}
+
+/**
+ * Marks the cells within reach of a change as dirty and counts them, each
+ * work item is a cell
+ * @param reach Halo of the filters in cells
+ * @param full Mark every cell, for refreshes
+ */
+__kernel void krnDilate(__global const uchar *changed,
+                        __global uchar *dirty,
+                        __global uint *count,
+                        int reach,
+                        int full)
+{
+  int2 uv;
+  int w, h, x, y;
+  uchar d;
+
+  uv = (int2){ get_global_id(0), get_global_id(1) };
+  w = get_global_size(0);
+  h = get_global_size(1);
+
+  d = full;
+  for (y = max(uv.y - reach, 0); y <= min(uv.y + reach, h - 1) && !d; ++y)
+  {
+    for (x = max(uv.x - reach, 0); x <= min(uv.x + reach, w - 1); ++x)
+    {
+      d |= changed[y * w + x];
+    }
+  }
+
+  dirty[uv.y * w + uv.x] = d;
+  if (d)
+  {
+    atomic_inc(count);
+  }
 }
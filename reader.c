@@ -0,0 +1,365 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "reader.h"
+
+/* Minimum size of a single read from a pipe */
+#define READER_CHUNK (4 << 20)
+/* Maximum length of a Y4M header line */
+#define READER_LINE 1024
+/* Frames of mapped files paged in ahead of the first read */
+#define READER_AHEAD 4
+
+/**
+ * Makes at least n bytes available at the read position, if possible
+ * @return Number of bytes available
+ */
+static size_t
+fill(struct reader *r, size_t n)
+{
+  size_t size;
+  ssize_t ret;
+  uint8_t *tmp;
+
+  if (r->map)
+  {
+    return r->length - r->offset;
+  }
+
+  if (r->end - r->start >= n || r->eof)
+  {
+    return r->end - r->start;
+  }
+
+  /* Move the remaining bytes to the front */
+  if (r->start + n > r->capacity && r->start > 0)
+  {
+    memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+
+  /* Grow the buffer so that multiple requests fit in a single read */
+  if (n > r->capacity)
+  {
+    size = 2 * n < READER_CHUNK ? READER_CHUNK : 2 * n;
+    if (!(tmp = (uint8_t*)realloc(r->buffer, size)))
+    {
+      return r->end - r->start;
+    }
+
+    r->buffer = tmp;
+    r->capacity = size;
+  }
+
+  /* Issue reads as large as the buffer allows */
+  while (r->end - r->start < n)
+  {
+    ret = read(r->fd, r->buffer + r->end, r->capacity - r->end);
+    if (ret < 0 && errno == EINTR)
+    {
+      continue;
+    }
+
+    if (ret <= 0)
+    {
+      r->eof = 1;
+      break;
+    }
+
+    r->end += ret;
+  }
+
+  return r->end - r->start;
+}
+
+/**
+ * Returns a pointer to the read position
+ */
+static inline const uint8_t *
+current(struct reader *r)
+{
+  return r->map ? r->map + r->offset : r->buffer + r->start;
+}
+
+/**
+ * Moves the read position forward
+ */
+static inline void
+advance(struct reader *r, size_t n)
+{
+  if (r->map)
+  {
+    r->offset += n;
+  }
+  else
+  {
+    r->start += n;
+  }
+}
+
+/**
+ * Reads a header line, without the trailing newline
+ * @return Length of the line, -1 on error
+ */
+static int
+readLine(struct reader *r, char *line)
+{
+  const uint8_t *ptr;
+  size_t n;
+
+  for (n = 0; n < READER_LINE; ++n)
+  {
+    if (fill(r, n + 1) < n + 1)
+    {
+      return -1;
+    }
+
+    ptr = current(r);
+    if (ptr[n] == '\n')
+    {
+      memcpy(line, ptr, n);
+      line[n] = '\0';
+      advance(r, n + 1);
+      return n;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Parses the YUV4MPEG2 stream header
+ */
+static int
+parseY4M(struct reader *r)
+{
+  char line[READER_LINE + 1], *tok, *save;
+  uint32_t num, den, cw, ch;
+
+  if (readLine(r, line) < 0 || strncmp(line, "YUV4MPEG2", 9))
+  {
+    fprintf(stderr, "Y4M: Invalid header\n");
+    return 0;
+  }
+
+  /* Default to 4:2:0 if no colour space is specified */
+  r->sx = r->sy = 1;
+  r->mono = 0;
+  for (tok = strtok_r(line + 9, " ", &save); tok;
+       tok = strtok_r(NULL, " ", &save))
+  {
+    switch (tok[0])
+    {
+      case 'W':
+      {
+        r->width = atoi(tok + 1);
+        break;
+      }
+      case 'H':
+      {
+        r->height = atoi(tok + 1);
+        break;
+      }
+      case 'F':
+      {
+        if (sscanf(tok + 1, "%u:%u", &num, &den) == 2 && den != 0)
+        {
+          r->fps = (double)num / den;
+        }
+        break;
+      }
+      case 'C':
+      {
+        if (!strncmp(tok + 1, "420", 3))
+        {
+          r->sx = r->sy = 1;
+        }
+        else if (!strcmp(tok + 1, "422"))
+        {
+          r->sx = 1;
+          r->sy = 0;
+        }
+        else if (!strcmp(tok + 1, "444"))
+        {
+          r->sx = r->sy = 0;
+        }
+        else if (!strcmp(tok + 1, "mono"))
+        {
+          r->sx = r->sy = 0;
+          r->mono = 1;
+        }
+        else
+        {
+          fprintf(stderr, "Y4M: Unsupported colour space '%s'\n", tok + 1);
+          return 0;
+        }
+        break;
+      }
+    }
+  }
+
+  cw = (r->width + (1 << r->sx) - 1) >> r->sx;
+  ch = (r->height + (1 << r->sy) - 1) >> r->sy;
+  r->size = r->width * r->height + (r->mono ? 0 : 2 * cw * ch);
+  return 1;
+}
+
+/**
+ * Opens a file or a pipe for reading
+ */
+int
+initReader(struct reader *r)
+{
+  struct stat st;
+  const char *ext;
+  size_t ahead;
+
+  r->map = NULL;
+  r->buffer = NULL;
+  r->start = r->end = r->offset = 0;
+  r->eof = 0;
+
+  /* Open the file, '-' stands for stdin */
+  if (!strcmp(r->path, "-"))
+  {
+    r->fd = dup(STDIN_FILENO);
+  }
+  else
+  {
+    r->fd = open(r->path, O_RDONLY);
+  }
+
+  if (r->fd < 0 || fstat(r->fd, &st) < 0)
+  {
+    return 0;
+  }
+
+  /* Map regular files, stream everything else */
+  if (S_ISREG(st.st_mode) && st.st_size > 0)
+  {
+    r->length = st.st_size;
+    r->map = mmap(NULL, r->length, PROT_READ, MAP_PRIVATE, r->fd, 0);
+    if (r->map == MAP_FAILED)
+    {
+      r->map = NULL;
+      return 0;
+    }
+
+    madvise(r->map, r->length, MADV_SEQUENTIAL);
+  }
+
+  /* Guess the format from the extension or the magic number */
+  if (r->format == READER_AUTO)
+  {
+    ext = strrchr(r->path, '.');
+    if ((ext && !strcmp(ext, ".y4m")) ||
+        (fill(r, 9) >= 9 && !memcmp(current(r), "YUV4MPEG2", 9)))
+    {
+      r->format = READER_Y4M;
+    }
+    else if (ext && !strcmp(ext, ".rgba"))
+    {
+      r->format = READER_RGBA;
+    }
+    else
+    {
+      r->format = READER_YUYV;
+    }
+  }
+
+  switch (r->format)
+  {
+    case READER_Y4M:
+    {
+      if (!parseY4M(r))
+      {
+        return 0;
+      }
+      break;
+    }
+    case READER_RGBA:
+    {
+      r->size = r->width * r->height * 4;
+      break;
+    }
+    default:
+    {
+      r->size = r->width * r->height * 2;
+      break;
+    }
+  }
+
+  if (r->width == 0 || r->height == 0)
+  {
+    fprintf(stderr, "Reader: Frame size must be specified\n");
+    return 0;
+  }
+
+  /* Advice values are not flags, the first frames are paged in apart */
+  if (r->map)
+  {
+    ahead = (size_t)READER_AHEAD * (r->size + READER_LINE);
+    madvise(r->map, ahead < r->length ? ahead : r->length, MADV_WILLNEED);
+  }
+
+  return 1;
+}
+
+/**
+ * Retrieves the next frame
+ * The pointer stays valid until the next call.
+ * @return 1 if a full frame was read, 0 at the end of the stream
+ */
+int
+readFrame(struct reader *r, const uint8_t **frame)
+{
+  char line[READER_LINE + 1];
+
+  if (r->format == READER_Y4M)
+  {
+    if (readLine(r, line) < 0 || strncmp(line, "FRAME", 5))
+    {
+      return 0;
+    }
+  }
+
+  if (fill(r, r->size) < r->size)
+  {
+    return 0;
+  }
+
+  *frame = current(r);
+  advance(r, r->size);
+  return 1;
+}
+
+/**
+ * Closes the file
+ */
+void
+destroyReader(struct reader *r)
+{
+  if (r->map)
+  {
+    munmap(r->map, r->length);
+    r->map = NULL;
+  }
+
+  if (r->buffer)
+  {
+    free(r->buffer);
+    r->buffer = NULL;
+  }
+
+  if (r->fd >= 0)
+  {
+    close(r->fd);
+    r->fd = -1;
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef __HOG_READER_H__
+#define __HOG_READER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum reader_format
+{
+  READER_AUTO,
+  READER_YUYV,
+  READER_RGBA,
+  READER_Y4M
+};
+
+struct reader
+{
+  int fd;
+  const char *path;
+  enum reader_format format;
+  uint32_t width;
+  uint32_t height;
+  size_t size;
+  double fps;
+
+  /* Y4M chroma subsampling shifts, chroma planes absent if mono */
+  int mono;
+  uint32_t sx;
+  uint32_t sy;
+
+  /* Memory mapped regular file */
+  uint8_t *map;
+  size_t length;
+  size_t offset;
+
+  /* Read buffer for pipes */
+  uint8_t *buffer;
+  size_t capacity;
+  size_t start;
+  size_t end;
+  int eof;
+};
+
+int initReader(struct reader *);
+int readFrame(struct reader *, const uint8_t **);
+void destroyReader(struct reader *);
+
+#endif /*__HOG_READER_H__*/
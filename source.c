@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "source.h"
+#include "convert.h"
+#include "stats.h"
+
+/**
+ * Opens a camera, a file or stdin
+ */
+int
+initSource(struct source *src)
+{
+  struct stat st;
+
+  src->eof = 0;
+  src->dev.fd = -1;
+  src->file.fd = -1;
+
+  /* Character devices are cameras, anything else is read as a file */
+  if (strcmp(src->path, "-") && stat(src->path, &st) == 0 &&
+      S_ISCHR(st.st_mode))
+  {
+    src->type = SOURCE_CAMERA;
+    src->dev.camera = src->path;
+    src->dev.width = src->width;
+    src->dev.height = src->height;
+    src->dev.userptr = src->zero_copy;
+    if (!initCamera(&src->dev))
+    {
+      return 0;
+    }
+
+    src->width = src->dev.width;
+    src->height = src->dev.height;
+    src->format = src->dev.layout;
+    src->studio = src->dev.studio;
+    src->zero_copy = src->zero_copy && !src->dev.convert;
+    return 1;
+  }
+
+  /* Files are copied out of the page cache anyway */
+  src->zero_copy = 0;
+  src->type = SOURCE_FILE;
+  src->file.path = src->path;
+  src->file.width = src->width;
+  src->file.height = src->height;
+  if (!initReader(&src->file))
+  {
+    return 0;
+  }
+
+  src->width = src->file.width;
+  src->height = src->file.height;
+  src->format = src->file.format == READER_RGBA ? V4L2_PIX_FMT_RGBA32
+                                                : V4L2_PIX_FMT_YUYV;
+  if (src->fps <= 0.0)
+  {
+    src->fps = src->file.fps;
+  }
+
+  return 1;
+}
+
+/**
+ * Starts capturing frames
+ */
+int
+startSource(struct source *src)
+{
+  switch (src->type)
+  {
+    case SOURCE_CAMERA:
+    {
+      return startCamera(&src->dev) &&
+             initCapture(&src->cap, &src->dev, src->mode);
+    }
+    case SOURCE_FILE:
+    {
+      clock_gettime(CLOCK_MONOTONIC, &src->next);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Returns the descriptor that turns readable once a frame arrives
+ * @return -1 for files, which are read once due
+ */
+int
+sourceFd(struct source *src)
+{
+  return src->type == SOURCE_CAMERA ? src->cap.ready : -1;
+}
+
+/**
+ * Returns the nanoseconds until the next frame can be read without waiting
+ * @return 0 if one can be read now or the source ended, -1 until sourceFd
+ * turns readable
+ */
+int64_t
+untilFrame(struct source *src)
+{
+  struct timespec now;
+  int64_t due;
+  int failed;
+
+  /* Frames captured before a failure are still handed out */
+  if (src->type == SOURCE_CAMERA)
+  {
+    failed = __atomic_load_n(&src->cap.failed, __ATOMIC_ACQUIRE);
+    if (frameWaiting(&src->cap))
+    {
+      return 0;
+    }
+
+    src->eof = failed;
+    return failed ? 0 : -1;
+  }
+
+  if (src->fast || src->fps <= 0.0 || src->eof)
+  {
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  due = (int64_t)(src->next.tv_sec - now.tv_sec) * 1000000000LL +
+        (src->next.tv_nsec - now.tv_nsec);
+  return due > 0 ? due : 0;
+}
+
+/**
+ * Waits until the next frame is due
+ */
+static void
+pace(struct source *src)
+{
+  long step;
+
+  if (src->fast || src->fps <= 0.0)
+  {
+    return;
+  }
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &src->next, NULL)
+         == EINTR);
+
+  step = (long)(1e9 / src->fps);
+  src->next.tv_nsec += step;
+  while (src->next.tv_nsec >= 1000000000L)
+  {
+    src->next.tv_nsec -= 1000000000L;
+    src->next.tv_sec += 1;
+  }
+}
+
+/**
+ * Retrieves a frame in the source format
+ * Y4M streams are repacked to YUYV.
+ * @return 1 if a frame was read, eof is set at the end of the stream
+ */
+int
+getFrame(struct source *src, uint8_t *dest)
+{
+  const uint8_t *ptr;
+  struct reader *r;
+  size_t luma, chroma;
+  int index, ret;
+
+  if (src->type == SOURCE_CAMERA)
+  {
+    if ((index = takeFrame(&src->cap, &src->timestamp)) < 0)
+    {
+      return 0;
+    }
+
+    ret = copyImage(&src->dev, index, dest);
+    giveFrame(&src->cap, index);
+    return ret;
+  }
+
+  r = &src->file;
+  pace(src);
+  STAT_START(wait);
+  if (!readFrame(r, &ptr))
+  {
+    src->eof = 1;
+    return 0;
+  }
+  STAT_STOP(STAT_WAIT, wait);
+
+  /* Files are stamped once read */
+  src->timestamp = statClock();
+  STAT_START(convert);
+  switch (r->format)
+  {
+    case READER_Y4M:
+    {
+      luma = r->width * r->height;
+      chroma = (r->size - luma) / 2;
+      planarToYUYV(ptr, r->mono ? NULL : ptr + luma,
+                   r->mono ? NULL : ptr + luma + chroma,
+                   dest, r->width, r->height, r->sx, r->sy);
+      break;
+    }
+    default:
+    {
+      memcpy(dest, ptr, r->size);
+      break;
+    }
+  }
+  STAT_STOP(STAT_CONVERT, convert);
+
+  return 1;
+}
+
+/**
+ * Retrieves a camera buffer without copying it
+ * @return Index into dev.buffers, -1 if no frame is available
+ */
+int
+acquireFrame(struct source *src)
+{
+  if (src->type != SOURCE_CAMERA)
+  {
+    return -1;
+  }
+
+  return takeFrame(&src->cap, &src->timestamp);
+}
+
+/**
+ * Returns a buffer to the camera once it was consumed
+ */
+void
+releaseFrame(struct source *src, int index)
+{
+  if (src->type == SOURCE_CAMERA && index >= 0)
+  {
+    giveFrame(&src->cap, index);
+  }
+}
+
+/**
+ * Stops capturing frames
+ */
+void
+stopSource(struct source *src)
+{
+  if (src->type == SOURCE_CAMERA)
+  {
+    /* The capture thread stops issuing ioctls first */
+    if (src->cap.started)
+    {
+      destroyCapture(&src->cap);
+    }
+    stopCamera(&src->dev);
+  }
+}
+
+/**
+ * Releases the camera or closes the file
+ */
+void
+destroySource(struct source *src)
+{
+  switch (src->type)
+  {
+    case SOURCE_CAMERA:
+    {
+      stopSource(src);
+      destroyCamera(&src->dev);
+      break;
+    }
+    case SOURCE_FILE:
+    {
+      destroyReader(&src->file);
+      break;
+    }
+  }
+}
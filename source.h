@@ -0,0 +1,59 @@
+#ifndef __HOG_SOURCE_H__
+#define __HOG_SOURCE_H__
+
+#include <stdint.h>
+#include <time.h>
+#include "camera.h"
+#include "capture.h"
+#include "reader.h"
+
+enum source_type
+{
+  SOURCE_CAMERA,
+  SOURCE_FILE
+};
+
+struct source
+{
+  enum source_type type;
+  const char *path;
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+
+  /* GREY frames hold limited range luma, the luma plane of YUV formats */
+  int studio;
+
+  /* Frame rate of files, 0 or fast to read as fast as possible */
+  double fps;
+  int fast;
+  int eof;
+
+  /* Capture time of the last frame in monotonic nanoseconds, 0 if
+     unknown */
+  uint64_t timestamp;
+
+  /* Hand out camera buffers instead of copying them */
+  int zero_copy;
+
+  /* Frames of the capture thread of cameras, every one or the latest */
+  enum capture_mode mode;
+  struct capture cap;
+  struct timespec next;
+
+  /* Backends */
+  struct camera dev;
+  struct reader file;
+};
+
+int initSource(struct source *);
+int startSource(struct source *);
+int sourceFd(struct source *);
+int64_t untilFrame(struct source *);
+int getFrame(struct source *, uint8_t *);
+int acquireFrame(struct source *);
+void releaseFrame(struct source *, int);
+void stopSource(struct source *);
+void destroySource(struct source *);
+
+#endif /*__HOG_SOURCE_H__*/
@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+#include "process.h"
+
+/* Samples the ring holds, a power of two */
+#define STATS_RING 4096
+/* Histogram bins, a quarter octave each from 1us up */
+#define STATS_BINS 128
+#define STATS_STEPS 4
+/* Time the reporter sleeps between draining the ring */
+#define STATS_POLL 50000000L
+
+#define STATS_COUNT (STAT_DEVICE + STAGE_COUNT)
+
+struct sample
+{
+  uint32_t id;
+  uint64_t ns;
+};
+
+/* Samples of the current window */
+struct histogram
+{
+  uint64_t bins[STATS_BINS];
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+};
+
+/**
+ * Single producer, single consumer ring
+ * The main thread pushes, the reporter pops, neither ever waits.
+ */
+struct stats
+{
+  struct sample ring[STATS_RING];
+  uint32_t head;
+  uint32_t tail;
+  uint64_t dropped;
+
+  /* Reporter thread and its output */
+  pthread_t thread;
+  FILE *out;
+  double interval;
+  int quit;
+
+  struct histogram hist[STATS_COUNT];
+};
+
+static const char * const hostNames[STAT_DEVICE] =
+{
+  "wait", "convert", "submit", "finish", "display", "latency"
+};
+
+/* NULL until initStats, recording is then a single check */
+static struct stats *stats;
+
+/**
+ * Returns the monotonic clock in nanoseconds, the one V4L2 stamps with
+ */
+uint64_t
+statClock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Queues a sample, dropped if the reporter fell behind
+ */
+void
+recordStat(uint32_t id, uint64_t ns)
+{
+  uint32_t head;
+
+  if (!stats || id >= STATS_COUNT)
+  {
+    return;
+  }
+
+  head = stats->head;
+  if (head - __atomic_load_n(&stats->tail, __ATOMIC_ACQUIRE) >= STATS_RING)
+  {
+    __atomic_fetch_add(&stats->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  stats->ring[head & (STATS_RING - 1)].id = id;
+  stats->ring[head & (STATS_RING - 1)].ns = ns;
+  __atomic_store_n(&stats->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the bin of a duration
+ */
+static uint32_t
+binOf(uint64_t ns)
+{
+  double bin;
+
+  if (ns < 1000)
+  {
+    return 0;
+  }
+
+  bin = log2(ns * 1e-3) * STATS_STEPS + 1;
+  return bin >= STATS_BINS - 1 ? STATS_BINS - 1 : (uint32_t)bin;
+}
+
+/**
+ * Returns the upper bound of a percentile in milliseconds
+ */
+static double
+quantile(struct histogram *h, double p)
+{
+  uint64_t rank, sum;
+  double bound;
+  uint32_t i;
+
+  rank = (uint64_t)ceil(p * h->count);
+  for (i = 0, sum = 0; i < STATS_BINS - 1; ++i)
+  {
+    if ((sum += h->bins[i]) >= rank)
+    {
+      break;
+    }
+  }
+
+  bound = i == 0 ? 1e-3 : pow(2.0, (double)i / STATS_STEPS) * 1e-3;
+  return bound < h->max * 1e-6 ? bound : h->max * 1e-6;
+}
+
+/**
+ * Prints and clears the histograms of the window
+ */
+static void
+report(struct stats *s, double elapsed)
+{
+  struct histogram *h;
+  uint32_t i;
+  uint64_t dropped;
+
+  dropped = __atomic_exchange_n(&s->dropped, 0, __ATOMIC_RELAXED);
+  fprintf(s->out, "stats: %.1fs window, %llu dropped\n", elapsed,
+          (unsigned long long)dropped);
+  fprintf(s->out, "  %-12s %8s %9s %9s %9s %9s\n", "stage", "count",
+          "mean ms", "p50 ms", "p99 ms", "max ms");
+
+  for (i = 0; i < STATS_COUNT; ++i)
+  {
+    h = &s->hist[i];
+    if (h->count == 0)
+    {
+      continue;
+    }
+
+    fprintf(s->out, "  %-12s %8llu %9.3f %9.3f %9.3f %9.3f\n",
+            i < STAT_DEVICE ? hostNames[i] : stageNames[i - STAT_DEVICE],
+            (unsigned long long)h->count, h->total * 1e-6 / h->count,
+            quantile(h, 0.50), quantile(h, 0.99), h->max * 1e-6);
+    memset(h, 0, sizeof(*h));
+  }
+
+  fflush(s->out);
+}
+
+/**
+ * Drains the ring into the histograms
+ */
+static void
+drain(struct stats *s)
+{
+  struct histogram *h;
+  struct sample *smp;
+  uint32_t tail, head;
+
+  tail = s->tail;
+  head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+  for (; tail != head; ++tail)
+  {
+    smp = &s->ring[tail & (STATS_RING - 1)];
+    h = &s->hist[smp->id];
+    h->bins[binOf(smp->ns)]++;
+    h->count++;
+    h->total += smp->ns;
+    h->max = smp->ns > h->max ? smp->ns : h->max;
+  }
+
+  __atomic_store_n(&s->tail, tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Reporter thread, summarises the samples once per interval
+ */
+static void *
+reporterMain(void *arg)
+{
+  struct stats *s = (struct stats*)arg;
+  struct timespec poll = { 0, STATS_POLL };
+  uint64_t start, now;
+
+  start = statClock();
+  while (!__atomic_load_n(&s->quit, __ATOMIC_ACQUIRE))
+  {
+    nanosleep(&poll, NULL);
+    drain(s);
+
+    now = statClock();
+    if ((now - start) * 1e-9 >= s->interval)
+    {
+      report(s, (now - start) * 1e-9);
+      start = now;
+    }
+  }
+
+  drain(s);
+  report(s, (statClock() - start) * 1e-9);
+  return NULL;
+}
+
+/**
+ * Starts collecting samples
+ * @param path File the reports are appended to, - for stderr
+ * @param interval Seconds between reports
+ */
+int
+initStats(const char *path, double interval)
+{
+  struct stats *s;
+
+  if (!(s = (struct stats*)calloc(1, sizeof(struct stats))))
+  {
+    return 0;
+  }
+
+  s->interval = interval > 0.0 ? interval : STATS_INTERVAL;
+  if (!(s->out = strcmp(path, "-") ? fopen(path, "a") : stderr))
+  {
+    free(s);
+    return 0;
+  }
+
+  if (pthread_create(&s->thread, NULL, reporterMain, s) != 0)
+  {
+    if (s->out != stderr)
+    {
+      fclose(s->out);
+    }
+    free(s);
+    return 0;
+  }
+
+  stats = s;
+  return 1;
+}
+
+/**
+ * Stops the reporter after a last report
+ */
+void
+destroyStats(void)
+{
+  struct stats *s = stats;
+
+  if (!s)
+  {
+    return;
+  }
+
+  stats = NULL;
+  __atomic_store_n(&s->quit, 1, __ATOMIC_RELEASE);
+  pthread_join(s->thread, NULL);
+  if (s->out != stderr)
+  {
+    fclose(s->out);
+  }
+  free(s);
+}
@@ -0,0 +1,45 @@
+#ifndef __HOG_STATS_H__
+#define __HOG_STATS_H__
+
+#include <stdint.h>
+
+/* Host stages, the device stages of enum stage follow at STAT_DEVICE */
+enum stat_id
+{
+  STAT_WAIT,
+  STAT_CONVERT,
+  STAT_SUBMIT,
+  STAT_FINISH,
+  STAT_DISPLAY,
+  STAT_LATENCY,
+  STAT_DEVICE
+};
+
+/* Seconds between two reports */
+#define STATS_INTERVAL 5.0
+
+#ifdef WITH_STATS
+
+int initStats(const char *, double);
+uint64_t statClock(void);
+void recordStat(uint32_t, uint64_t);
+void destroyStats(void);
+
+/* Times a section, declares the start timestamp */
+#define STAT_START(t)    uint64_t t = statClock()
+#define STAT_STOP(id, t) recordStat((id), statClock() - (t))
+
+#else
+
+/* Compiled out, nothing is left of the instrumentation */
+static inline int initStats(const char *p, double i) { (void)p; (void)i; return 0; }
+static inline uint64_t statClock(void) { return 0; }
+static inline void recordStat(uint32_t id, uint64_t ns) { (void)id; (void)ns; }
+static inline void destroyStats(void) { }
+
+#define STAT_START(t)
+#define STAT_STOP(id, t)
+
+#endif /*WITH_STATS*/
+
+#endif /*__HOG_STATS_H__*/
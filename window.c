@@ -5,23 +5,175 @@
 #include "window.h"
 #include "process.h"
 
+/* Full window quad as a strip, clip space position and texture coordinate,
+   the first texture row is the top of the image */
+static const GLfloat QUAD[] =
+{
+  -1.0f,  1.0f, 0.0f, 0.0f,
+   1.0f,  1.0f, 1.0f, 0.0f,
+  -1.0f, -1.0f, 0.0f, 1.0f,
+   1.0f, -1.0f, 1.0f, 1.0f
+};
+
+static const char *VERTEX_SHADER =
+  "#version 330 core\n"
+  "layout(location = 0) in vec2 pos;\n"
+  "layout(location = 1) in vec2 uv;\n"
+  "out vec2 coord;\n"
+  "void main()\n"
+  "{\n"
+  "  coord = uv;\n"
+  "  gl_Position = vec4(pos, 0.0, 1.0);\n"
+  "}\n";
+
+static const char *FRAGMENT_SHADER =
+  "#version 330 core\n"
+  "uniform sampler2D image;\n"
+  "in vec2 coord;\n"
+  "out vec4 color;\n"
+  "void main()\n"
+  "{\n"
+  "  color = vec4(texture(image, coord).rgb, 1.0);\n"
+  "}\n";
+
+/**
+ * Compiles a shader, printing the log if it fails
+ * @return 0 on failure
+ */
+static GLuint
+compileShader(GLenum type, const char *source)
+{
+  GLchar log[1024];
+  GLuint shader;
+  GLint ok;
+
+  shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok)
+  {
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "OpenGL: Cannot compile shader\n%s\n", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+
+  return shader;
+}
+
+/**
+ * Creates the quad and the shader drawing it, both stay bound since
+ * nothing else is drawn
+ */
+static int
+initQuad(struct window *wnd)
+{
+  GLuint vs, fs;
+  GLint ok;
+
+  vs = compileShader(GL_VERTEX_SHADER, VERTEX_SHADER);
+  fs = compileShader(GL_FRAGMENT_SHADER, FRAGMENT_SHADER);
+  if (!vs || !fs)
+  {
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    return 0;
+  }
+
+  wnd->program = glCreateProgram();
+  glAttachShader(wnd->program, vs);
+  glAttachShader(wnd->program, fs);
+  glLinkProgram(wnd->program);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+  glGetProgramiv(wnd->program, GL_LINK_STATUS, &ok);
+  if (!ok)
+  {
+    fprintf(stderr, "OpenGL: Cannot link shader\n");
+    return 0;
+  }
+
+  glGenVertexArrays(1, &wnd->vao);
+  glBindVertexArray(wnd->vao);
+  glGenBuffers(1, &wnd->vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, wnd->vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(QUAD), QUAD, GL_STATIC_DRAW);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+                        (const void*)0);
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+                        (const void*)(2 * sizeof(GLfloat)));
+  glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+
+  glUseProgram(wnd->program);
+  glUniform1i(glGetUniformLocation(wnd->program, "image"), 0);
+  glActiveTexture(GL_TEXTURE0);
+
+  /* The window cannot be resized */
+  glViewport(0, 0, wnd->width, wnd->height);
+  return 1;
+}
+
+/**
+ * Sets the swap interval, falling back to vsync if the extension for
+ * late swaps or any control at all is missing
+ */
+static void
+setSwapInterval(struct window *wnd)
+{
+  int interval = wnd->interval;
+
+  if (interval < 0 && !GLXEW_EXT_swap_control_tear)
+  {
+    fprintf(stderr, "GLX: Late swaps are not supported, using vsync\n");
+    interval = 1;
+  }
+
+  if (GLXEW_EXT_swap_control)
+  {
+    glXSwapIntervalEXT(wnd->dpy, wnd->wnd, interval);
+  }
+  else if (GLXEW_MESA_swap_control && interval >= 0)
+  {
+    glXSwapIntervalMESA(interval);
+  }
+  else if (interval != 1)
+  {
+    fprintf(stderr, "GLX: Swap interval cannot be changed\n");
+  }
+}
+
 int
 initWindow(struct window *wnd)
 {
+  PFNGLXCREATECONTEXTATTRIBSARBPROC createContext;
+  GLXFBConfig *configs;
   XEvent evt;
   XVisualInfo *vi;
   XSetWindowAttributes swa;
   Colormap cmap;
   Atom atom;
   Window root;
+  int count;
 
   static int attr[] =
   {
-    GLX_RGBA,
+    GLX_X_RENDERABLE, True,
+    GLX_DRAWABLE_TYPE, GLX_WINDOW_BIT,
+    GLX_RENDER_TYPE,  GLX_RGBA_BIT,
     GLX_RED_SIZE,     8,
     GLX_GREEN_SIZE,   8,
     GLX_BLUE_SIZE,    8,
-    GLX_DOUBLEBUFFER,
+    GLX_DOUBLEBUFFER, True,
+    None
+  };
+
+  static int ctxAttr[] =
+  {
+    GLX_CONTEXT_MAJOR_VERSION_ARB, 3,
+    GLX_CONTEXT_MINOR_VERSION_ARB, 3,
+    GLX_CONTEXT_PROFILE_MASK_ARB,  GLX_CONTEXT_CORE_PROFILE_BIT_ARB,
     None
   };
 
@@ -31,14 +183,22 @@ initWindow(struct window *wnd)
     return 0;
   }
 
-  /* Retrieve visual info */
-  if (!(vi = glXChooseVisual(wnd->dpy, 0, attr)))
+  /* Retrieve a framebuffer config and its visual */
+  if (!(configs = glXChooseFBConfig(wnd->dpy, DefaultScreen(wnd->dpy), attr,
+                                    &count)))
+  {
+    return 0;
+  }
+
+  if (count < 1 || !(vi = glXGetVisualFromFBConfig(wnd->dpy, configs[0])))
   {
+    XFree(configs);
     return 0;
   }
 
   if (!(cmap = XCreateColormap(wnd->dpy, root, vi->visual, AllocNone)))
   {
+    XFree(configs);
     XFree(vi);
     return 0;
   }
@@ -53,6 +213,7 @@ initWindow(struct window *wnd)
                                  0, vi->depth, InputOutput, vi->visual,
                                  CWColormap | CWEventMask, &swa)))
   {
+    XFree(configs);
     XFree(vi);
     return 0;
   }
@@ -76,21 +237,32 @@ initWindow(struct window *wnd)
     XNextEvent(wnd->dpy, &evt);
   } while (evt.type != MapNotify);
 
-  /* Create the OpenGL context */
-  if (!(wnd->ctx = glXCreateContext(wnd->dpy, vi, NULL, GL_TRUE)))
+  /* Create a core profile OpenGL context, GLEW is not loaded yet */
+  createContext = (PFNGLXCREATECONTEXTATTRIBSARBPROC)glXGetProcAddressARB(
+    (const GLubyte*)"glXCreateContextAttribsARB");
+  if (!createContext ||
+      !(wnd->ctx = createContext(wnd->dpy, configs[0], NULL, True, ctxAttr)))
   {
+    fprintf(stderr, "GLX: Cannot create an OpenGL 3.3 core context\n");
+    XFree(configs);
     XFree(vi);
     return 0;
   }
 
+  XFree(configs);
   XFree(vi);
   glXMakeCurrent(wnd->dpy, wnd->wnd, wnd->ctx);
+
+  /* Core profiles need the experimental loader, which leaves an error */
+  glewExperimental = GL_TRUE;
   if (glewInit() != GLEW_OK)
   {
     return 0;
   }
+  glGetError();
 
-  return 1;
+  setSwapInterval(wnd);
+  return initQuad(wnd);
 }
 
 int
@@ -123,11 +295,33 @@ updateWindow(struct window *wnd)
   return 1;
 }
 
+/**
+ * Returns the descriptor of the X connection, readable once events arrive
+ */
+int
+windowFd(struct window *wnd)
+{
+  return ConnectionNumber(wnd->dpy);
+}
+
 void
 destroyWindow(struct window *wnd)
 {
   if (wnd->ctx)
   {
+    if (wnd->vao)
+    {
+      glDeleteVertexArrays(1, &wnd->vao);
+      glDeleteBuffers(1, &wnd->vbo);
+      wnd->vao = wnd->vbo = 0;
+    }
+
+    if (wnd->program)
+    {
+      glDeleteProgram(wnd->program);
+      wnd->program = 0;
+    }
+
     glXMakeCurrent(wnd->dpy, None, NULL);
     glXDestroyContext(wnd->dpy, wnd->ctx);
     wnd->ctx = 0;
@@ -146,26 +340,16 @@ destroyWindow(struct window *wnd)
   }
 }
 
+/**
+ * Draws the output of the last finished frame and swaps, which only waits
+ * for vsync with a positive swap interval
+ */
 void
 displayImage(struct window *wnd, struct process *proc)
 {
-  glViewport(0, 0, wnd->width, wnd->height);
-
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glOrtho(0.0f, wnd->width, wnd->height, 0.0f, -1.0, 1.0f);
-  glMatrixMode(GL_MODELVIEW);
-
-  glEnable(GL_TEXTURE_2D);
   glBindTexture(GL_TEXTURE_2D, proc->output);
-  glBegin(GL_QUADS);
-    glTexCoord2f(0.0f, 0.0f); glVertex2i(0, 0);
-    glTexCoord2f(1.0f, 0.0f); glVertex2i(wnd->width, 0);
-    glTexCoord2f(1.0f, 1.0f); glVertex2i(wnd->width, wnd->height);
-    glTexCoord2f(0.0f, 1.0f); glVertex2i(0, wnd->height);
-  glEnd();
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
   glBindTexture(GL_TEXTURE_2D, 0);
-  glDisable(GL_TEXTURE_2D);
 
   glXSwapBuffers(wnd->dpy, wnd->wnd);
 }
@@ -17,10 +17,20 @@ struct window
   GLXContext ctx;
   int width;
   int height;
+
+  /* Swap interval, 0 swaps at once, negative only waits for frames that
+     are on time if GLX_EXT_swap_control_tear is supported */
+  int interval;
+
+  /* Quad covering the window and the shader texturing it */
+  GLuint vao;
+  GLuint vbo;
+  GLuint program;
 };
 
 int initWindow(struct window *);
 int updateWindow(struct window *);
+int windowFd(struct window *);
 void destroyWindow(struct window *);
 void displayImage(struct window *, struct process *);
 
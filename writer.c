@@ -0,0 +1,381 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "writer.h"
+
+/**
+ * Connects to host:port
+ * @return -1 if no address accepts the connection
+ */
+static int
+connectTo(const char *addr)
+{
+  struct addrinfo hints, *res, *ai;
+  char host[256];
+  const char *port;
+  int fd;
+
+  if (!(port = strrchr(addr, ':')) || (size_t)(port - addr) >= sizeof(host))
+  {
+    return -1;
+  }
+
+  memcpy(host, addr, port - addr);
+  host[port - addr] = '\0';
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port + 1, &hints, &res) != 0)
+  {
+    return -1;
+  }
+
+  for (fd = -1, ai = res; ai && fd < 0; ai = ai->ai_next)
+  {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) >= 0 &&
+        connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  freeaddrinfo(res);
+  return fd;
+}
+
+/**
+ * Writes out the gathered records
+ */
+static int
+flush(struct writer *w)
+{
+  size_t done;
+  ssize_t ret;
+
+  for (done = 0; done < w->used; done += ret)
+  {
+    if ((ret = write(w->fd, w->out + done, w->used - done)) <= 0)
+    {
+      if (ret < 0 && errno == EINTR)
+      {
+        ret = 0;
+        continue;
+      }
+      return 0;
+    }
+  }
+
+  w->used = 0;
+  return 1;
+}
+
+/**
+ * Returns the first pixel from x on whose bit differs from value
+ */
+static uint32_t
+nextChange(const uint32_t *row, uint32_t width, uint32_t x, uint32_t value)
+{
+  uint32_t word;
+
+  while (x < width)
+  {
+    word = (row[x >> 5] ^ (value ? ~0u : 0u)) >> (x & 31);
+    if (word)
+    {
+      x += __builtin_ctz(word);
+      break;
+    }
+    x = (x | 31) + 1;
+  }
+
+  return x < width ? x : width;
+}
+
+/**
+ * Encodes a bitmap behind the gathered records
+ * @return Size of the payload
+ */
+static size_t
+encode(struct writer *w, const uint32_t *bits, uint8_t *dest)
+{
+  uint16_t *p = (uint16_t*)dest, *count;
+  const uint32_t *row;
+  uint32_t x, y, end, word;
+
+  switch (w->encoding)
+  {
+    case ENCODING_BITS:
+    {
+      memcpy(dest, bits, w->words * 4 * w->height);
+      return w->words * 4 * w->height;
+    }
+    case ENCODING_RUNS:
+    {
+      for (y = 0; y < w->height; ++y)
+      {
+        row = bits + y * w->words;
+        count = p++;
+        *count = 0;
+        for (x = 0; x < w->width; x = end)
+        {
+          /* Runs alternate, odd ones are edges */
+          end = nextChange(row, w->width, x, *count & 1);
+          *p++ = (uint16_t)(end - x);
+          ++*count;
+        }
+      }
+      break;
+    }
+    case ENCODING_POINTS:
+    {
+      for (y = 0; y < w->height; ++y)
+      {
+        row = bits + y * w->words;
+        for (x = 0; x < w->words; ++x)
+        {
+          for (word = row[x]; word; word &= word - 1)
+          {
+            *p++ = (uint16_t)(x * 32 + __builtin_ctz(word));
+            *p++ = (uint16_t)y;
+          }
+        }
+      }
+      break;
+    }
+  }
+
+  return (uint8_t*)p - dest;
+}
+
+/**
+ * Writer thread, encodes queued bitmaps and writes them in large batches
+ */
+static void *
+writerMain(void *arg)
+{
+  struct writer *w = (struct writer*)arg;
+  struct record rec;
+  struct slot *slot;
+  uint8_t *dest;
+  int ok;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;)
+  {
+    while (!w->quit && w->head == w->tail)
+    {
+      pthread_cond_wait(&w->filled, &w->lock);
+    }
+
+    if (w->head == w->tail)
+    {
+      break;
+    }
+
+    slot = &w->slots[w->tail % WRITER_SLOTS];
+    pthread_mutex_unlock(&w->lock);
+
+    memcpy(rec.magic, "EDGE", 4);
+    rec.encoding = w->encoding;
+    rec.width = w->width;
+    rec.height = w->height;
+    rec.stream = slot->stream;
+    rec.frame = slot->frame;
+    dest = w->out + w->used;
+    rec.size = encode(w, slot->bits, dest + sizeof(rec));
+    memcpy(dest, &rec, sizeof(rec));
+    w->used += sizeof(rec) + rec.size;
+
+    pthread_mutex_lock(&w->lock);
+    w->tail++;
+    pthread_cond_signal(&w->drained);
+
+    /* Write once a batch is full or nothing else is queued, after a
+       failure records are only drained */
+    if (w->used >= WRITER_BATCH || w->head == w->tail)
+    {
+      pthread_mutex_unlock(&w->lock);
+      ok = w->failed || flush(w);
+      w->used = 0;
+      pthread_mutex_lock(&w->lock);
+      if (!ok)
+      {
+        fprintf(stderr, "Writer: Cannot write edges (%s)\n",
+                strerror(errno));
+        w->failed = 1;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/**
+ * Opens the destination and starts the writer thread
+ * @param path File or FIFO, - for stdout, tcp:HOST:PORT for a socket
+ * @param width Pixels of a row, at most 65535 for the 16 bit encodings
+ * @param height Rows of a bitmap
+ */
+int
+initWriter(struct writer *w, const char *path, enum encoding encoding,
+           uint32_t width, uint32_t height)
+{
+  size_t bits, payload;
+  uint32_t i;
+
+  memset(w, 0, sizeof(*w));
+  w->fd = -1;
+  if (width > 0xFFFF || height > 0xFFFF)
+  {
+    fprintf(stderr, "Writer: Frames are too large to encode\n");
+    return 0;
+  }
+
+  w->encoding = encoding;
+  w->width = width;
+  w->height = height;
+  w->words = (width + 31) / 32;
+
+  if (!strcmp(path, "-"))
+  {
+    w->fd = dup(STDOUT_FILENO);
+  }
+  else if (!strncmp(path, "tcp:", 4))
+  {
+    w->fd = connectTo(path + 4);
+  }
+  else
+  {
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+
+  if (w->fd < 0)
+  {
+    fprintf(stderr, "Writer: Cannot open '%s'\n", path);
+    return 0;
+  }
+
+  /* Room for a full batch and the largest record that overflows it */
+  bits = w->words * 4 * height;
+  payload = encoding == ENCODING_BITS ? bits :
+            encoding == ENCODING_RUNS ? (size_t)(width + 2) * 2 * height :
+            (size_t)width * height * 4;
+  w->capacity = WRITER_BATCH + sizeof(struct record) + payload;
+  if (!(w->out = (uint8_t*)malloc(w->capacity)))
+  {
+    return 0;
+  }
+
+  for (i = 0; i < WRITER_SLOTS; ++i)
+  {
+    if (!(w->slots[i].bits = (uint32_t*)malloc(bits)))
+    {
+      return 0;
+    }
+  }
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->filled, NULL);
+  pthread_cond_init(&w->drained, NULL);
+  if (pthread_create(&w->thread, NULL, writerMain, w) != 0)
+  {
+    pthread_cond_destroy(&w->drained);
+    pthread_cond_destroy(&w->filled);
+    pthread_mutex_destroy(&w->lock);
+    return 0;
+  }
+
+  w->started = 1;
+  return 1;
+}
+
+/**
+ * Queues the edges of a frame, waits if the writer fell behind so no
+ * frame is lost
+ * @param frame Sequence number of the frame
+ * @param stream Stream of the batch the bitmap belongs to
+ * @param bits Bitmap rows, pitch bytes apart
+ * @return 0 once writing failed
+ */
+int
+pushEdges(struct writer *w, uint64_t frame, uint32_t stream,
+          const uint32_t *bits, size_t pitch)
+{
+  struct slot *slot;
+  uint32_t y;
+  int failed;
+
+  pthread_mutex_lock(&w->lock);
+  while (w->head - w->tail >= WRITER_SLOTS && !w->failed)
+  {
+    pthread_cond_wait(&w->drained, &w->lock);
+  }
+  failed = w->failed;
+  pthread_mutex_unlock(&w->lock);
+
+  if (failed)
+  {
+    return 0;
+  }
+
+  /* Only the producer touches free slots */
+  slot = &w->slots[w->head % WRITER_SLOTS];
+  slot->frame = frame;
+  slot->stream = stream;
+  for (y = 0; y < w->height; ++y)
+  {
+    memcpy(slot->bits + y * w->words, (const uint8_t*)bits + y * pitch,
+           w->words * 4);
+  }
+
+  pthread_mutex_lock(&w->lock);
+  w->head++;
+  pthread_cond_signal(&w->filled);
+  pthread_mutex_unlock(&w->lock);
+  return 1;
+}
+
+/**
+ * Writes what is still queued and closes the destination
+ */
+void
+destroyWriter(struct writer *w)
+{
+  uint32_t i;
+
+  if (w->started)
+  {
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_signal(&w->filled);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    pthread_cond_destroy(&w->drained);
+    pthread_cond_destroy(&w->filled);
+    pthread_mutex_destroy(&w->lock);
+  }
+
+  for (i = 0; i < WRITER_SLOTS; ++i)
+  {
+    free(w->slots[i].bits);
+    w->slots[i].bits = NULL;
+  }
+
+  free(w->out);
+  w->out = NULL;
+
+  if (w->fd >= 0)
+  {
+    close(w->fd);
+    w->fd = -1;
+  }
+}
@@ -0,0 +1,76 @@
+#ifndef __HOG_WRITER_H__
+#define __HOG_WRITER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* Frames queued for the writer thread */
+#define WRITER_SLOTS 16
+/* Output is gathered up to this size before it is written */
+#define WRITER_BATCH (1 << 20)
+
+/* Encodings of the edge records */
+enum encoding
+{
+  /* Rows of 32 bit words, bit x % 32 of word x / 32 is pixel x */
+  ENCODING_BITS,
+  /* Rows of a 16 bit run count and 16 bit runs, starting with non edges */
+  ENCODING_RUNS,
+  /* 16 bit x and y of every edge pixel, in row order */
+  ENCODING_POINTS
+};
+
+/* Header of every record, in host byte order */
+struct record
+{
+  char magic[4];
+  uint32_t encoding;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stream;
+  uint32_t size;
+  uint64_t frame;
+};
+
+/* Edge bitmap waiting to be encoded */
+struct slot
+{
+  uint32_t *bits;
+  uint64_t frame;
+  uint32_t stream;
+};
+
+struct writer
+{
+  /* Destination, a file, FIFO, stdout or TCP socket */
+  int fd;
+  enum encoding encoding;
+  uint32_t width;
+  uint32_t height;
+  size_t words;
+
+  /* Ring of bitmaps, the producer waits for a free slot */
+  struct slot slots[WRITER_SLOTS];
+  uint32_t head;
+  uint32_t tail;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t drained;
+  pthread_t thread;
+  int started;
+  int quit;
+  int failed;
+
+  /* Encoded records not written yet */
+  uint8_t *out;
+  size_t used;
+  size_t capacity;
+};
+
+int initWriter(struct writer *, const char *, enum encoding, uint32_t,
+               uint32_t);
+int pushEdges(struct writer *, uint64_t, uint32_t, const uint32_t *, size_t);
+void destroyWriter(struct writer *);
+
+#endif /*__HOG_WRITER_H__*/